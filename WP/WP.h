@@ -1,18 +1,27 @@
 // Definitions used by the Arduino Uno Weather_Probe code, WS.ino
 //
-#define Vers "WP5.3 DB3.0"    // <Code-version> <Database-version>
+#define Vers "WP5.4 DB3.0"    // <Code-version> <Database-version>
                               // DB version may be used to create
                               // sqlite3 DB CREATE/INSERT strings,
                               // so be sure to update its version
                               // number if you change the DB
                               // structure below
 
-typedef enum rptMode {none=0, report, csv, xml} rptModes;
+typedef enum rptMode {none=0, report, csv, xml, binary} rptModes;
 typedef enum cmdTypes {vers=0, csample, creport, ccsv, cxmlstart, 
-		       cxmlstop, cwhoru, chelp, csettime, crestart,  noCmd} cmds;
+		       cxmlstop, cwhoru, chelp, csettime, crestart, cbinary,
+		       cbaudok, cbaud, cstream, clatest, noCmd} cmds;
+// "baudok" must precede "baud" since commands are matched by prefix
 static const String cmdNames[] = {"version","sample", "report", "csv", 
 				  "xmlstart", "xmlstop", "whoru", "help",
-				  "settime", "restart", "unrecognized"};
+				  "settime", "restart", "binary", "baudok",
+				  "baud", "stream", "latest", "unrecognized"};
+
+// Serial link rates
+#define BAUD_DEFAULT 9600     // rate at startup; ws always connects at this rate
+#define BAUD_CONFIRM 3000     // msec to wait for "baudok" after "baud <rate>"
+                              // before going back to the previous rate
+                              // (baudConfirmMs in src/WS.h)
 
 // Chronodot RTC
                               // VCC to Uno 5v, GND to Uno GND
@@ -29,7 +38,9 @@ static const String cmdNames[] = {"version","sample", "report", "csv",
 #define cs  10                // CS to pin 10
 #define dc   9                // RS/DC to pin 9
 #define rst  8                // Reset to pin 8
-#define UPDATE_DELAY 60000    // update TFT every 60 sec if no Pi command comes in
+#define UPDATE_DELAY 60000    // sample and update TFT every 60 sec if no Pi command
+                              //   has; "latest" reports the last of those samples
+#define STREAM_MAX 3600       // longest "stream <seconds>" period, in seconds
 #define TFT_BLACK 0,0,0
 #define TFT_WHITE 255,255,255
 typedef enum tftTYPE { tftMISSING=0, tftST7735R, tftILI9163C } tftTYPE; // see Prentice
@@ -64,6 +75,16 @@ uint8_t sampleRate=S_128;     // Sample 128 times for each MPL3115A2 reading
                               //   https://www.starpath.com/downloads/calibration_procedure.pdf
 #define MY_CALIB_CORR 3.5*100 // millibars-> Pascals, calibrated for my MPL: replace with yours
 #define FT_PER_METER 3.28084  // conversion
+#define MPL_ADDRESS  0x60     // its I2C address and registers, for starting a reading
+#define MPL_STATUS   0x00     //   and seeing when it's ready without waiting on it
+#define MPL_PDR      0x04     //   STATUS: new pressure/altitude data ready
+#define MPL_OUT_P    0x01     //   OUT_P (3 bytes) and OUT_T (2): the reading, for collecting it
+#define MPL_CTRL_REG1 0x26
+#define MPL_ALT      0x80     //   CTRL_REG1: altimeter, not barometer, mode
+#define MPL_OST      0x02     //   CTRL_REG1: take one reading now
+#define MPL_P0   101326.0     // sea-level pressure, Pa, the MPL reckons altitude from
+#define MPL_WAIT     1100     // msec after which to collect a reading even if not flagged
+                              //   ready (about 512 msec at 128x oversampling)
 
 void     (* restartFunc) (void) = 0;  // declare restart function at address 0
 uint32_t readwrite8(uint8_t cmd, uint8_t bits, uint8_t dummy);
@@ -105,3 +126,41 @@ struct recordValues {
   struct dhtReadings dht;
   struct dsReadings ds18;
     };
+
+// A sample being taken: its sensors' conversions run side by side while
+// loop() goes on answering commands, and each reading is collected as it
+// becomes ready (see startSample() and pollSample() in WP.ino)
+struct sampleState {
+  boolean busy;                 // started, not yet all collected
+  boolean forPi, forStream;     // when done, report it: "sample" asked, or push it
+  boolean mplDone, dhtDone;
+  int     dsNext;               // next DS18 to collect; dsCount when all are
+  long    started;              // millis() when the conversions were started
+  struct recordValues rec;
+    };
+
+// Binary sample frame, sent for each sample in "binary" report mode.
+// ws decodes it with the same layout, defined again in src/WS.h:
+// change the two together, and bump frameVersion if the layout changes.
+//   bytes  0-1  frameMagic0, frameMagic1
+//          2    frameVersion
+//          3    framePayloadLen
+//          4-5  year                      uint16
+//          6-10 month, day, hour, min, sec uint8 each
+//         11-14 MPL pressure, Pa          int32
+//         15-16 MPL temperature, 0.1F     int16
+//         17-18 MPL altitude, 0.1m        int16
+//         19-20 DHT22 temperature, 0.1F   int16
+//         21    DHT22 RH, %               uint8
+//         22-37 DS18 x DSMAX: label (2 chars), temperature 0.1F int16
+//         38-39 CRC-16/CCITT (poly 0x1021, init 0xFFFF) of bytes 2-37
+// Multi-byte values are little-endian.  A reading that failed (NaN, as
+// the DHT library returns) is sent as the "no reading" value of its field.
+#define frameMagic0     0xA5
+#define frameMagic1     0x5A
+#define frameVersion    1
+#define framePayloadLen 34
+#define frameLen        (4+framePayloadLen+2)
+#define frameNoReading32 ((int32_t) 0x80000000)  // no reading: int32 fields
+#define frameNoReading16 ((int16_t) 0x8000)      //   int16 fields
+#define frameNoReadingRH 0xFF                    //   RH
@@ -1,4 +1,4 @@
-/* Weather_Probe V5.3
+/* Weather_Probe V5.4
  
    In response to queries from a USB-connected Raspberry Pi, gather
    and report back meterological  data using the DS18B20 temp sensor,
@@ -32,6 +32,24 @@
 
    Code and revisions to this program by HDTodd:
 
+  V5.4
+    Add "binary" report mode: each sample is sent as one fixed-layout,
+    CRC-checked frame (see WP.h) for ws to decode, rather than as text.
+    Add "baud <rate>" and "baudok" commands so ws can raise the serial
+    rate; an unconfirmed change reverts after BAUD_CONFIRM msec.
+    Add "stream <seconds>" command: the probe samples on its own timer,
+    every <seconds> (0 stops), and pushes each record, preceded by a
+    "#<sequence number>" line, without waiting to be asked.
+    Add "latest" command: reports the last sample taken, for the TFT or
+    for the Pi, at once, preceded by an "@<age in msec>" line, rather
+    than taking a new one.  Commands that don't sample no longer put
+    off the next background sample.
+    Sample without blocking: the DS18 and MPL3115A2 conversions are
+    started together and each reading is collected when it's ready,
+    while loop() goes on answering commands, so a sample takes as long
+    as its slowest sensor rather than all of them in turn, and "whoru"
+    and "version" are answered at once even mid-sample.
+
   V5.3, 2022\12\22
     Adjust pressure to be sea-level pressure using calibration 
     correction and altitude correction.  Code changes in WP.ino.
@@ -109,7 +127,10 @@ Setup and Code Management
      -DATA (yellow) = A5 with 4K7 ohm pullup resistor to VCC
  
    Usage:
-     - Serial terminal at 9600bps (edit setup() to change speed)
+     - Serial terminal at 9600bps (BAUD_DEFAULT in WP.h); "baud <rate>"
+       changes it, but reverts unless confirmed by "baudok" (see loop())
+     - "sample" reports one sample; "stream <seconds>" reports one every
+       <seconds> until "stream 0"; "latest" reports the last one taken
      - Times various sensor measurements
      - Examines status flags used to poll device for data ready
 
@@ -142,13 +163,25 @@ rptModes   rptMode=report;         // default to report mode
 dsInfo dsList[DSMAX+1];		   // max number of DS devices + loop guard
 
 boolean    haveRTC, haveDHT22, haveMPL3115, haveDS18, haveTFT;
+long       curBaud=BAUD_DEFAULT, prevBaud=BAUD_DEFAULT;  // serial rates, now and before "baud"
+long       baudMarker;             // when "baud" changed the rate
+boolean    baudPending=false;      // "baud" not yet confirmed by "baudok"
+unsigned long streamPeriod=0;      // msec between pushed samples; 0 = only when asked
+unsigned long streamSeq;           // number of the last sample pushed
+long       streamMarker;           // when the last one was due
+struct recordValues lastRec;       // the last sample taken, for "latest"
+long       lastRecAt;              //   and when
+struct sampleState smp;            // the sample being taken, if one is
 int	   dsCount;
 uint8_t    dsResMode=1;		   // use 10-bit for precision
 void getTime(char dtString[20]);
 void setTime(char *dtS);
-void readSensors(struct recordValues *rec);
+void startSample(void);
+void pollSample(void);
+void finishSample(void);
 void updateTFT(struct recordValues *rec);
 void reportOut(rptModes rptMode, struct recordValues *rec);
+void sendFrame(struct recordValues *rec);
 tftTYPE findTFT(void);
 uint32_t readwrite8(uint8_t tftCmd, uint8_t tftBits, uint8_t TFTDummy);
 /* following booleans cause sampling to be triggered on the
@@ -170,7 +203,7 @@ void setup(void) {
   digitalWrite(samplingLED, LOW);
 
   // start serial port
-  Serial.begin(9600,SERIAL_8N1);
+  Serial.begin(BAUD_DEFAULT,SERIAL_8N1);
   Serial.println("WP starting");
 /*
   Do not reorder the following module startup sequences.  Some
@@ -291,13 +324,22 @@ void setup(void) {
  * loop() procedure
  -----------------------------------------------------------------
  * In main loop, make a first pass to collect data from the sensors
- * and display it on the TFT.  Then wait for at most 'UPDATE_DELAY' 
- * msec, waiting for a command from the Pi.  If we get a command, 
- * act on it.  If it causes a data sampling (and TFT update), reset 
- * the timer.  It it doesn't cause a data sampling, go back into the 
- * loop to wait for the timer expiration.  If the timer expires 
- * (with no command having come in), just go through the loop to 
- * collect sensor data and update the TFT
+ * and display it on the TFT.  Then wait until 'UPDATE_DELAY' msec
+ * after that sampling, waiting for a command from the Pi.  If we get
+ * a command, act on it.  If it causes a data sampling (and TFT
+ * update), reset the timer.  It it doesn't cause a data sampling,
+ * go back into the loop to wait for the timer expiration.  If the
+ * timer expires (with no command having come in), just go through the
+ * loop to collect sensor data and update the TFT; "latest" reports
+ * the last of those samples without taking another.
+ * Sampling doesn't hold up the loop: a sample is started, and while we
+ * wait for the next command pollSample() collects each sensor's reading
+ * as it's ready, and reports the sample, if it's been asked for, once
+ * they all are.
+ * After "stream <seconds>", the timeout is that period instead, and is
+ * measured from when the last sample was due rather than from when it
+ * was taken, so the samples don't drift; each sample it triggers is
+ * also reported, numbered, to the Pi.
  */
 void loop(void) { 
   long marker;
@@ -305,15 +347,32 @@ void loop(void) {
   int cmd=noCmd;
   boolean foundCmd=false;
   String cmdString;
-  struct recordValues rec;
+  long newBaud, secs, period;
   
 /* Note start time for loop metrics and for timeout monitoring */
-  marker = startTime = millis();   // Time the loop & note time for elapsed
+  startTime = millis();            // Time the loop & note time for elapsed
+  if (streamPeriod > 0) {          // streaming: time from the last sample due
+    marker = streamMarker;
+    period = streamPeriod;
+  } else {                         // else from the last sample started
+    marker = smp.started;
+    period = UPDATE_DELAY;
+  };
 
-/* Now wait for either timeout or a typed-in command */
+/* Now wait for either timeout or a typed-in command.  If a rate change
+   hasn't been confirmed in time, the host can't hear us: go back.      */
   while (!timedOut && !gotCmd) {
     while (!(gotCmd=(Serial.available() > 0))    // get response or timeout
-           && !(timedOut=((millis()-marker) > UPDATE_DELAY))) delay(1);  
+           && !(timedOut=((millis()-marker) > period))) {
+      if (baudPending && (millis()-baudMarker) > BAUD_CONFIRM) {
+        baudPending = false;
+        curBaud = prevBaud;
+        Serial.end();
+        Serial.begin(curBaud,SERIAL_8N1);
+      };
+      if (smp.busy) pollSample();  // collect what's ready of the sample
+        else delay(1);
+    };
 
 /* Something happened -- timeout or command received? */
   if (gotCmd) {                       //  we received a command: get and parse it
@@ -336,16 +395,63 @@ void loop(void) {
       Serial.println(Vers);
       break;
     case csample:
-      readSensors(&rec);
-      updateTFT(&rec);
-      if (!timedOut) reportOut(rptMode, &rec);
-      break;                       // leave cmd/delay loop and go do sample
+      if (timedOut && streamPeriod>0) {          // next one is due a period after this one,
+        streamMarker += streamPeriod;            //   unless we've fallen a period behind
+        if ((millis()-streamMarker) > streamPeriod) streamMarker = millis();
+      };
+      if (!smp.busy) startSample();              // else the one under way will do
+      if (!timedOut) smp.forPi = true;
+        else if (streamPeriod>0) smp.forStream = true;
+      break;                       // leave cmd/delay loop; pollSample() finishes it
+    case clatest:                  // the last sample, without waiting for a new one
+      if (rptMode == none) break;
+      while (smp.busy && lastRec.cd.dt[0] == 0) pollSample();  // (unless there's none yet)
+      Serial.print('@');           // msec since it was taken
+      Serial.println(millis()-lastRecAt);
+      reportOut(rptMode, &lastRec);
+      break;
     case creport:
       rptMode = report;
       break;
     case ccsv:
       rptMode = csv;
       break;
+    case cbinary:
+      rptMode = binary;
+      break;
+    case cbaud:                    // acknowledge at the old rate, then switch
+      newBaud = cmdString.substring(5).toInt();
+      if (newBaud!=9600 && newBaud!=115200 && newBaud!=230400 && newBaud!=500000) {
+        Serial.println(F("[?WP] Unsupported baud rate"));
+        break;
+      };
+      Serial.print(F("[%WP] baud "));
+      Serial.println(newBaud);
+      Serial.flush();              // wait for that to go out
+      prevBaud = curBaud;
+      curBaud = newBaud;
+      Serial.end();
+      Serial.begin(curBaud,SERIAL_8N1);
+      baudPending = true;
+      baudMarker = millis();
+      break;
+    case cstream:                  // sample on our own timer and push each one
+      secs = cmdString.substring(7).toInt();     // 0 stops
+      if (secs<0 || secs>STREAM_MAX) {
+        Serial.println(F("[?WP] Unsupported stream period"));
+        break;
+      };
+      Serial.print(F("[%WP] stream "));
+      Serial.println(secs);
+      streamPeriod = secs*1000L;
+      streamSeq = 0;
+      streamMarker = millis();     // first one a period from now, after ws has
+                                   //   had time to set the report mode
+      break;
+    case cbaudok:                  // host hears us fine at the new rate
+      baudPending = false;
+      Serial.println(F("[%WP] baudok"));
+      break;
     case cxmlstart:
       rptMode = xml;
       Serial.println(F("<?xml version=\"1.0\" ?>"));
@@ -469,9 +575,63 @@ void reportOut(rptModes rptMode, struct recordValues *rec) {
 
     Serial.println(F("</sample>"));      
     break;
+
+  case binary:                 // one CRC-checked binary frame for ws
+    sendFrame(rec);
+    break;
   };				// end switch (rptMode)
 };				// end void reportOut()
 
+// store 16- and 32-bit values little-endian into a frame; return next byte
+static uint8_t *put16(uint8_t *p, int16_t v) {
+  *p++ = v & 0xFF; *p++ = (v>>8) & 0xFF;
+  return p;
+};
+static uint8_t *put32(uint8_t *p, int32_t v) {
+  return put16(put16(p, v & 0xFFFF), (v>>16) & 0xFFFF);
+};
+// a reading in tenths, or frameNoReading16 if it failed: converting NaN
+// to an integer is undefined, and would send a made-up reading
+static int16_t tenths(float v) {
+  return isnan(v) ? frameNoReading16 : (int16_t) round(v*10);
+};
+
+// CRC-16/CCITT, poly 0x1021, init 0xFFFF (same as crc16() in ws)
+uint16_t crc16(const uint8_t *p, uint8_t n) {
+  uint16_t crc = 0xFFFF;
+  while (n--) {
+    crc ^= (uint16_t)(*p++) << 8;
+    for (uint8_t i=0; i<8; i++) crc = (crc & 0x8000) ? (crc<<1) ^ 0x1021 : crc<<1;
+  };
+  return crc;
+};
+
+// Sends the sample as a single binary frame, laid out as described in WP.h:
+// about 40 bytes rather than the 100-700 of the text report modes
+void sendFrame(struct recordValues *rec) {
+  uint8_t frame[frameLen], *p = frame;
+  char *dt = rec->cd.dt;           // "yyyy-mm-dd hh:mm:ss"
+
+  *p++ = frameMagic0;
+  *p++ = frameMagic1;
+  *p++ = frameVersion;
+  *p++ = framePayloadLen;
+  p = put16(p, (dt[0]-'0')*1000 + (dt[1]-'0')*100 + (dt[2]-'0')*10 + (dt[3]-'0'));
+  for (int i=5; i<=17; i+=3) *p++ = (dt[i]-'0')*10 + (dt[i+1]-'0');
+  p = put32(p, isnan(rec->mpl.press) ? frameNoReading32 : (int32_t) round(rec->mpl.press));
+  p = put16(p, tenths(rec->mpl.tempf));
+  p = put16(p, tenths(rec->mpl.alt));
+  p = put16(p, tenths(rec->dht.tempf));
+  *p++ = isnan(rec->dht.rh) ? frameNoReadingRH : (uint8_t) round(rec->dht.rh);
+  for (int dev=0; dev<DSMAX; dev++) {
+    *p++ = rec->ds18.label[dev][0];
+    *p++ = rec->ds18.label[dev][1];
+    p = put16(p, tenths(rec->ds18.tempf[dev]));
+  };
+  put16(p, crc16(frame+2, framePayloadLen+2));
+  Serial.write(frame, frameLen);
+};				// end void sendFrame()
+
 // sets the Chronodot or RTC clock based on the supplied 20-character date-time string
 // input string must be formatted as "yyyy-mm-dd hh:mm:ss"
 void setTime(char *dtS) {
@@ -503,53 +663,123 @@ void getTime(char dtString[20]) {
       now.hour(),now.minute(), now.second(), '\0' );;
 };
 
-void readSensors(struct recordValues *rec) {
-  uint8_t data[9];
+// Starts taking a sample: time stamps it, and starts the DS18 and MPL3115A2
+// conversions, which run at the same time; the readings are collected by
+// pollSample().  Absent sensors read as 0.
+void startSample(void) {
+  struct recordValues *rec = &smp.rec;
 
   digitalWrite(samplingLED, HIGH);	    // visual sign that we're sampling
+  smp.started = millis();
+  smp.busy = true;
+  smp.forPi = smp.forStream = false;
   // time stamp this record
   getTime(rec->cd.dt);
 
   // if we have DS18s, start reading temps now, in parallel
   if ( haveDS18 ) ds18.readAllTemps();
-  
-  if ( haveMPL3115 ) {
-  // v5.3: adjust pressure for calibration and altitude
-    rec->mpl.press = baro.readPressure()+MY_ELEV_CORR+MY_CALIB_CORR;   // Get MPL3115A2 data
-    rec->mpl.alt   = baro.readAltitude();
-    rec->mpl.tempf  = baro.readTempF();
-  }
-  else {
+  smp.dsNext = haveDS18 ? 0 : dsCount;
+  for (int dev=dsCount; dev<DSMAX; dev++) {
+    rec->ds18.tempf[dev] = 0.0;
+    rec->ds18.label[dev][0] = rec->ds18.label[dev][1] = '*';
+    rec->ds18.label[dev][2] = 0x00;
+  };
+
+  // and the MPL's reading: clear and set its one-shot bit, in barometer
+  // mode, so that OUT_P holds pressure
+  smp.mplDone = !haveMPL3115;
+  if ( haveMPL3115 && I2c.read(MPL_ADDRESS, MPL_CTRL_REG1, 1) == 0 ) {
+    uint8_t ctrl = I2c.receive() & ~(MPL_OST|MPL_ALT);
+    I2c.write(MPL_ADDRESS, MPL_CTRL_REG1, ctrl);
+    I2c.write(MPL_ADDRESS, MPL_CTRL_REG1, (uint8_t) (ctrl | MPL_OST));
+  };
+  if ( !haveMPL3115 ) {
     rec->mpl.press = 0.0;
     rec->mpl.alt   = 0.0;
     rec->mpl.tempf  = 0.0;
   };
-  
-  if ( haveDHT22 ) {
-    rec->dht.tempf = myDHT22.readTemperature(true); // Get DHT22 data with temp in Fahrenheit
-    rec->dht.rh    = myDHT22.readHumidity();
-  } else {
+
+  smp.dhtDone = !haveDHT22;
+  if ( !haveDHT22 ) {
     rec->dht.tempf = 0.0;
     rec->dht.rh    = 0.0;
   };
+};                            // end startSample
 
-// Get data for the DS18's we have, zero the rest
-  if ( haveDS18 ) {
-    ds18.waitForTemps(convDelay[(int)dsResMode]);
-    for (int dev=0; dev<dsCount; dev++) {
-      rec->ds18.tempf[dev] = CtoF(ds18.getTemperature(dsList[dev].addr, data, false));
-      rec->ds18.label[dev][0] = data[2];
-      rec->ds18.label[dev][1] = data[3];
-      rec->ds18.label[dev][2] = 0x00;
+// Collects one reading of the sample being taken, if one is ready, and
+// returns: called each time round loop()'s wait for a command, so that no
+// step keeps a command waiting long.  Finishes the sample after the last.
+void pollSample(void) {
+  struct recordValues *rec = &smp.rec;
+  uint8_t data[9];
+
+  if ( !smp.dhtDone ) {       // a few msec to read: nothing to wait for
+    rec->dht.tempf = myDHT22.readTemperature(true); // Get DHT22 data with temp in Fahrenheit
+    rec->dht.rh    = myDHT22.readHumidity();
+    smp.dhtDone = true;
+    return;
+  };
+
+  if ( !smp.mplDone ) {       // ready once it flags new data
+    boolean ready = (millis()-smp.started) > MPL_WAIT;
+    if ( !ready && I2c.read(MPL_ADDRESS, MPL_STATUS, 1) == 0 )
+      ready = (I2c.receive() & MPL_PDR) != 0;
+    if ( ready ) {
+  // Read the one-shot's result from OUT_P and OUT_T ourselves: the library's
+  // readPressure() etc. each start a reading of their own and wait for it.
+  // Pressure is Q18.2 Pa and temperature Q8.4 C, each left-justified.
+      if ( I2c.read(MPL_ADDRESS, MPL_OUT_P, 5) == 0 ) {
+        uint32_t p = (uint32_t) I2c.receive() << 16;
+        p |= (uint32_t) I2c.receive() << 8;
+        p |= I2c.receive();
+        int16_t t = (int16_t) ((uint16_t) I2c.receive() << 8);
+        t |= I2c.receive();
+        float pa = p / 64.0;
+  // v5.3: adjust pressure for calibration and altitude
+        rec->mpl.press = pa+MY_ELEV_CORR+MY_CALIB_CORR;
+  // the altitude the MPL would give, from the same reading, by its formula
+        rec->mpl.alt   = 44330.77*(1.0-pow(pa/MPL_P0, 0.1902632));
+        rec->mpl.tempf = CtoF(t / 256.0);
+      }
+      else {                  // lost it: record it as absent
+        rec->mpl.press = 0.0;
+        rec->mpl.alt   = 0.0;
+        rec->mpl.tempf = 0.0;
+      };
+      smp.mplDone = true;
+      return;
     };
   };
-  for (int dev=dsCount; dev<DSMAX; dev++) {
-    rec->ds18.tempf[dev] = 0.0;
-    rec->ds18.label[dev][0] = rec->ds18.label[dev][1] = '*';
+
+// Get data for the DS18's we have, one per call, once converted
+  if ( smp.dsNext < dsCount ) {
+    if ( (millis()-smp.started) < convDelay[(int)dsResMode] ) return;
+    int dev = smp.dsNext++;
+    rec->ds18.tempf[dev] = CtoF(ds18.getTemperature(dsList[dev].addr, data, false));
+    rec->ds18.label[dev][0] = data[2];
+    rec->ds18.label[dev][1] = data[3];
     rec->ds18.label[dev][2] = 0x00;
+    return;
   };
+
+  if ( smp.mplDone ) finishSample();
+};                            // end pollSample
+
+// All the readings are in: show the sample, keep it for "latest", and
+// report it if it was asked for or is to be pushed
+void finishSample(void) {
   digitalWrite(samplingLED, LOW);
-};                            // end readSensors
+  smp.busy = false;
+  updateTFT(&smp.rec);
+  lastRec = smp.rec;                        // keep it for "latest"
+  lastRecAt = smp.started;                  //   as old as its time stamp
+  if (smp.forStream && rptMode!=none) {     // push it, numbered, so the Pi can
+    Serial.print('#');                      //   tell if it missed any
+    Serial.println(++streamSeq);
+    reportOut(rptMode, &smp.rec);
+  }
+  else if (smp.forPi) reportOut(rptMode, &smp.rec);
+};                            // end finishSample
 
 void updateTFT(struct recordValues *rec) {
   static char ts[21];                     // temp string for conversions
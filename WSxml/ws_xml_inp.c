@@ -14,14 +14,19 @@
  * purpose: Parse a file to a tree, use xmlDocGetRootElement() to
  *          get the root element, then walk the document and print
  *          all the samples in document order.
- * usage: ws_xml_inp filename
+ * usage: ws_xml_inp [-s | -f] filename
+ *   -s streams the file instead (see ws_xml_stream.c): constant memory,
+ *      rows printed as samples are read, and "-" reads stdin
+ *   -f streams a file that ws is still writing, following it as it grows
  * xml parsing code author: Dodji Seketeli
  * copy: see Copyright for the status of this software.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include "ws_xml_stream.h"
 
 xmlNode* find_element(xmlNode * a_node, xmlChar * target);
 xmlNode* find_content(xmlNode * anode);
@@ -35,12 +40,26 @@ int main(int argc, char **argv) {
     xmlNode *root_element = NULL, *samples_tree, *sample, *mpl, *dht, *ds18;
     xmlChar *date_time, *mpl_press, *mpl_temp, *dht_temp, *dht_rh;
     xmlChar *db_temp, *db_loc;
+    int c, stream = 0, follow = 0;
     
-    if (argc != 2) {
+    while ( (c=getopt(argc, argv, "sf")) != -1 )
+      switch (c) {
+      case 'f':
+        follow = 1;                       /* and stream */
+      case 's':
+        stream = 1;
+        break;
+      default:
+        argc = 0;
+      };
+    if (argc - optind != 1) {
       printf("Weather Station XML-input processing program\n");
-      printf("Usage: ws_xml_inp <filename>\n");
+      printf("Usage: ws_xml_inp [-s | -f] <filename>\n");
+      printf("\t-s streams the file (\"-\" for stdin) in constant memory\n");
+      printf("\t-f streams and follows a file that ws is writing\n");
       return(1);
     };
+    argv += optind-1;                     /* the file is argv[1], as before */
     
     /*
      * This macro initializes the library and checks potential ABI mismatches
@@ -49,6 +68,12 @@ int main(int argc, char **argv) {
      */
     LIBXML_TEST_VERSION
     
+    if (stream) {
+      c = stream_samples(argv[1], follow);
+      xmlCleanupParser();
+      return(c);
+    }
+
     /* Parse the file, validate the xml against the DTD, and get the DOM */
     doc = xmlReadFile(argv[1], NULL, XML_PARSE_DTDVALID | XML_PARSE_NOBLANKS);
     
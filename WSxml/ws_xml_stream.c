@@ -0,0 +1,286 @@
+/**
+ * ws_xml_stream.c
+ * Streaming reader for Weather Station XML data files, for ws_xml_inp -s.
+ *
+ * David Todd, for use with the WeatherStation system
+ *
+ * Rather than building the whole document in memory and walking it, as
+ * ws_xml_inp does by default, this feeds the file in pieces to libxml2's
+ * SAX push parser, which builds no tree at all: each sample's fields are
+ * collected as the parser reports them, and the sample is written out as
+ * its CSV row as soon as its </sample> has been read.  So memory use
+ * doesn't depend on the size of the file, and the rows of a file being
+ * piped in appear as the samples arrive.  gzip'd files (from ws -r) are
+ * read as they are.
+ *
+ * With -f, a file that ws is still writing is followed, like "tail -f".
+ * ws keeps the file a complete document by writing "</samples>" after each
+ * sample and writing the next sample over it, so the parser is fed the
+ * file only up to that trailer, and we wait there for the next sample.
+ * When ws rotates the file (ws -r), the old one is finished and the new
+ * one is followed from its start.
+ *
+ * The DTD isn't loaded or checked in this mode; use 'xmllint --valid'.
+ *
+ * read_samples() does the reading and hands each sample to a function of
+ * the caller's; ws uses it, through read_gz_samples(), to import XML
+ * archives (ws import) from a file it has already opened and looked into.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <libxml/parser.h>
+#include "ws_xml_stream.h"
+
+#define FOLLOW_WAIT 500000              /* usec between looks at a followed file */
+#define TRAILER "</samples>"
+#define CHUNK 16384                     /* bytes handed to the parser at a time */
+
+/* The parser's state: the sample being read, the field whose text the
+   parser is reporting, and where completed samples go                     */
+struct parse_state {
+    struct sample s;
+    char *field;
+    long count;
+    void (*emit)(struct sample *s, void *arg);
+    void *arg;
+};
+
+/* State of a followed file */
+struct follow {
+    char *name;
+    int fd;
+    ino_t ino;
+    off_t pos;
+};
+
+/**
+ * True if the file being followed is no longer the one under its name,
+ * i.e., ws has rotated it
+ **/
+static int rotated(struct follow *f) {
+    struct stat st;
+
+    return( stat(f->name, &st) < 0 || st.st_ino != f->ino );
+}
+
+/**
+ * Reads the next piece of a followed file.  Hands over what's in
+ * the file up to the "</samples>" trailer (or the end), holding back
+ * anything at the end that might be the start of the trailer, and waits
+ * for more when there's nothing else to give.  The trailer itself is
+ * given only once the file has been rotated.
+ **/
+static int follow_read(struct follow *f, char *buf, int len) {
+    char *t;
+    int n, k;
+
+    while (1) {
+        if ( (n=pread(f->fd, buf, len, f->pos)) < 0 ) return(-1);
+        if ( n > 0 && rotated(f) ) {     /* finished: all of it, trailer too */
+            f->pos += n;
+            return(n);
+        }
+        if ( (t=memmem(buf, n, TRAILER, strlen(TRAILER))) != NULL ) n = t-buf;
+        else                              /* hold back a partial trailer */
+            for (k = n > (int) strlen(TRAILER) ? n-strlen(TRAILER) : 0; k<n; k++)
+                if (buf[k] == '<' && strncmp(buf+k, TRAILER, n-k) == 0) {
+                    n = k;
+                    break;
+                }
+        if (n > 0) {
+            f->pos += n;
+            return(n);
+        }
+        if ( rotated(f) ) return(0);     /* rotated away with nothing left */
+        usleep(FOLLOW_WAIT);
+    }
+}
+
+/**
+ * Opens the file to follow, waiting for ws to create it if necessary
+ **/
+static void follow_open(struct follow *f) {
+    struct stat st;
+
+    while ( (f->fd=open(f->name, O_RDONLY)) < 0 || fstat(f->fd, &st) < 0 ) {
+        if (f->fd >= 0) close(f->fd);
+        usleep(FOLLOW_WAIT);
+    }
+    f->ino = st.st_ino;
+    f->pos = 0;
+}
+
+/**
+ * Prints a completed sample in the same form as ws_xml_inp's DOM mode
+ **/
+static void print_sample(struct sample *s, void *arg) {
+    int i;
+
+    printf("(%s", s->date_time);
+    if (s->have_mpl) printf(",%s,%s", s->mpl_press, s->mpl_temp);
+    if (s->have_dht) printf(",%s,%s", s->dht_temp, s->dht_rh);
+    for (i=0; i<s->n_ds18; i++) printf(",%s,%s", s->ds18_lbl[i], s->ds18_temp[i]);
+    printf(")\n");
+    fflush(stdout);
+}
+
+/**
+ * SAX callbacks: an element starts, its text arrives (perhaps in pieces),
+ * and it ends
+ **/
+static void start_element(void *ctx, const xmlChar *name, const xmlChar *prefix,
+                          const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces,
+                          int nb_attributes, int nb_defaulted, const xmlChar **attributes) {
+    struct parse_state *ps = (struct parse_state *) ctx;
+    struct sample *s = &ps->s;
+    const char *n = (const char *) name;
+
+    ps->field = NULL;
+    if      (strcmp(n, "sample") == 0) memset(s, 0, sizeof(*s));
+    else if (strcmp(n, "MPL3115A2") == 0) s->have_mpl = 1;
+    else if (strcmp(n, "DHT22") == 0)     s->have_dht = 1;
+    else if (strcmp(n, "DS18") == 0 && s->n_ds18 < DS18_MAX) s->n_ds18++;
+    else if (strcmp(n, "source_loc") == 0) ps->field = s->source_loc;
+    else if (strcmp(n, "date_time") == 0) ps->field = s->date_time;
+    else if (strcmp(n, "mpl_press") == 0) ps->field = s->mpl_press;
+    else if (strcmp(n, "mpl_temp") == 0)  ps->field = s->mpl_temp;
+    else if (strcmp(n, "dht_temp") == 0)  ps->field = s->dht_temp;
+    else if (strcmp(n, "dht_rh") == 0)    ps->field = s->dht_rh;
+    else if (strcmp(n, "ds18_lbl") == 0 && s->n_ds18 > 0)  ps->field = s->ds18_lbl[s->n_ds18-1];
+    else if (strcmp(n, "ds18_temp") == 0 && s->n_ds18 > 0) ps->field = s->ds18_temp[s->n_ds18-1];
+}
+
+static void characters(void *ctx, const xmlChar *ch, int len) {
+    struct parse_state *ps = (struct parse_state *) ctx;
+    int have;
+
+    if (ps->field == NULL) return;
+    have = strlen(ps->field);
+    if (len > FIELD_MAX-1-have) len = FIELD_MAX-1-have;
+    memcpy(ps->field+have, ch, len);
+    ps->field[have+len] = 0;
+}
+
+static void end_element(void *ctx, const xmlChar *name, const xmlChar *prefix,
+                        const xmlChar *URI) {
+    struct parse_state *ps = (struct parse_state *) ctx;
+
+    ps->field = NULL;
+    if (strcmp((const char *) name, "sample") == 0) {
+        ps->emit(&ps->s, ps->arg);
+        ps->count++;
+    }
+}
+
+/**
+ * Readies the SAX handler and parser state to hand samples to emit(sample, arg)
+ **/
+static void init_parse(xmlSAXHandler *sax, struct parse_state *ps,
+                       void (*emit)(struct sample *s, void *arg), void *arg) {
+    memset(sax, 0, sizeof(*sax));
+    sax->initialized = XML_SAX2_MAGIC;
+    sax->startElementNs = start_element;
+    sax->endElementNs = end_element;
+    sax->characters = characters;
+    memset(ps, 0, sizeof(*ps));
+    ps->emit = emit;
+    ps->arg = arg;
+}
+
+/**
+ * Reads the samples in "filename" ("-" for stdin) and hands each one, as
+ * it is completed, to emit(sample, arg).  With "follow", keeps reading as
+ * ws adds to the file, and through its rotations, until killed.  Sets
+ * *count to the number of samples read, and returns 0, or 1 if the file
+ * can't be opened, or 2 if it is not well-formed.
+ **/
+int read_samples(char *filename, int follow, void (*emit)(struct sample *s, void *arg),
+                 void *arg, long *count) {
+    static char buf[CHUNK];
+    xmlSAXHandler sax;
+    xmlParserCtxtPtr ctxt;
+    struct parse_state ps;
+    struct follow f;
+    gzFile in = NULL;
+    int n, err, from_stdin = (strcmp(filename, "-") == 0);
+
+    if (from_stdin) follow = 0;
+    init_parse(&sax, &ps, emit, arg);
+    *count = 0;
+    do {
+        if (follow) {
+            f.name = filename;
+            follow_open(&f);
+        }
+        else if ( !from_stdin && (in=gzopen(filename, "rb")) == NULL )
+            return(1);
+        ctxt = xmlCreatePushParserCtxt(&sax, &ps, NULL, 0, filename);
+        xmlCtxtUseOptions(ctxt, XML_PARSE_NONET);
+        do {
+            if (follow) n = follow_read(&f, buf, sizeof(buf));
+            else if (from_stdin) n = read(0, buf, sizeof(buf));  /* what's there: don't wait to fill buf */
+            else n = gzread(in, buf, sizeof(buf));
+            err = xmlParseChunk(ctxt, buf, n > 0 ? n : 0, n <= 0);
+        } while (n > 0 && err == 0);
+        err = err || !ctxt->wellFormed || n < 0;
+        xmlFreeParserCtxt(ctxt);
+        if (follow) close(f.fd);
+        else if (!from_stdin) gzclose(in);
+        *count = ps.count;
+        if (err) return(2);
+    } while (follow);
+    return(0);
+}
+
+/**
+ * Reads the samples from "in", already open (and perhaps already read into,
+ * with the bytes read put back), to its end, handing each one to
+ * emit(sample, arg); "name" is for the parser's messages.  The caller
+ * closes "in".  Sets *count as read_samples() does, and returns 0, or 2 if
+ * the document is not well-formed or can't be read.
+ **/
+int read_gz_samples(gzFile in, char *name, void (*emit)(struct sample *s, void *arg),
+                    void *arg, long *count) {
+    static char buf[CHUNK];
+    xmlSAXHandler sax;
+    xmlParserCtxtPtr ctxt;
+    struct parse_state ps;
+    int n, err;
+
+    init_parse(&sax, &ps, emit, arg);
+    ctxt = xmlCreatePushParserCtxt(&sax, &ps, NULL, 0, name);
+    xmlCtxtUseOptions(ctxt, XML_PARSE_NONET);
+    do {
+        n = gzread(in, buf, sizeof(buf));
+        err = xmlParseChunk(ctxt, buf, n > 0 ? n : 0, n <= 0);
+    } while (n > 0 && err == 0);
+    err = err || !ctxt->wellFormed || n < 0;
+    xmlFreeParserCtxt(ctxt);
+    *count = ps.count;
+    return(err ? 2 : 0);
+}
+
+/**
+ * Streams the samples in "filename" ("-" for stdin) to stdout as CSV rows,
+ * for ws_xml_inp -s and -f.  Returns 0, or 1 if the file can't be read.
+ **/
+int stream_samples(char *filename, int follow) {
+    long count;
+
+    switch ( read_samples(filename, follow, print_sample, NULL, &count) ) {
+    case 1:
+        printf("error: could not open %s\n", filename);
+        return(1);
+    case 2:
+        printf("error: %s is not well-formed XML; stopped after %ld samples\n", filename, count);
+        printf("\tUse 'xmllint --valid %s' to validate input file\n", filename);
+        return(1);
+    }
+    return(0);
+}
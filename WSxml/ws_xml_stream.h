@@ -0,0 +1,30 @@
+/**
+ * ws_xml_stream.h
+ * The streaming Weather Station XML reader in ws_xml_stream.c, for
+ * ws_xml_inp and for ws's importer
+ **/
+#ifndef WS_XML_STREAM_H
+#define WS_XML_STREAM_H
+
+#include <zlib.h>
+
+#define FIELD_MAX 64                    /* longest field value kept */
+#define DS18_MAX   8                    /* most DS18s in one sample */
+
+/* One sample's fields, as the text in the file, and which sensors it has */
+struct sample {
+    char source_loc[FIELD_MAX];         /* the probe, in a multi-probe file; else "" */
+    char date_time[FIELD_MAX];
+    int have_mpl, have_dht, n_ds18;
+    char mpl_press[FIELD_MAX], mpl_temp[FIELD_MAX];
+    char dht_temp[FIELD_MAX], dht_rh[FIELD_MAX];
+    char ds18_lbl[DS18_MAX][FIELD_MAX], ds18_temp[DS18_MAX][FIELD_MAX];
+};
+
+int read_samples(char *filename, int follow, void (*emit)(struct sample *s, void *arg),
+                 void *arg, long *count);
+int read_gz_samples(gzFile in, char *name, void (*emit)(struct sample *s, void *arg),
+                    void *arg, long *count);
+int stream_samples(char *filename, int follow);
+
+#endif
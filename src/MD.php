@@ -8,22 +8,41 @@
 $HISTORY="'-168 hours'";	   //period of time over which to display temps
 $DB_LOC="/var/databases/"; //location of the sqlite3 db
 $DB_NAME="WeatherData.db";   //name of sqlite3 db
+$WS_API="http://localhost:8088"; //ws's HTTP server (ws -H 8088); "" to read the db
 ?>
 
 <?php
 // First, PHP code to populate an array with the [time,temp] data pairs
 //   and create a JSON array for the Javascript below
 
-$db = new PDO('sqlite:' . $DB_LOC . $DB_NAME) 
-      	  or die('Cannot open database ' . $DB_NAME);
-$query = "SELECT * FROM ProbeData  WHERE date_time>datetime('now',$HISTORY)"; 
-foreach ($db->query($query) as $row) 
-  $chart_array[]=array((string)$row['date_time'],(int)$row['mpl_press'],(int)$row['dht22_rh']); 
-$query = "SELECT * FROM ProbeData ORDER BY date_time DESC LIMIT 1";
-foreach ($db->query($query) as $row) {
-  $last_time=(string)$row['date_time'];
-  $last_temp=json_encode( (real)$row['mpl_temp']*1.8+32);
-  $last_press=json_encode( (int)$row['mpl_press'] );
+// If ws is answering HTTP, the latest sample comes from its memory and the
+//   history from its /history query, in half-hour means, without a database
+//   connection here; otherwise, read the database
+$api = $WS_API ? json_decode(@file_get_contents("$WS_API/latest?probe=0"), true) : null;
+if (!empty($api['samples'])) {
+  $s = $api['samples'][0];
+  $last_time=(string)$s['date_time'];
+  $last_temp=json_encode( (real)$s['mpl_temp']*1.8+32);
+  $last_press=json_encode( (int)$s['mpl_press'] );
+  $h1 = json_decode(@file_get_contents("$WS_API/history?field=mpl_press&start=-168h&r=30m&a=avg"), true);
+  $h2 = json_decode(@file_get_contents("$WS_API/history?field=dht22_rh&start=-168h&r=30m&a=avg"), true);
+  $byT = array();
+  foreach ((array)$h2['data'] as $p) $byT[$p[0]] = $p[1];
+  foreach ((array)$h1['data'] as $p)
+    $chart_array[]=array(date('Y-m-d H:i:s',$p[0]),(int)round($p[1]),
+                         isset($byT[$p[0]]) ? (int)round($byT[$p[0]]) : null);
+} else {
+  $db = new PDO('sqlite:' . $DB_LOC . $DB_NAME) 
+        	  or die('Cannot open database ' . $DB_NAME);
+  $query = "SELECT date_time, mpl_press, dht22_rh FROM ProbeData WHERE date_time>datetime('now',$HISTORY) ORDER BY date_time"; 
+  foreach ($db->query($query) as $row) 
+    $chart_array[]=array((string)$row['date_time'],(int)$row['mpl_press'],(int)$row['dht22_rh']); 
+  $query = "SELECT * FROM ProbeData ORDER BY date_time DESC LIMIT 1";
+  foreach ($db->query($query) as $row) {
+    $last_time=(string)$row['date_time'];
+    $last_temp=json_encode( (real)$row['mpl_temp']*1.8+32);
+    $last_press=json_encode( (int)$row['mpl_press'] );
+  }
 }
 //Now convert to a JSON array for the Javascript
 $temp_data=json_encode($chart_array);
@@ -52,19 +52,28 @@ Link/load with the file rs232.c, included with the package and
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <ctype.h>
+#include <pthread.h>
 #include "rs232.h"
 #include "WS.h"
 
 /* Global variables, used by ancillary procedures */
-FILE *xmlout;                      // used by setStoreMode()
 storeModes storeMode;
 boolean keepReading=true;          // set "false" in intHandler by ^c
 boolean xmlToFile;
-struct fieldDesc {
-    char *fieldName; 
-    char *fieldAttributes; }; 
+char *xmlName;                     // xml output file, if one was given
+char *tsDir = tsDefaultDir;        // column store directory, in ts mode
+struct commPort probes[maxProbes]; // the probes we collect from, set by setStoreMode()
+int nProbes;
+boolean probesNamed;               // -p was given, so import numbers sources by it
+boolean binaryLink;                // -b: probes send binary frames, which ws formats
+char *httpSpec = NULL;             // -H: serve /latest and /history on this [addr:]port
+int streamSecs = 0;                // -t: probes push a sample this often, unasked
+boolean askLatest;                 // -l: probes report their latest background sample
+extern long benchSamples;          // -n: samples to time, in WS-Bench.c
 struct fieldDesc fieldList[] = {
     {"date_time", "TEXT PRIMARY KEY"},
     {"mpl_press", "INT"},
@@ -79,198 +88,740 @@ struct fieldDesc fieldList[] = {
     {"ds18_3_temp", "REAL"},
     {"ds18_4_lbl", "TEXT"},
     {"ds18_4_temp", "REAL"},
+    {"probe_id", "INT"},
     NULL, NULL};
 
-int main(int argc, char *argv[]) 
-{
-  char *ch;
-  int i, n;
-  unsigned char rBuf[rBufSize];    // receive buffer from Uno
-  unsigned char lBuf[lBufSize];    // line buffer
-  struct commPort Uno = {          // port 24 = /dev/ttyACM0 on RaspPi
-    24, 9600, "8N1", *rBuf, 0 };  // try 25 = /dev/ttyACM1 if that doesn't work
-  struct sigaction act;            // catch CNTL-C to terminate XML file cleanly
-  //  boolean gotLine;
-
-struct WPCmds {
+static struct wsRing toParser, toStore;   // the ingest pipeline: lines, then samples
+static void *parseLines(void *arg);
+static void *storeItems(void *arg);
+static void storeLine(struct commPort *Uno, unsigned char lBuf[], int n);
+static void storeSample(struct commPort *Uno, struct wsSample *smp);
+static void recordSample(struct commPort *Uno, struct wsSample *smp);
+static void checkSeq(struct commPort *Uno, char *text);
+static void checkAge(struct commPort *Uno, char *text);
+static boolean startProbe(struct commPort *Uno, int tries);
+static void dropProbe(struct commPort *Uno);
+static void rejoinProbe(struct commPort *Uno);
+
+static struct WPCmds {
   char *cmdString; 
   int cmdLen; 
   } startWPCmds[] = {        // storeModes order 
     {"\n",1},
     {"report\n",7}, 
     {"csv\n",4},
-    {"xmlstart\n",9}
+    {"xmlstart\n",9},
+    {"csv\n",4}
     };
 
+int main(int argc, char *argv[]) 
+{
+  int i, n;
+  unsigned char *lBuf;             // the line just received, in place in the port's buffer
+  struct commPort *port;           // port with data waiting
+  wsEvents ev;                     // what evWait() returned
+  struct pipeItem *item;           // where it's passed to the parser
+  pthread_t parserTid, storeTid;
+
 /* Start of main code 
  *------------------------------------------------------------------------------
 */
 
-/* Catch ^C's to exit cleanly */
-  act.sa_handler = intHandler;
-  sigaction(SIGINT, &act, NULL);
-
 /* Validate arguments or provide help.
    Determine report-out mode and verify access to database/recording files 
 */
-  storeMode = setStoreMode(argc, argv);     // set the storage mode for sampled data
+  storeMode = setStoreMode(argc, argv);     // set the storage mode and probe list
+  if (storeMode == importMode) {            // bulk-load files rather than collect
+    initDBMgr();
+    n = importToDB(argv+optind+1, argc-optind-1);
+    closeDBMgr();
+    exit(n ? EXIT_SUCCESS : EXIT_FAILURE);
+  };
+
+/* Catch ^C's, and systemd's SIGTERM, as events so we can exit cleanly */
+  initEvents();
+
   if (storeMode == sqlMode) initDBMgr();    // test database connection if necessary
+  if (storeMode == xmlMode) initXMLMgr(xmlToFile ? xmlName : NULL);  // or open the xml file
+  if (storeMode == tsMode) initTSMgr(tsDir, fieldList);               // or the column store
+  initLatest(nProbes);                      // publish each probe's latest sample
+  if (httpSpec) initHTTP(httpSpec);         // and answer dashboards
+
+  for (i=0; i<nProbes && keepReading; i++)
+    if (! startProbe(&probes[i], 0) ) {     // verify connection to each Weather Probe
+      if (!keepReading) break;              // ^C while waiting: shut down as usual, below
+      fprintf(stderr, "[?WS] WeatherStation cannot open comport %s to Arduino\n",
+	      probes[i].devName);
+      exit(EXIT_FAILURE);
+    };
+  for ( ; i<nProbes; i++) probes[i].down = true;  // not started, and not to be asked
 
-  if (! connectToWP(&Uno) ) {               // verify connection to Weather Probe
-        fprintf(stderr, "[?WS] WeatherStation cannot open comport to Arduino\n");
-	exit(EXIT_FAILURE);
+  /* Binary frames are formatted here, so the xml prolog has to be, too      */
+  if (binaryLink && storeMode==xmlMode) {
+    appendToXML("<?xml version=\"1.0\" ?>\r\n", false);
+    appendToXML("<!DOCTYPE samples SYSTEM \"weather_data.dtd\">\r\n", false);
+    appendToXML("<samples>\r\n", false);
   };
 
-  /* Finally, get down to work.  Tell the probe how we want to see the data   */
-  RS232_SendBuf(Uno.portNum, startWPCmds[storeMode].cmdString, startWPCmds[storeMode].cmdLen);
-  sleep(1);                                 // give the probe time to set up
+  /* Finally, get down to work.  With -n, samples are requested as fast as
+     they are recorded rather than on the timer (see WS-Bench.c).  With -t,
+     the timer asks only the probes that can't stream, and keeps watch on
+     the ones that do.                                                     */
+  if (benchSamples > 0) benchStart(probes, nProbes);
+    else evStartSampling(streamSecs > 0 ? streamSecs : SAMPLE_PERIOD);
+
+  /* Start the parser and store threads: this thread reads the probes and
+     passes their lines to the parser, which passes the samples it makes
+     of them to the store thread, each through a ring (see WS-Ring.c).  So
+     a slow database holds up only the store thread, and the rings fill,
+     while the probes' lines go on being read.                             */
+  ringInit(&toParser, "probes->parser", pipeSlots, sizeof(struct pipeItem));
+  ringInit(&toStore, "parser->store", pipeSlots, sizeof(struct pipeItem));
+  if ( pthread_create(&parserTid, NULL, parseLines, NULL) != 0
+       || pthread_create(&storeTid, NULL, storeItems, NULL) != 0 ) {
+    fprintf(stderr, "[?WS] Can't start the ingest threads\n");
+    exit(EXIT_FAILURE);
+  };
 
-  /* This loops "forever" -- or until a ^C is typed */
+  /* This loops "forever" -- or until a ^C is typed.  Each pass handles one
+     event: time to sample, data from a probe, or a signal.  All the probes
+     are read from this one loop, and there is one parser and one store
+     thread, so their data are written by one writer, in the order in
+     which their lines arrive.                                             */
   while (keepReading) {                     // exit if ^C received, or other trigger in future
-    RS232_SendBuf(Uno.portNum, "sample\n", 7);    // tell the probe to take a sample
-    sleep(2);                                  // wait a bit for the probe to do its work
-                                               // and then start reading lines from the serial port
-    while ( getDataLine(&Uno,lBuf) ) {
-      if ( (storeMode==sqlMode && (lBuf[0]!='(' || lBuf[1]!='\''))  // csv lines start ('
-            || (storeMode==xmlMode && lBuf[0]!=('<')) )  {          // xml lines start <
-	fprintf(stderr, "[%WS] Data line formatted incorrectly:\n\t%s", lBuf);
-      };
-      switch (storeMode) {
-        case rptMode:
-	  printf("%s", lBuf);                 // for report mode, just print the line
-	  break;
-        case xmlMode:                         // if xml mode, just copy the line to the file
-	  xmlout = !xmlToFile ? stdout : fopen(argv[2], "a");
-	  fprintf(xmlout,"%s", lBuf);
-	  if (xmlToFile) fclose(xmlout);
-	  break;
-        case sqlMode:                         // if sql mode, add row to the table
-	  appendToDB(lBuf);
-	  break;                             // end sql processing
-        default:
-	  break;
-      };                                     // close switch for processing
-    };                                       // end getDataLine -- process all lines for this sample
-    if (keepReading) sleep(SAMPLE_PERIOD);   // sleep for specified period before sampling again
+    switch ( (ev=evWait(-1, &port)) ) {
+      case evSample:
+	for (i=0; i<nProbes; i++) {
+	  if (probes[i].down) {             // a lost probe: is it back?
+	    rejoinProbe(&probes[i]);
+	    continue;
+	  };
+	  /* A streaming probe's samples aren't in step with our timer: allow it
+	     a period's grace before saying it's gone quiet                      */
+	  if (probes[i].heard) probes[i].quiet = 0;
+	  else if (++probes[i].quiet > (probes[i].streamed ? 1 : 0))
+	    fprintf(stderr, "[%WS] No data from probe on %s since last sample\n", probes[i].devName);
+	  if (!probes[i].streamed)                   // tell each probe to take a sample, or
+	    RS232_SendBuf(probes[i].portNum,         //   with -l to report its latest
+			  __atomic_load_n(&probes[i].latest, __ATOMIC_RELAXED) ? "latest\n" : "sample\n", 7);
+	  probes[i].heard = false;
+	};
+	break;
+      case evPort:                          // pass on the lines that have arrived,
+      case evPortDown:                      //   and drop a port that's hung up
+	while ( (n=getDataLine(port,&lBuf)) > 0 ) {
+	  port->heard = true;
+	  item = ringSlot(&toParser);
+	  if (n >= pipeLineMax) {           // no probe line is this long: keep its start
+	    fprintf(stderr, "[%WS] Line from %s is too long; cut to %d characters\n",
+		    port->devName, pipeLineMax-2);
+	    n = pipeLineMax-2;
+	    lBuf[n] = '\n';
+	  };
+	  item->port = port;
+	  item->len = n;
+	  memcpy(item->text, lBuf, n);
+	  item->text[n] = 0;
+	  ringPush(&toParser);
+	};                                   // end getDataLine -- process all lines that are in
+	ringFlush(&toParser);
+	if (n < 0 || ev == evPortDown) dropProbe(port);
+	break;
+      default:                              // signal: nothing more to do here
+	break;
+    };
   };                                         // end while keepReading -- terminate recording
                                              // if there's ever a time when we don't
                                              // keepReading, we'll exit here to terminate cleanly
-  if (storeMode==xmlMode) {                  // if we're doing xml mode, end the document
-    xmlout = !xmlToFile ? stdout : fopen(argv[2], "a");  
-    fprintf(xmlout,"</samples>\n");
-    if (xmlToFile) fclose(xmlout);
-  };
+  item = ringSlot(&toParser);               // the end of the data: the stages finish
+  item->port = NULL;                        //   what they have, and stop
+  ringPush(&toParser);
+  ringFlush(&toParser);
+  pthread_join(parserTid, NULL);
+  pthread_join(storeTid, NULL);
+  ringsReport(stderr);
+  for (i=0; i<nProbes; i++)
+    if (probes[i].lost > 0)
+      fprintf(stderr, "[%WS] %lu pushed sample%s from %s never arrived\n",
+	      probes[i].lost, probes[i].lost==1 ? "" : "s", probes[i].devName);
+  if (storeMode==xmlMode) closeXMLMgr();    // if we're doing xml mode, end the document
+  if (storeMode==sqlMode) closeDBMgr();     // commit queued rows, release the database
+  if (storeMode==tsMode) closeTSMgr();      // sync and trim the column files
+  if (httpSpec) closeHTTP();
+  closeLatest();
+  if (benchSamples > 0) benchReport(stderr, argv[optind], nProbes);
   exit(EXIT_SUCCESS);
 };  // end main()
 
 
-/* Start of intHandler() 
+/* Start of parseLines()
  *------------------------------------------------------------------------------
- * Triggers end or main loop if a ^C is received on controlling terminal
+ * The parser thread: checks each line from the probes, and parses it into
+ * a sample -- decodes it, from a probe in binary mode -- if it is one that
+ * ws will store as a sample; passes the sample, or in rpt and xml modes the
+ * line, to the store thread.  The probes' status messages go to stderr, and
+ * the numbers of the samples they push are checked for gaps, and the ages of
+ * the latest samples they report for staleness.
 */
-void intHandler(int sigType) {            // catch ^C's
+static void *parseLines(void *arg) {
+  struct pipeItem *in, *out;
+  const char *why;
+
+  while (true) {
+    if ( (in=ringNext(&toParser, 0)) == NULL ) {  // caught up: let the store thread
+      ringFlush(&toStore);                  //   have what there is, and wait
+      in = ringNext(&toParser, -1);
+    };
+    out = ringSlot(&toStore);
+    if ( (out->port=in->port) == NULL ) {   // the end: pass it on, and stop
+      ringPush(&toStore);
+      ringFlush(&toStore);
+      ringPop(&toParser);
+      break;
+    };
+    out->len = 0;
+    if (in->text[0] == '#') {               // a pushed sample's number
+      checkSeq(in->port, (char *) in->text+1);
+      ringPop(&toParser);
+      continue;
+    };
+    if (in->text[0] == '@') {               // the age of a probe's latest sample
+      checkAge(in->port, (char *) in->text+1);
+      ringPop(&toParser);
+      continue;
+    };
+    if (in->port->latest && strncmp((char *) in->text, "Command, one of:", 16) == 0) {
+      fprintf(stderr, "[%WS] Probe on %s doesn't know \"latest\"; it will be asked for new samples\n",
+	      in->port->devName);                    // an older WP
+      __atomic_store_n(&in->port->latest, false, __ATOMIC_RELAXED);
+      ringPop(&toParser);
+      continue;
+    };
+    if (in->port->binary) {
+      if (in->text[0] != frameMagic0) {     // text: probe message or chatter
+	if (in->text[0] == '[') fprintf(stderr, "%s", in->text);
+	else fprintf(stderr, "[%WS] Unexpected text from %s:\n\t%s", in->port->devName, in->text);
+	ringPop(&toParser);
+	continue;
+      };
+      if ( !decodeFrame(in->text, &out->sample) ) {
+	fprintf(stderr, "[%WS] Frame from %s has an impossible date; sample not recorded\n",
+		in->port->devName);
+	ringPop(&toParser);
+	continue;
+      };
+      if ( !checkSample(&out->sample, &why) ) {  // as a text sample's are checked
+	fprintf(stderr, "[%WS] Frame from %s %s; sample not recorded\n", in->port->devName, why);
+	ringPop(&toParser);
+	continue;
+      };
+    }
+    else if (storeMode==sqlMode || storeMode==tsMode) {
+      if ( !parseSample((char *) in->text, &out->sample, &why) ) {
+	fprintf(stderr, "[%WS] Sample from %s %s; row not recorded:\n\t%s",
+		in->port->devName, why, in->text);
+	ringPop(&toParser);
+	continue;
+      };
+    }
+    else {
+      if (storeMode==xmlMode && in->text[0]!='<')           // xml lines start <
+	fprintf(stderr, "[%WS] Data line formatted incorrectly:\n\t%s", in->text);
+      memcpy(out->text, in->text, in->len+1);
+      out->len = in->len;
+    };
+    ringPush(&toStore);
+    ringPop(&toParser);
+  };
+  return(NULL);
+}; // end parseLines()
+
+
+/* Start of checkSeq()
+ *------------------------------------------------------------------------------
+ * A streaming probe numbers the samples it pushes, from 1: "text" is the
+ * number of the next one.  Reports any skipped since the last, which never
+ * made it here -- lost in transit, or the probe's output was held up.
+*/
+static void checkSeq(struct commPort *Uno, char *text) {
+  unsigned long seq;
+  char *end;
+
+  seq = strtoul(text, &end, 10);
+  if (end == text || (*end != '\r' && *end != '\n')) {
+    fprintf(stderr, "[%WS] Garbled sample number from %s:\n\t#%s", Uno->devName, text);
+    return;
+  };
+  if (seq == Uno->seq+2)
+    fprintf(stderr, "[%WS] Sample %lu from %s lost\n", seq-1, Uno->devName);
+  else if (seq > Uno->seq+2)
+    fprintf(stderr, "[%WS] Samples %lu to %lu from %s lost\n", Uno->seq+1, seq-1, Uno->devName);
+  if (seq > Uno->seq+1) Uno->lost += seq - Uno->seq - 1;
+  Uno->seq = seq;                           // (less than the last: the probe started over)
+}; // end checkSeq()
+
+
+/* Start of startProbe()
+ *------------------------------------------------------------------------------
+ * Connects to the probe on Uno's port, giving it "tries" seconds to answer
+ * (0: as long as it takes), has it stream with -t, tells it the format we
+ * want, and has the event loop watch its port.  False if it can't be reached.
+*/
+static boolean startProbe(struct commPort *Uno, int tries) {
+
+  if (! connectToWP(Uno, tries) ) return(false);
+
+  /* With -t, have the probe sample on its own, before it's told the format,
+     so the first sample, a period from now, comes in that format          */
+  if (streamSecs > 0 && !(Uno->streamed=startStream(Uno, streamSecs)))
+    fprintf(stderr, "[%WS] Probe on %s can't stream; it will be asked for each sample\n",
+	    Uno->devName);
+
+  /* Tell the probe how we want to see the data, and listen for it */
+  if (binaryLink) {
+    RS232_SendBuf(Uno->portNum, "binary\n", 7);
+    Uno->binary = true;
+  }
+  else
+    RS232_SendBuf(Uno->portNum, startWPCmds[storeMode].cmdString, startWPCmds[storeMode].cmdLen);
+  Uno->heard = true;
+  __atomic_store_n(&Uno->latest, askLatest, __ATOMIC_RELAXED);
+  evAddPort(Uno);
+  return(true);
+}; // end startProbe()
+
+
+/* Start of dropProbe()
+ *------------------------------------------------------------------------------
+ * A probe's port has hung up or failed, e.g., its USB cable was pulled: stop
+ * watching it and close it, and carry on with the other probes.  Each sample
+ * period, rejoinProbe() looks to see whether it's back.  With -n there is no
+ * sample timer, so ws stops once it has no probes left.
+*/
+static void dropProbe(struct commPort *Uno) {
+  int i;
+
+  fprintf(stderr, "[?WS] Lost the probe on %s; its port is closed until it's back\n",
+	  Uno->devName);
+  evDropPort(Uno);
+  RS232_CloseComport(Uno->portNum);
+  Uno->down = true;
+  if (benchSamples == 0) return;
+  for (i=0; i<nProbes; i++)
+    if (!probes[i].down) return;
+  fprintf(stderr, "[?WS] No probes left; stopping\n");
   keepReading = false;
-}; // end intHandler()
+}; // end dropProbe()
+
+
+/* Start of rejoinProbe()
+ *------------------------------------------------------------------------------
+ * Reconnects a lost probe once its device is back, e.g., plugged in again.
+ * The event loop waits while it does -- rejoinTries seconds, at most, for
+ * a probe that doesn't answer, plus the link speed checks -- and the other
+ * probes' lines wait in their ttys.  One that can't be reached is tried
+ * again at the next sample period.
+*/
+static void rejoinProbe(struct commPort *Uno) {
+  char path[48];
+
+  if (!keepReading) return;                         // stopping: leave it
+  snprintf(path, sizeof(path), "%s%s", Uno->devName[0]=='/' ? "" : "/dev/", Uno->devName);
+  if ( access(path, R_OK|W_OK) != 0 ) return;       // not back yet
+  fprintf(stderr, "[%WS] %s is back; reconnecting to its probe\n", Uno->devName);
+  if ( !startProbe(Uno, rejoinTries) ) {
+    if (keepReading)                                //   (^C: main() shuts down)
+      fprintf(stderr, "[?WS] No probe answering on %s; will try again\n", Uno->devName);
+    return;
+  };
+  Uno->down = false;
+  Uno->quiet = 0;
+}; // end rejoinProbe()
+
+
+/* Start of checkAge()
+ *------------------------------------------------------------------------------
+ * A probe asked for its latest sample says how old it is, in msec: "text".
+ * Reports one that has stopped sampling in the background.
+*/
+static void checkAge(struct commPort *Uno, char *text) {
+  long ms = atol(text);
+
+  if (ms > latestStaleMs)
+    fprintf(stderr, "[%WS] Latest sample from %s is %ld seconds old\n", Uno->devName, ms/1000);
+}; // end checkAge()
 
 
-/* Start of gotLine()
+/* Start of storeItems()
  *------------------------------------------------------------------------------
- * gotLine() assembles a complete line, ended by '\n', from the Uno serial port
- * and returns it in lBuf as a NULL-terminated string
+ * The store thread: records what the parser passes it, and commits the
+ * queued database rows when they're due.  With -n, it sees the samples in,
+ * and ends the run when they're all recorded.
 */
-boolean gotLine(struct commPort *Uno, char *lBuf) {
-  int n, i, lnext;
-  boolean sawEOL;
-
-  lnext = 0;                       // init output line pointer
-  do {
-    n = RS232_PollComport(Uno->portNum, Uno->rBuf, rBufSize-1);
-    if(n > 0) {
-      Uno->rBuf[n] = 0;            // put a NULL at the end
-      sawEOL = false;              // look for EOL
-      for (i = 0; i<n ; i++) {
-        lBuf[lnext++] = Uno->rBuf[i]; // copy receive buffer to line buffer
-        if (Uno->rBuf[i] == '\n') {   // did we just finish a line?
-	   lBuf[lnext] = 0;        //   yep, terminate it & process
-	   sawEOL = true;
+static void *storeItems(void *arg) {
+  struct pipeItem *item;
+  boolean benchDone = false;
+  int ms;
+
+  while (true) {
+    ms = (storeMode==sqlMode) ? dbSecsToFlush()*1000 : -1;
+    if (benchSamples > 0 && (ms < 0 || ms > 1000)) ms = 1000;  // look for stalls
+    if ( (item=ringNext(&toStore, ms)) != NULL ) {
+      if (item->port == NULL) {             // the end of the data
+	ringPop(&toStore);
+	break;
+      };
+      if (item->len == 0) storeSample(item->port, &item->sample);
+	else storeLine(item->port, item->text, item->len);
+      ringPop(&toStore);
+    };
+    if (storeMode==sqlMode && dbSecsToFlush()==0) flushDB();
+    if (benchSamples > 0 && !benchDone && benchCheck(probes, nProbes)) {
+      benchDone = true;
+      kill(getpid(), SIGTERM);              // end the main loop, as a ^C would
+    };
+  };
+  return(NULL);
+}; // end storeItems()
+
+
+/* Start of storeSample()
+ *------------------------------------------------------------------------------
+ * Records a sample the parser has made of a probe's line or frame -- as it
+ * is, in sql and ts modes, or formatted as the probe would have sent it,
+ * line by line.
+*/
+static void storeSample(struct commPort *Uno, struct wsSample *smp) {
+  char text[sBufSize], *line, *eol, c;
+
+  if (storeMode == sqlMode || storeMode == tsMode) {
+    recordSample(Uno, smp);
+    return;
+  };
+  latestSample(Uno->probeID, smp);         // current conditions, for all to read
+  if ( formatSample(storeMode, smp, text, sizeof(text)) < 0 ) return;
+  for (line=text; (eol=strchr(line, '\n')) != NULL; line=eol) {
+    c = *++eol;                             // storeLine() wants one terminated line
+    *eol = 0;
+    storeLine(Uno, (unsigned char *) line, eol-line);
+    *eol = c;
+  };
+}; // end storeSample()
+
+
+/* Start of storeLine()
+ *------------------------------------------------------------------------------
+ * Records one line of data from the probe on port "Uno" in rpt or xml mode.
+ * With more than one probe, report lines are prefixed with the probe's device
+ * name, and each xml <sample> is collected whole and tagged with a <source_loc>
+ * so that samples from different probes don't interleave; only the first
+ * probe's xml prolog is kept.
+*/
+static void storeLine(struct commPort *Uno, unsigned char lBuf[], int n) {
+  boolean last;                             // line completes a sample?
+
+  last = (storeMode==xmlMode) ? strncmp((char *) lBuf, "</sample>", 9)==0 : isdigit(lBuf[0]);
+  switch (storeMode) {
+    case rptMode:
+      if (nProbes > 1) printf("%-8s ", Uno->devName);
+      printf("%s", lBuf);                   // for report mode, just print the line
+      fflush(stdout);
+      break;
+    case xmlMode:                           // if xml mode, copy the line to the file
+      if (nProbes > 1) {
+	if ( strncmp((char *) lBuf, "<sample>", 8) == 0 ) {
+	  Uno->sBufLen = snprintf(Uno->sBuf, sBufSize, "%s<source_loc>%s</source_loc>\n",
+				  lBuf, Uno->devName);
+	  return;
 	};
-      };                           // end of loop to copy receive-->line
-    };                             // end n>0
-    if ( !sawEOL ) sleep(1);       // if no EOL, wait for more from Uno
-  } while ( !sawEOL && keepReading ); // end do...while
-  return( sawEOL ? true : false );
-};  // end gotLine()
+	if (Uno->sBufLen > 0) {             // inside a sample: hold the line
+	  if (Uno->sBufLen+n < sBufSize) {
+	    memcpy(Uno->sBuf+Uno->sBufLen, lBuf, n+1);
+	    Uno->sBufLen += n;
+	  };
+	  if ( strncmp((char *) lBuf, "</sample>", 9) != 0 ) return;
+	  lBuf = (unsigned char *) Uno->sBuf;   // sample complete: write it all
+	  Uno->sBufLen = 0;
+	}
+	else if (Uno->probeID != 0) return; // prolog or chatter from another probe
+      };
+      appendToXML((char *) lBuf, last);
+      break;
+    default:                                // sql and ts lines are made samples by the parser
+      break;
+  };
+  if (benchSamples > 0 && last) benchStored(Uno);
+}; // end storeLine()
+
+
+/* Start of recordSample()
+ *------------------------------------------------------------------------------
+ * Adds a sample from the probe on port "Uno", parsed from its csv line or
+ * decoded from its frame, as a row of the table or the column files, and
+ * publishes it as the probe's current conditions, for all to read
+*/
+static void recordSample(struct commPort *Uno, struct wsSample *smp) {
+  if (storeMode == sqlMode) appendToDB(Uno->probeID, smp);
+    else appendToTS(Uno->probeID, smp);
+  latestSample(Uno->probeID, smp);
+  if (benchSamples > 0) benchStored(Uno);
+}; // end recordSample()
+
+
+/* Start of intHandler() 
+ *------------------------------------------------------------------------------
+ * Triggers end or main loop if a ^C is received on controlling terminal
+*/
+void intHandler(int sigType) {            // catch ^C's
+  keepReading = false;
+}; // end intHandler()
+
 
 /* This procedure processes any command-line arguments to "ws" to determine
-   the mode of reporting (rpt, sql, or xml) and if it's in xml mode, initiates
-   the xml output data file if one is given
+   the probes to collect from (-p), the mode of reporting (rpt, sql, xml, or ts),
+   and if it's in xml mode, verifies the xml output data file if one is given
 */
 storeModes setStoreMode(int argc, char *argv[]) {
+  extern int maxBaud, benchWindow, dbBatchRows, dbBatchSecs;
+  extern char *dbName;
   storeModes mode;
-  char *ch;
+  char *ports = "ttyACM0", *dev;   // port 24 = /dev/ttyACM0 on RaspPi
+  boolean rotate = false;
+  int c, n;
 
-  mode  = noMode;
-  if (argc>1) {                             // what mode was requested?  rpt, sql, or xml?
-    if (strcasecmp(argv[1], "rpt")==0) mode = rptMode;
-    if (strcasecmp(argv[1], "sql")==0) mode = sqlMode;
-    if (strcasecmp(argv[1], "xml")==0) {
-      mode = xmlMode;
-      if (argc>=2)                         // if xml, was a filename given?
-        xmlout = stdout;                   // if not, output to stdout
-      else
-        if ( !(xmlout=fopen(argv[2],"a")) ) {
-	  fprintf(stderr, "[?WS] Cannot open %s for output in append mode\n", argv[2]);
+  while ( (c=getopt(argc, argv, "bc:d:H:ln:p:r:s:t:w:")) != -1 )
+    switch (c) {
+      case 's':                            // fastest serial rate to negotiate
+	maxBaud = atoi(optarg);
+	break;
+      case 'b':                            // binary frames on the serial link
+	binaryLink = true;
+	break;
+      case 'c':                            // -c rows[,secs] between database commits
+	n = sscanf(optarg, "%d,%d", &dbBatchRows, &dbBatchSecs);
+	if ( n < 1 || dbBatchRows < 1 || dbBatchRows > dbBatchMax || dbBatchSecs < 1 ) {
+	  fprintf(stderr, "[?WS] -c wants rows per commit, 1 to %d, and optionally \",seconds\"\n", dbBatchMax);
+	  exit(EXIT_FAILURE);
+	};
+	break;
+      case 'd':                            // database other than the compiled-in one
+	dbName = optarg;
+	break;
+      case 'H':                            // HTTP server on [addr:]port
+	httpSpec = optarg;
+	break;
+      case 't':                            // probes push a sample every so many seconds
+	if ( (streamSecs=atoi(optarg)) < 1 || streamSecs > streamMax ) {
+	  fprintf(stderr, "[?WS] -t wants seconds between samples, 1 to %d\n", streamMax);
 	  exit(EXIT_FAILURE);
 	};
-      if (xmlout!=stdout) fclose(xmlout);
+	break;
+      case 'l':                            // take the probes' latest samples
+	askLatest = true;
+	break;
+      case 'n':                            // time this many samples, then quit
+	benchSamples = atol(optarg);
+	break;
+      case 'w':                            //   with this many outstanding per probe
+	benchWindow = atoi(optarg);
+	break;
+      case 'r':                            // -r day | size[K|M|G] | day,size
+	if ( !setXMLRotation(optarg) ) {
+	  fprintf(stderr, "[?WS] -r wants \"day\", a size such as 100M, or both (\"day,100M\")\n");
+	  exit(EXIT_FAILURE);
+	};
+	rotate = true;
+	break;
+      case 'p':                            // -p ttyACM0,ttyACM1,...
+	ports = optarg;
+	probesNamed = true;
+	break;
+      default:
+	optind = argc;                     // complain with the help text below
+	break;
+    };
+
+  mode  = noMode;
+  if (optind < argc) {                      // what mode was requested?  rpt, sql, or xml?
+    if (strcasecmp(argv[optind], "rpt")==0) mode = rptMode;
+    if (strcasecmp(argv[optind], "sql")==0) mode = sqlMode;
+    if (strcasecmp(argv[optind], "xml")==0) {
+      mode = xmlMode;
+      xmlToFile = (optind+1 < argc);        // if xml, was a filename given?
+      if (xmlToFile) xmlName = argv[optind+1];  //   if not, output to stdout
     };
+    if (strcasecmp(argv[optind], "ts")==0) {
+      mode = tsMode;
+      if (optind+1 < argc) tsDir = argv[optind+1];  // else the default directory
+    };
+    if (strcasecmp(argv[optind], "import")==0 && optind+1 < argc) mode = importMode;
   };
   if (mode==noMode) {
     printf("WeatherStation v%s: program to collect and record meteorological data\n", Version);
-    printf("\tws <mode> where <mode> = rpt | sql | xml\n");
-    printf("\tfor a report-style printout, SQL database recording, or XML data file recording\n");
+    printf("\tws [-b] [-c rows[,secs]] [-d database] [-H [addr:]port] [-p port[,port...]] [-r day|size|day,size] [-s maxbaud]\n");
+    printf("\t\t[-l | -t seconds] [-n samples [-w window]] <mode> where <mode> = rpt | sql | xml [xmlfile] | ts [dir]\n");
+    printf("\tfor a report-style printout, SQL database recording, XML data file recording,\n");
+    printf("\tor column store recording (default %s)\n", tsDefaultDir);
+    printf("\tfrom the probes on the listed ports (default ttyACM0; at most %d)\n", maxProbes);
+    printf("\tws [-d database] import file...   loads XML data files and CSV captures\n");
+    printf("\t(gzip'd or not; - for stdin) into the database, skipping samples already there\n");
+    printf("\t-b has the probes send compact, CRC-checked binary samples\n");
+    printf("\t-s limits the serial rate negotiated with the probes (default 500000; %d = don't)\n", baseBaud);
+    printf("\t-d records to that sqlite3 file or MySQL database instead of the default\n");
+    printf("\t-c commits queued rows to the database once there are that many (default 64),\n");
+    printf("\t   or once the oldest has waited that many seconds (default 60)\n");
+    printf("\t-H answers GET /latest and /history?field=... with JSON over HTTP on that port\n");
+    printf("\t-r starts a new xmlfile each day and/or at that size (e.g., 100M), and\n");
+    printf("\t   compresses the old one with gzip\n");
+    printf("\t-t has the probes sample every \"seconds\" on their own, and push each sample\n");
+    printf("\t   (default: ask them for one every %d seconds)\n", SAMPLE_PERIOD);
+    printf("\t-l has the probes report the latest sample they took in the background,\n");
+    printf("\t   at once, rather than take a new one when asked\n");
+    printf("\t-n takes that many samples as fast as the probes answer, keeping \"window\"\n");
+    printf("\t   requests outstanding at each (default 1), then reports ingest timing\n");
     exit(EXIT_SUCCESS);
   };
+  if (askLatest && (streamSecs > 0 || benchSamples > 0)) {
+    fprintf(stderr, "[?WS] -l is for samples asked for on the timer, so can't be used with -t or -n\n");
+    exit(EXIT_FAILURE);
+  };
+  if (streamSecs > 0 && benchSamples > 0) {
+    fprintf(stderr, "[?WS] -n asks for samples as fast as they come, so can't be used with -t\n");
+    exit(EXIT_FAILURE);
+  };
+  if (rotate && !(mode==xmlMode && xmlToFile)) {
+    fprintf(stderr, "[?WS] -r rotates an xml file, so needs \"xml <xmlfile>\"\n");
+    exit(EXIT_FAILURE);
+  };
+
+  /* Build the probe list: each probe's position in it is its probe_id */
+  nProbes = 0;
+  for (dev=strtok(ports, ","); dev!=NULL; dev=strtok(NULL, ",")) {
+    if (nProbes == maxProbes) {
+      fprintf(stderr, "[?WS] No more than %d probes may be given\n", maxProbes);
+      exit(EXIT_FAILURE);
+    };
+    n = -1;                                 // import only matches the names to <source_loc>s
+    if ( mode != importMode && (n=RS232_GetPortnr(dev)) < 0 ) {
+      fprintf(stderr, "[?WS] %s is not a serial port ws knows\n", dev);
+      exit(EXIT_FAILURE);
+    };
+    if (strncmp(dev, "/dev/", 5) == 0) dev += 5;
+    memset(&probes[nProbes], 0, sizeof(struct commPort));
+    probes[nProbes].portNum = n;
+    probes[nProbes].probeID = nProbes;
+    probes[nProbes].baudRate = baseBaud;
+    strcpy(probes[nProbes].commMode, "8N1");
+    snprintf(probes[nProbes].devName, sizeof(probes[nProbes].devName), "%s", dev);
+    nProbes++;
+  };
+  if (nProbes == 0) {
+    fprintf(stderr, "[?WS] No probe port given\n");
+    exit(EXIT_FAILURE);
+  };
   return(mode);
 };                                         // end setStoreMode
 
 /* This procedure returns a single line of sample data from the probe each time it is called.
-   It is called after a "sample" command has been sent to the probe by the invoking procedure.
-   The "sample" command causes the probe to return data from its sensors with
-   each line terminated by a '\n' character (not a NULL).
+   The probe's data lines are each terminated by a '\n' character (not a NULL).
    A "sampling" may return 1 line (e.g., sql mode) or many lines (e.g., xml mode)
-   This routine is called repeatedly and returns a value of "true" along with
-   a line of data in the line buffer, "lbuf", until the receive buffer has been emptied
-   and there is no more data in the serial-port pipeline from the probe.  When that
-   happens, the procedure returns a value of "false" the next time it is called, and the
-   invoking procedure knows that all the data from its last "sample" command has been processed.
+   This routine never waits: it returns the length of the next complete line, and sets
+   "line" to point to it, as long as there is one in what has been received, and 0 once
+   what's left is empty or only part of a line, or -1 if reading the port fails (e.g.,
+   EIO: the probe was unplugged), once the complete lines before that are returned.
+   (A port that has hung up reads as empty: evWait() reports that as evPortDown.)
+   Lines are framed in place in the port's receive buffer: memchr() finds each '\n',
+   and the line is handed back without being copied, NULL-terminated by a NULL written
+   over the first byte of the line after it (that byte is put back on the next call).
+   So the line is good only until the next call for the same port.  A partial line
+   is slid to the front of the buffer and completed by later calls, after the event
+   loop reports that more data has arrived.  A line too long for the buffer is
+   reported and discarded.
+   For a probe in binary mode, a binary frame (which starts with frameMagic0 and may
+   contain '\n's) is returned in the same way, as a "line" of frameLen bytes, once its
+   CRC has been checked.  Bytes that are neither a good frame nor a complete line are
+   discarded up to the next frameMagic0, so that we resynchronize after corruption.
 */
-boolean getDataLine(struct commPort *Uno, unsigned char lbuf[]) {
-#define  maxWait  10                           // if no response from Probe in 10 sec, quit
-  //  static int rbufLen=0, rbufPtr=0;            // chars left in rbuf
-  static int rBufPtr=0;
-  int i,  lbufPtr=0;
-  boolean gotLine = false;                   // start loop with no line from probe
-  int timerCount = 0;
-
-  lbuf[0] = 0;
-  if ( Uno->rBufLen == 0 )                       // no data in buffer so go get some
-    while ( ( (Uno->rBufLen = RS232_PollComport(Uno->portNum, Uno->rBuf, rBufSize-1) )<=0 ) 
-            && (timerCount < maxWait) 
-	    && keepReading )  {
-      sleep(1);
-      timerCount++;
+int getDataLine(struct commPort *Uno, unsigned char **line) {
+  unsigned char *eol, *mark;
+  int start, n;
+
+  Uno->rBuf[Uno->rBufHead] = Uno->rBufSaved;     // undo the last line's NULL
+  while (true) {
+    if (Uno->binary && Uno->rBufHead < Uno->rBufLen && Uno->rBuf[Uno->rBufHead] == frameMagic0) {
+      n = checkFrame(Uno->rBuf+Uno->rBufHead, Uno->rBufLen-Uno->rBufHead);
+      if (n > 0) {                               // a good frame: hand it back
+	start = Uno->rBufHead;
+	Uno->rBufHead += n;
+	if (Uno->rBufScan < Uno->rBufHead) Uno->rBufScan = Uno->rBufHead;
+	Uno->rBufSaved = Uno->rBuf[Uno->rBufHead];
+	Uno->rBuf[Uno->rBufHead] = 0;
+	*line = Uno->rBuf + start;
+	return(n);
+      };
+      if (n < 0) {                               // a bad one: skip its magic byte
+	fprintf(stderr, "[%WS] Bad frame from %s discarded\n", Uno->devName);
+	if (++Uno->rBufHead > Uno->rBufScan) Uno->rBufScan = Uno->rBufHead;
+	continue;
+      };
+      eol = NULL;                                // a partial one: go read the rest
+    }
+    else {
+      eol = memchr(Uno->rBuf+Uno->rBufScan, '\n', Uno->rBufLen-Uno->rBufScan);
+      if (Uno->binary) {                         // a frame starting before the '\n'?
+	mark = memchr(Uno->rBuf+Uno->rBufHead, frameMagic0,
+		      (eol ? eol+1 : Uno->rBuf+Uno->rBufLen) - (Uno->rBuf+Uno->rBufHead));
+	if (mark != NULL) {                      // yes: what's ahead of it is debris
+	  fprintf(stderr, "[%WS] %d stray bytes from %s discarded\n",
+		  (int) (mark-Uno->rBuf) - Uno->rBufHead, Uno->devName);
+	  Uno->rBufHead = mark - Uno->rBuf;
+	  if (Uno->rBufScan < Uno->rBufHead) Uno->rBufScan = Uno->rBufHead;
+	  continue;
+	};
+      };
     };
-  if(Uno->rBufLen > 0) {
-    Uno->rBuf[Uno->rBufLen] = 0;                        // put a "null" at the end
-    lbufPtr=0; 
-    do {
-      lbuf[lbufPtr++] = Uno->rBuf[rBufPtr++];
-    } while ( (rBufPtr<Uno->rBufLen) && (lbuf[lbufPtr-1] != '\n') );
-    lbuf[lbufPtr] = 0;                        // null-terminate the line
-    if ( rBufPtr == Uno->rBufLen ) rBufPtr = Uno->rBufLen = 0;    // if we're at end of buffer, say it's empty
-    gotLine = true;
-  };                                          // end of loop to copy receive-->line
-  return(gotLine);
+    if (eol != NULL) {                           // found a complete line
+      start = Uno->rBufHead;
+      Uno->rBufHead = Uno->rBufScan = eol+1 - Uno->rBuf;
+      if (Uno->rBufOverlong) {                   // it's the tail of one we're discarding
+	Uno->rBufOverlong = false;
+	continue;
+      };
+      Uno->rBufSaved = Uno->rBuf[Uno->rBufHead];
+      Uno->rBuf[Uno->rBufHead] = 0;              // null-terminate the line
+      *line = Uno->rBuf + start;
+      return(Uno->rBufHead - start);
+    };
+    if (!Uno->binary || Uno->rBuf[Uno->rBufHead] != frameMagic0)
+      Uno->rBufScan = Uno->rBufLen;              // no '\n' in what we have
+    if (Uno->rBufHead > 0) {                     // slide the partial line to the front
+      memmove(Uno->rBuf, Uno->rBuf+Uno->rBufHead, Uno->rBufLen-Uno->rBufHead);
+      Uno->rBufLen  -= Uno->rBufHead;
+      Uno->rBufScan -= Uno->rBufHead;
+      Uno->rBufHead  = 0;
+    };
+    if (Uno->rBufLen == rBufSize) {              // no room left, and still no '\n'
+      if (!Uno->rBufOverlong)
+	fprintf(stderr, "[%WS] Line longer than %d bytes from %s discarded\n",
+		rBufSize, Uno->devName);
+      Uno->rBufOverlong = true;
+      Uno->rBufLen = Uno->rBufScan = 0;
+    };
+    n = RS232_PollComport(Uno->portNum, Uno->rBuf+Uno->rBufLen, rBufSize-Uno->rBufLen);
+    if (n <= 0) {
+      Uno->rBufSaved = Uno->rBuf[Uno->rBufHead];
+      return(n);                                 // nothing more has arrived, or never will
+    };
+    Uno->rBufLen += n;
+  };
 };                                          // end getDataLine()
 
+/* Start of resetDataLines()
+ *------------------------------------------------------------------------------
+ * Empties the port's receive buffer, as when the port is (re)opened
+*/
+void resetDataLines(struct commPort *Uno) {
+  Uno->rBufHead = Uno->rBufScan = Uno->rBufLen = 0;
+  Uno->rBufSaved = Uno->rBuf[0];
+  Uno->rBufOverlong = false;
+}; // end resetDataLines()
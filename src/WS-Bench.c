@@ -0,0 +1,217 @@
+/*  WS-Bench.c
+    End-to-end ingest timing for the WeatherStation controller.
+
+    With "-n samples", ws doesn't wait for the sample timer: it keeps
+    "window" (-w, default 1) "sample" commands outstanding at each probe,
+    sending another as each sample is recorded, until it has recorded
+    "samples" of them.  Everything else is the ordinary path -- the
+    event loop, getDataLine(), the parser thread, the store thread, and
+    appendToDB()/flushDB() or the rpt/xml output -- so what is timed is
+    what ws does with real probes.  Run it against wpsim (see "make bench").
+    Once benchStart() has begun the run, these routines are called only by
+    the store thread.
+
+    For each sample, the latency is the time from writing "sample\n" to the
+    probe's port until the sample is committed: printed and flushed (rpt),
+    written to the xml file (xml), or in a database transaction that has
+    committed (sql).  Latencies go into a log-linear histogram (about 3%
+    resolution, 1 usec to days) so that memory use doesn't grow with the
+    run.  At the end ws reports samples/sec, latency percentiles and a
+    coarse histogram, its CPU time, and its peak resident set size.
+
+    A sample that doesn't arrive within benchStallMs (e.g., one corrupted
+    in transit) is counted as lost, and the probe's window is refilled.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "rs232.h"
+#include "WS.h"
+
+#define benchStallMs 2000                 // no sample for this long: count window as lost
+#define hSub   32                         // histogram buckets per power of 2
+#define hBuckets (2*hSub + 40*hSub)       // 0 .. 2^45 usec
+
+long benchSamples = 0;                    // -n: samples to take; 0 = normal operation
+int benchWindow = 1;                      // -w: "sample" commands outstanding per probe
+
+static struct timespec sentAt[maxProbes][benchWindowMax];  // per-probe FIFO of send times
+static int sentHead[maxProbes], sentCount[maxProbes];
+static struct timespec pendAt[dbBatchMax];  // recorded, awaiting commit (sql)
+static int nPend;
+static long nSent, nDone, nLost, seenCommits;
+static unsigned long hist[hBuckets];
+static double latMax;
+static struct timespec tStart, tLast, tHeard;
+static struct rusage ruStart;
+
+/* Microseconds from t0 to t1 */
+static double usecs(struct timespec *t0, struct timespec *t1) {
+  return( (t1->tv_sec-t0->tv_sec)*1e6 + (t1->tv_nsec-t0->tv_nsec)/1e3 );
+};
+
+/* Histogram bucket for a latency of v usec, and the value a bucket stands for */
+static int bucketOf(unsigned long long v) {
+  int shift = 0;
+
+  while ( (v>>shift) >= 2*hSub ) shift++;
+  return( shift==0 ? (int) v : hSub*(shift+1) + (int) ((v>>shift) - hSub) );
+};
+static double valueOf(int b) {
+  int shift = b/hSub - 1;
+
+  if (b < 2*hSub) return(b);
+  return( ((b%hSub + hSub) + 0.5) * (double) (1ULL<<shift) );
+};
+
+/* Record one latency, ending now */
+static void record(struct timespec *t0, struct timespec *now) {
+  double us = usecs(t0, now);
+  int b;
+
+  if (us < 0) us = 0;
+  b = bucketOf( (unsigned long long) us );
+  hist[b < hBuckets ? b : hBuckets-1]++;
+  if (us > latMax) latMax = us;
+  nDone++;
+  tLast = *now;
+};
+
+/* Ask the probe for another sample, if we still want one */
+static void request(struct commPort *Uno) {
+  int p = Uno->probeID, i;
+
+  if (Uno->down || nSent >= benchSamples || sentCount[p] >= benchWindow) return;
+  i = (sentHead[p] + sentCount[p]++) % benchWindowMax;
+  RS232_SendBuf(Uno->portNum, "sample\n", 7);
+  clock_gettime(CLOCK_MONOTONIC, &sentAt[p][i]);
+  nSent++;
+};
+
+/* Start of benchStart()
+ *------------------------------------------------------------------------------
+ * Fills each probe's window with "sample" commands, in place of the timer
+*/
+void benchStart(struct commPort probes[], int nProbes) {
+  int i, w;
+
+  if (benchWindow < 1) benchWindow = 1;
+  if (benchWindow > benchWindowMax) benchWindow = benchWindowMax;
+  getrusage(RUSAGE_SELF, &ruStart);
+  clock_gettime(CLOCK_MONOTONIC, &tStart);
+  tLast = tHeard = tStart;
+  for (w=0; w<benchWindow; w++)
+    for (i=0; i<nProbes; i++) request(&probes[i]);
+}; // end benchStart()
+
+/* Start of benchStored()
+ *------------------------------------------------------------------------------
+ * Called when a probe's sample has been completely stored.  Matches it with
+ * the oldest outstanding "sample" sent to that probe, records the latency
+ * if the sample is already committed (otherwise when benchCommitted() sees
+ * the database commit), and sends the next "sample".
+*/
+void benchStored(struct commPort *Uno) {
+  extern storeModes storeMode;
+  int p = Uno->probeID;
+
+  if (sentCount[p] == 0) return;            // not one we asked for
+  clock_gettime(CLOCK_MONOTONIC, &tHeard);
+  if (storeMode == sqlMode && nPend < dbBatchMax)
+    pendAt[nPend++] = sentAt[p][sentHead[p]];
+  else
+    record(&sentAt[p][sentHead[p]], &tHeard);
+  sentHead[p] = (sentHead[p]+1) % benchWindowMax;
+  sentCount[p]--;
+  benchCommitted();
+  request(Uno);
+}; // end benchStored()
+
+/* Start of benchCommitted()
+ *------------------------------------------------------------------------------
+ * If the database has committed since we last looked, every sample awaiting
+ * commit is now in the table: record their latencies
+*/
+void benchCommitted(void) {
+  extern long dbCommits;
+  struct timespec now;
+  int i;
+
+  if (nPend == 0 || dbCommits == seenCommits) return;
+  seenCommits = dbCommits;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i=0; i<nPend; i++) record(&pendAt[i], &now);
+  nPend = 0;
+}; // end benchCommitted()
+
+/* Start of benchCheck()
+ *------------------------------------------------------------------------------
+ * Called after each event.  Counts samples that have stalled for benchStallMs
+ * as lost and re-fills the windows; returns true once the run is complete,
+ * with every sample recorded, committed, or lost.
+*/
+boolean benchCheck(struct commPort probes[], int nProbes) {
+  struct timespec now;
+  int i, w;
+
+  if (nDone + nLost + nPend >= benchSamples) {
+    if (nPend > 0) flushDB();               // commit the last, partial batch
+    benchCommitted();
+    return(nDone + nLost >= benchSamples);
+  };
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if ( usecs(&tHeard, &now) < benchStallMs*1000.0 ) return(false);
+  for (i=0; i<nProbes; i++) {
+    if (sentCount[i] > 0)
+      fprintf(stderr, "[%WS] No answer from %s for %d sec; %d sample%s counted as lost\n",
+	      probes[i].devName, benchStallMs/1000, sentCount[i], sentCount[i]>1 ? "s" : "");
+    nLost += sentCount[i];
+    sentCount[i] = 0;
+  };
+  tHeard = now;
+  for (w=0; w<benchWindow; w++)
+    for (i=0; i<nProbes; i++) request(&probes[i]);
+  return(false);
+}; // end benchCheck()
+
+/* Start of benchReport()
+ *------------------------------------------------------------------------------
+ * Prints the run's throughput, latency percentiles and histogram, CPU time,
+ * and peak RSS to "out"
+*/
+void benchReport(FILE *out, char *mode, int nProbes) {
+  static const double pct[] = {50, 90, 99, 99.9};
+  static const char *pctName[] = {"p50", "p90", "p99", "p999"};
+  struct rusage ru;
+  double secs, user, sys, lim;
+  unsigned long sum, n;
+  int b, i;
+
+  getrusage(RUSAGE_SELF, &ru);
+  secs = usecs(&tStart, &tLast)/1e6;
+  user = (ru.ru_utime.tv_sec-ruStart.ru_utime.tv_sec) + (ru.ru_utime.tv_usec-ruStart.ru_utime.tv_usec)/1e6;
+  sys  = (ru.ru_stime.tv_sec-ruStart.ru_stime.tv_sec) + (ru.ru_stime.tv_usec-ruStart.ru_stime.tv_usec)/1e6;
+
+  fprintf(out, "ws %s: %d probe%s, window %d: %ld samples in %.3f sec = %.1f samples/sec",
+	  mode, nProbes, nProbes>1 ? "s" : "", benchWindow, nDone, secs, secs>0 ? nDone/secs : 0.0);
+  if (nLost > 0) fprintf(out, " (%ld lost)", nLost);
+  fprintf(out, "\n  latency, \"sample\" to committed:");
+  for (i=0; i<4; i++) {                     // each percentile: first bucket that reaches it
+    for (b=0, sum=0; b<hBuckets && (sum+=hist[b]) < pct[i]/100*nDone; b++) ;
+    fprintf(out, "  %s %.3f ms", pctName[i], (nDone>0 ? valueOf(b) : 0)/1000);
+  };
+  fprintf(out, "  max %.3f ms\n", latMax/1000);
+  for (lim=100, b=0; nDone>0 && b<hBuckets; lim*=10) {   // decades, from 100 usec
+    for (n=0; b<hBuckets && valueOf(b) < lim; b++) n += hist[b];
+    if (n > 0)
+      fprintf(out, "    < %9.1f ms %9lu %5.1f%%\n", lim/1000, n, 100.0*n/nDone);
+  };
+  fprintf(out, "  cpu %.3f sec user + %.3f sec system = %.1f usec/sample; peak RSS %ld kB\n",
+	  user, sys, nDone>0 ? (user+sys)*1e6/nDone : 0.0, ru.ru_maxrss);
+}; // end benchReport()
@@ -2,13 +2,57 @@
     Procedures to append  meterological data to MySQL or sqlite3 database.
 
     Written by HDTodd, hdtodd@gmail.com, 2016, for use with WeatherStation.c
+
+    The sqlite3 database is opened once, in initDBMgr(), and held open for
+    the life of the run.  Rows are added through a single prepared INSERT
+    that is reset and re-bound for each sample rather than re-parsed,
+    and the handle is released by closeDBMgr() when ws terminates.
+
+    MySQL works the same way, through one long-lived connection and its
+    server-side prepared INSERT.  If the server has gone away, the
+    connection is re-opened, the INSERT is re-prepared, and the batch is
+    retried once before ws gives up.
+
+    There is one writer: ws's store thread (storeItems() in WS.c), or the
+    main thread of "ws import", calls appendToDB() and flushDB().  So the
+    queue, the rollup cache, and the connection need no locks.
+
+    Rows come as samples already parsed and checked (see parseSample() in
+    WS-Sample.c), and each field is bound as its column's type -- text,
+    whole number, real, or NULL for a reading the probe sent as "nan" --
+    so the database has no text to convert, and no text from the probe
+    ever becomes part of a statement.
+
+    Rows are not written as they arrive: appendToDB() queues them, and
+    flushDB() commits the queue as one transaction once it holds
+    dbBatchRows rows or its oldest row is dbBatchSecs old.  The sqlite3
+    file is put in WAL mode, so that readers -- wsq, the web pages, ws -H
+    -- don't block the commit; if another writer holds the database past
+    the busy timeout, the transaction is rolled back and the queue kept
+    for the next flush rather than lost.  Every row is
+    tagged with the probe_id of the probe that sent it; ProbeData's key
+    is (date_time, probe_id) so that probes sampled in the same second
+    don't collide.
+
+    Each row that is added is also folded into hourly and daily rollups,
+    ProbeHourly and ProbeDaily: for each period and probe, the count of
+    samples and, for each numeric column, its min, max, mean, and count
+    (an absent DS18's reading doesn't count).  A chart of a week or a year
+    can then read a few hundred rollup rows rather than every sample.  The
+    rollups are kept in memory for the periods being recorded, loaded from
+    the table when a period is first seen, and written back in the same
+    transaction as the rows that changed them, so they always agree with
+    ProbeData.  When a rollup table is first created, it is filled from the
+    rows already in ProbeData.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <math.h>
 #include "WS.h"
-char sqlString[300];
+char sqlString[512];
 static int callback(void *NotUsed, int argc, char **argv, char **azColName);
 
 #ifndef USE_SQLITE3
@@ -27,22 +71,69 @@ static int callback(void *NotUsed, int argc, char **argv, char **azColName);
   #include <my_global.h>
   #include <my_sys.h>
   #include <mysql.h>
+  #include <errmsg.h>
+  #include <mysqld_error.h>
 #endif
 
+#define nDBFields nSampleFields           // date_time + 4 MPL/DHT22 + 4 DS18 (label,temp)
+#define insertVals "VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?)"
+
+/* The numeric columns of ProbeData (fieldList[] in WS.c), as rolled up:
+   which of a sample's fields each is, and which is its DS18 label, if any */
+static const struct rollCol {
+  char *name;
+  int fld, lbl;
+} rollCols[] = {
+  {"mpl_press", 1, -1}, {"mpl_temp", 2, -1}, {"dht22_temp", 3, -1}, {"dht22_rh", 4, -1},
+  {"ds18_1_temp", 6, 5}, {"ds18_2_temp", 8, 7}, {"ds18_3_temp", 10, 9}, {"ds18_4_temp", 12, 11}};
+#define nRollCols 8
+#define rollCacheMax 128                  // periods held in memory between writes
+static const char *rollTable[2] = {"ProbeHourly", "ProbeDaily"};
+struct rollup {                           // one period's rollup for one probe
+  char period[20];                        // "yyyy-mm-dd hh:00:00" or "yyyy-mm-dd"
+  int kind, probeID;                      // 0 hourly, 1 daily
+  boolean dirty;
+  long n, cn[nRollCols];
+  double min[nRollCols], max[nRollCols], sum[nRollCols];
+};
+static struct rollup rollCache[rollCacheMax];
+static int nRollCache = 0;
+static boolean rollFailed = false;        // a write to make room failed, or was busy
+static void initRollups(void);
+static void rollupAdd(int probeID, struct wsSample *s);
+static boolean rollupWrite(void);
+
 #ifdef USE_MYSQL
   static char *opt_host_name = myHost;    // server host (default=localhost)
   static char *opt_user_name = myUsrName; // username (default=login name)
   static char *opt_password =  myPwd;     // password (default=none)
   static unsigned int opt_port_num = 0;   // port number (use built-in value)
   static char *opt_socket_name = NULL;    // socket name (use built-in value)
-static char *opt_db_name =     myDB;      // database name (default=none)
+  char *dbName =                myDB;      // database name; may be reset before initDBMgr()
   static unsigned int opt_flags = 0;      // connection flags (none)
-  static MYSQL *conn;                     // pointer to connection handler
-  MYSQL_RES *res;
-  MYSQL_ROW row;
+  static MYSQL *dbConn;                   // connection handler, held for the run
+  static MYSQL_STMT *dbStmt;              //   and its prepared INSERT
+  static boolean openConn(boolean quiet);
+  static void closeConn(void);
+  #define connLost(err) ((err)==CR_SERVER_GONE_ERROR || (err)==CR_SERVER_LOST || (err)==CR_CONN_HOST_ERROR)
 #endif
+
+int dbBatchRows = 64;                     // commit when this many rows are queued
+int dbBatchSecs = 60;                     //   or when the oldest has waited this long
+static struct wsSample dbQueue[dbBatchMax];  // rows waiting for the next transaction
+static int dbQueueID[dbBatchMax];         //   and the probes that sent them
+static int dbQueued = 0;
+long dbCommits = 0;                       // transactions committed, for ws -n timing
+long dbRowsAdded = 0, dbDuplicates = 0;   // rows committed, and rows skipped as duplicates
+boolean dbReportDups = true;              // complain about each duplicate (not when importing)
+static time_t dbFirstQueued;
 #ifdef USE_SQLITE3
-  sqlite3 *db;                            // database handle 
+  #define dbBusy(rc) (((rc)&0xff)==SQLITE_BUSY || ((rc)&0xff)==SQLITE_LOCKED)
+  #define closeTries 3                    // flushes tried for the last rows, if busy
+  char *dbName = DBName;                  // database file; may be reset before initDBMgr()
+  sqlite3 *db = NULL;                     // database handle, open for the life of the run
+  static sqlite3_stmt *insStmt = NULL;    // prepared INSERT, re-bound for each row
+  static sqlite3_stmt *rollSel[2], *rollRep[2];  // read and replace a rollup row
   char *zErrMsg = 0,			  // returned error code
        *sql, 				  // sql command string
        outstr[200];                       // space for datetime string
@@ -54,21 +145,33 @@ static char *opt_db_name =     myDB;      // database name (default=none)
 
   void initDBMgr(void) {
 #ifdef USE_SQLITE3
-  rc = sqlite3_open(DBName, &db);
+  sqlite3_stmt *st;
+
+  rc = sqlite3_open(dbName, &db);
   if ( rc ) {
-    fprintf(stderr, "[?WS] Can't open or create database %s\n%s\n", DBName, sqlite3_errmsg(db));
+    fprintf(stderr, "[?WS] Can't open or create database %s\n%s\n", dbName, sqlite3_errmsg(db));
     exit(0);
   } else {
-    fprintf(stdout, "[%WS] Opened database %s\n", DBName);
+    fprintf(stdout, "[%WS] Opened database %s\n", dbName);
+  };
+  sqlite3_busy_timeout(db, 5000);           // wait out another writer, briefly
+
+  // In WAL mode readers don't block the writer, nor it them
+  if ( sqlite3_prepare_v2(db, "PRAGMA journal_mode=WAL", -1, &st, NULL) == SQLITE_OK ) {
+    if ( sqlite3_step(st) != SQLITE_ROW
+	 || strcmp((const char *) sqlite3_column_text(st, 0), "wal") != 0 )
+      fprintf(stderr, "[%WS] Can't put %s in WAL mode; readers may delay commits\n", dbName);
+    sqlite3_finalize(st);
   };
 
   // If the table doesn't exist, create it
   strcpy(sqlString, "CREATE TABLE if not exists ProbeData ");
-  strcat(sqlString, "(date_time TEXT PRIMARY KEY, mpl_press INT, mpl_temp REAL, dht22_temp REAL, dht22_rh INT,");
+  strcat(sqlString, "(date_time TEXT, mpl_press INT, mpl_temp REAL, dht22_temp REAL, dht22_rh INT,");
   strcat(sqlString, "ds18_1_lbl TEXT, ds18_1_temp REAL,");
   strcat(sqlString, "ds18_2_lbl TEXT, ds18_2_temp REAL,");
   strcat(sqlString, "ds18_3_lbl TEXT, ds18_3_temp REAL,");
-  strcat(sqlString, "ds18_4_lbl TEXT, ds18_4_temp REAL)");
+  strcat(sqlString, "ds18_4_lbl TEXT, ds18_4_temp REAL,");
+  strcat(sqlString, "probe_id INT NOT NULL DEFAULT 0, PRIMARY KEY (date_time, probe_id))");
   rc = sqlite3_exec(db, sqlString, callback, 0, &zErrMsg);
   if ( rc != SQLITE_OK ) {
     fprintf(stderr, "[?WS] Can't open or create database table 'ProbeData'\n");
@@ -78,61 +181,560 @@ static char *opt_db_name =     myDB;      // database name (default=none)
   } else {
     fprintf(stdout, "[%WS] Table 'ProbeData' opened or created successfully\n");
   };
-  sqlite3_close(db); 
+
+  // Tables from before multi-probe support lack probe_id: add it, with
+  // their rows credited to the first probe
+  if ( sqlite3_table_column_metadata(db, NULL, "ProbeData", "probe_id", NULL, NULL, NULL, NULL, NULL)
+       != SQLITE_OK ) {
+    rc = sqlite3_exec(db, "ALTER TABLE ProbeData ADD COLUMN probe_id INT NOT NULL DEFAULT 0",
+		      NULL, 0, &zErrMsg);
+    if ( rc != SQLITE_OK ) {
+      fprintf(stderr, "[?WS] Can't add column 'probe_id' to table 'ProbeData'\n");
+      fprintf(stderr, "\tSQL error: %s\n", zErrMsg);
+      exit(EXIT_FAILURE);
+    };
+    fprintf(stdout, "[%WS] Added column 'probe_id' to table 'ProbeData'\n");
+    fprintf(stdout, "[%WS] Its key is still date_time alone, so only one probe can record to it\n");
+  };
+
+  // Compile the INSERT once; appendToDB() just binds new values to it
+  rc = sqlite3_prepare_v2(db, insertCols insertVals, -1, &insStmt, NULL);
+  if ( rc != SQLITE_OK ) {
+    fprintf(stderr, "[?WS] Can't prepare INSERT for table 'ProbeData'\n");
+    fprintf(stderr, "\tSQL error: %s\n", sqlite3_errmsg(db));
+    exit(EXIT_FAILURE);
+  };
+  initRollups();
+#endif
+#ifdef USE_MYSQL
+  if ( !openConn(false) ) exit(EXIT_FAILURE);
+  fprintf(stdout, "[%WS] Opened MySQL database %s\n", dbName);
 #endif
   };
 
-void appendToDB(unsigned char lbuf[]) {	    
+/* Start of appendToDB()
+ *------------------------------------------------------------------------------
+ * Queues sample "s" from probe "probeID" for the next transaction.  The
+ * queue is committed by flushDB() when it holds dbBatchRows rows, or when
+ * the oldest row has waited dbBatchSecs (see dbSecsToFlush()), or when ws
+ * terminates and calls closeDBMgr().
+*/
+void appendToDB(int probeID, struct wsSample *s) {
+  if (dbQueued == dbBatchMax && !flushDB()) {
+    fprintf(stderr, "[?WS] %d rows are queued for a busy database; sample %s from probe %d not recorded\n",
+	    dbQueued, s->dt, probeID);
+    return;
+  };
+  if (dbQueued == 0) dbFirstQueued = time(NULL);
+  dbQueueID[dbQueued] = probeID;
+  dbQueue[dbQueued++] = *s;
+  if (dbQueued >= dbBatchRows || dbQueued >= dbBatchMax) flushDB();
+}; // end appendToDB
 
+/* Start of dbSecsToFlush()
+ *------------------------------------------------------------------------------
+ * Returns the number of seconds until the queued rows must be committed,
+ * 0 if they're overdue, or -1 if nothing is queued
+*/
+int dbSecsToFlush(void) {
+  int left;
+
+  if (dbQueued == 0) return(-1);
+  left = dbBatchSecs - (int) (time(NULL) - dbFirstQueued);
+  return( left>0 ? left : 0 );
+}; // end dbSecsToFlush
+
+/* Start of flushDB()
+ *------------------------------------------------------------------------------
+ * Commits all queued rows in a single transaction, so the database pays for
+ * one journal sync per batch rather than one per row.  A row whose date_time
+ * is already in the table is reported and skipped.  If the sqlite3 database
+ * stays busy (locked by another writer), the transaction is rolled back and
+ * false is returned, with the rows still queued for the next try; any other
+ * failure is fatal.
+*/
+boolean flushDB(void) {
+  const char *text;
+  double v;
+  int i, k, r, added = 0, dups = 0;
+
+  if (dbQueued == 0) return(true);
 #ifdef USE_MYSQL
-	    conn = mysql_init (NULL);           // initialize connection handler
-	    if (conn == NULL) {
-	      fprintf (stderr, "[?WS] mysql_init() failed (probably out of memory)\n");
-	      exit (EXIT_FAILURE);
-	    };
-	    if (mysql_real_connect (conn,       // connect to server
-                          opt_host_name, opt_user_name, opt_password,
-			  opt_db_name, opt_port_num, opt_socket_name, 
+  MYSQL_BIND bind[nDBFields+1];
+  unsigned long len[nDBFields];
+  double dval[nDBFields];
+  int ival[nDBFields];
+  boolean ok = false;
+  int try;
+
+  for (try=0; try<2 && !ok; try++) {     // one retry of the batch after a reconnect
+    if (dbStmt == NULL && !openConn(true)) break;
+    ok = (mysql_query(dbConn, "START TRANSACTION") == 0);
+    added = dups = 0;
+    for (r=0; r<dbQueued && ok; r++) {
+      memset(bind, 0, sizeof(bind));
+      for (i=0; i<nDBFields; i++) {      // each as its column's type
+	k = sampleField(&dbQueue[r], i, &v, &text);
+	if (k == 'd' || k == 'l') {
+	  len[i] = strlen(text);
+	  bind[i].buffer_type   = MYSQL_TYPE_STRING;
+	  bind[i].buffer        = (char *) text;
+	  bind[i].buffer_length = len[i];
+	  bind[i].length        = &len[i];
+	}
+	else if (isnan(v)) bind[i].buffer_type = MYSQL_TYPE_NULL;
+	else if (k == 'i') {
+	  ival[i] = (int) lrint(v);
+	  bind[i].buffer_type   = MYSQL_TYPE_LONG;
+	  bind[i].buffer        = &ival[i];
+	}
+	else {
+	  dval[i] = v;
+	  bind[i].buffer_type   = MYSQL_TYPE_DOUBLE;
+	  bind[i].buffer        = &dval[i];
+	};
+      };
+      bind[nDBFields].buffer_type = MYSQL_TYPE_LONG;
+      bind[nDBFields].buffer      = &dbQueueID[r];
+      if ( mysql_stmt_bind_param(dbStmt, bind) == 0
+	   && mysql_stmt_execute(dbStmt) == 0 ) {
+	rollupAdd(dbQueueID[r], &dbQueue[r]);
+	added++;
+	continue;
+      };
+      if (mysql_stmt_errno(dbStmt) == ER_DUP_ENTRY) {
+	if (dbReportDups)
+	  fprintf(stderr, "[%WS] Duplicate date_time %s from probe %d; row not recorded\n",
+		  dbQueue[r].dt, dbQueueID[r]);
+	dups++;
+	continue;
+      };
+      if ( !connLost(mysql_stmt_errno(dbStmt)) ) {
+	fprintf(stderr, "[?WS] MySQL INSERT statement failed\n");
+	fprintf(stderr, "\t%s\n", mysql_stmt_error(dbStmt) );
+	exit (EXIT_FAILURE);
+      };
+      ok = false;
+    };
+    if (ok) ok = rollupWrite();
+    if (ok) ok = (mysql_commit(dbConn) == 0);
+    if (!ok) {
+      nRollCache = 0;                     // rolled back: re-read them from the tables
+      if ( dbConn && !connLost(mysql_errno(dbConn)) && dbStmt && !connLost(mysql_stmt_errno(dbStmt)) ) {
+	fprintf(stderr, "[?WS] MySQL transaction failed\n\t%s\n", mysql_error(dbConn));
+	exit (EXIT_FAILURE);
+      };
+      fprintf(stderr, "[%WS] Lost connection to MySQL server; reconnecting\n");
+      closeConn();
+    };
+  };
+  if (!ok) {
+    fprintf(stderr, "[?WS] MySQL server unavailable; can't record %d queued row%s\n",
+	    dbQueued, dbQueued>1 ? "s" : "");
+    exit (EXIT_FAILURE);
+  };
+#endif
+#ifdef USE_SQLITE3
+  boolean busy = false;
+
+  if ( (rc=sqlite3_exec(db, "BEGIN", NULL, 0, NULL)) != SQLITE_OK ) {
+    fprintf(stderr, "[?WS] SQL error starting transaction: %s\n", sqlite3_errmsg(db));
+    exit(EXIT_FAILURE);
+  };
+  for (r=0; r<dbQueued && !busy; r++) {
+    for (i=0; i<nDBFields; i++) {         // each as its column's type
+      k = sampleField(&dbQueue[r], i, &v, &text);
+      if (k == 'd' || k == 'l') sqlite3_bind_text(insStmt, i+1, text, -1, SQLITE_STATIC);
+      else if (isnan(v)) sqlite3_bind_null(insStmt, i+1);
+      else if (k == 'i') sqlite3_bind_int(insStmt, i+1, (int) lrint(v));
+      else sqlite3_bind_double(insStmt, i+1, v);
+    };
+    sqlite3_bind_int(insStmt, nDBFields+1, dbQueueID[r]);
+    rc = sqlite3_step(insStmt);
+    sqlite3_reset(insStmt);
+    if ( rc == SQLITE_DONE ) {
+      rollupAdd(dbQueueID[r], &dbQueue[r]);
+      added++;
+    }
+    else if ( rc == SQLITE_CONSTRAINT ) {
+      if (dbReportDups)
+	fprintf(stderr, "[%WS] Duplicate date_time %s from probe %d; row not recorded\n",
+		dbQueue[r].dt, dbQueueID[r]);
+      dups++;
+    }
+    else if ( dbBusy(rc) ) busy = true;
+    else {
+      fprintf(stderr, "[?WS] SQL error during row insert: %s\n", sqlite3_errmsg(db));
+      fprintf(stderr, "\tCan't write to database file %s: check permissions\n", dbName);
+      exit(EXIT_FAILURE);
+    };
+  };
+  if (!busy) busy = !rollupWrite();
+  if ( !busy && (rc=sqlite3_exec(db, "COMMIT", NULL, 0, NULL)) != SQLITE_OK ) {
+    if ( !dbBusy(rc) ) {
+      fprintf(stderr, "[?WS] SQL error committing %d rows: %s\n", dbQueued, sqlite3_errmsg(db));
+      fprintf(stderr, "\tCan't write to database file %s: check permissions\n", dbName);
+      exit(EXIT_FAILURE);
+    };
+    busy = true;
+  };
+  if (busy) {
+    sqlite3_exec(db, "ROLLBACK", NULL, 0, NULL);
+    nRollCache = 0;                       // rolled back: re-read them from the tables
+    dbFirstQueued = time(NULL);           // try again when the next batch is due
+    fprintf(stderr, "[%WS] Database %s is busy; %d queued row%s kept for the next commit\n",
+	    dbName, dbQueued, dbQueued>1 ? "s" : "");
+    return(false);
+  };
+#endif
+  dbQueued = 0;
+  dbCommits++;
+  dbRowsAdded += added;
+  dbDuplicates += dups;
+  return(true);
+}; // end flushDB
+
+/* Start of closeDBMgr()
+ *------------------------------------------------------------------------------
+ * Commits anything still queued, then releases the prepared INSERT and the
+ * database handle opened by initDBMgr()
+*/
+void closeDBMgr(void) {
+#ifdef USE_SQLITE3
+  int i;
+
+  for (i=0; i<closeTries && !flushDB(); i++) ;
+  if (dbQueued > 0)
+    fprintf(stderr, "[?WS] Database %s stayed busy; %d queued row%s not recorded\n",
+	    dbName, dbQueued, dbQueued>1 ? "s" : "");
+
+  if (insStmt) sqlite3_finalize(insStmt);
+  insStmt = NULL;
+  for (i=0; i<2; i++) {
+    if (rollSel[i]) sqlite3_finalize(rollSel[i]);
+    if (rollRep[i]) sqlite3_finalize(rollRep[i]);
+    rollSel[i] = rollRep[i] = NULL;
+  };
+  if (db) sqlite3_close(db);
+  db = NULL;
+#endif
+#ifdef USE_MYSQL
+  flushDB();
+  closeConn();
+#endif
+}; // end closeDBMgr
+
+#ifdef USE_MYSQL
+/* Start of openConn()
+ *------------------------------------------------------------------------------
+ * Connects to the server, creates ProbeData if it's missing, and prepares
+ * the INSERT.  Returns false, with a message, on failure; "quiet"
+ * suppresses the message for reconnect attempts.
+*/
+static boolean openConn(boolean quiet) {
+  const char *err;
+
+  if ( (dbConn = mysql_init(NULL)) == NULL ) {
+    fprintf (stderr, "[?WS] mysql_init() failed (probably out of memory)\n");
+    exit (EXIT_FAILURE);
+  };
+  if (mysql_real_connect (dbConn,       // connect to server
+			  opt_host_name, opt_user_name, opt_password,
+			  dbName, opt_port_num, opt_socket_name, 
 			  opt_flags) == NULL) {
-	      fprintf (stderr, "[?WS] mysql_real_connect() failed\n");
-	      mysql_close (conn);
-	      exit (EXIT_FAILURE);
-	    };
-
-	    strcpy(sqlString, "INSERT INTO ProbeData VALUES");
-	    strcat(sqlString, lbuf);
-	    if (mysql_query (conn, sqlString) != 0) {   // add the row
-	      fprintf(stderr, "[?WS] MySQL INSERT statement failed\n");
-	      fprintf(stderr, "\t%s\n", mysql_error(conn) );
-	      mysql_close(conn);
-	      exit (EXIT_FAILURE);
-	    };
-
-	    mysql_close (conn);                  // disconnect from server
+    if (!quiet) fprintf (stderr, "[?WS] mysql_real_connect() failed\n\t%s\n", mysql_error(dbConn));
+    closeConn();
+    return(false);
+  };
+
+  // If the table doesn't exist, create it
+  strcpy(sqlString, "CREATE TABLE IF NOT EXISTS ProbeData ");
+  strcat(sqlString, "(date_time DATETIME NOT NULL, mpl_press INT, mpl_temp FLOAT, dht22_temp FLOAT, dht22_rh SMALLINT,");
+  strcat(sqlString, "ds18_1_lbl CHAR(2), ds18_1_temp FLOAT,");
+  strcat(sqlString, "ds18_2_lbl CHAR(2), ds18_2_temp FLOAT,");
+  strcat(sqlString, "ds18_3_lbl CHAR(2), ds18_3_temp FLOAT,");
+  strcat(sqlString, "ds18_4_lbl CHAR(2), ds18_4_temp FLOAT,");
+  strcat(sqlString, "probe_id INT NOT NULL DEFAULT 0, PRIMARY KEY (date_time, probe_id))");
+  if (mysql_query(dbConn, sqlString) != 0) {
+    fprintf(stderr, "[?WS] Can't open or create database table 'ProbeData'\n");
+    fprintf(stderr, "\t%s\n", mysql_error(dbConn) );
+    exit (EXIT_FAILURE);
+  };
+
+  // Tables from before multi-probe support lack probe_id: add it
+  if ( mysql_query(dbConn, "ALTER TABLE ProbeData ADD COLUMN probe_id INT NOT NULL DEFAULT 0") != 0
+       && mysql_errno(dbConn) != ER_DUP_FIELDNAME ) {
+    fprintf(stderr, "[?WS] Can't add column 'probe_id' to table 'ProbeData'\n");
+    fprintf(stderr, "\t%s\n", mysql_error(dbConn) );
+    exit (EXIT_FAILURE);
+  };
+  initRollups();                          // and the rollup tables
+
+  if ( (dbStmt = mysql_stmt_init(dbConn)) == NULL
+       || mysql_stmt_prepare(dbStmt, insertCols insertVals, strlen(insertCols insertVals)) != 0 ) {
+    err = dbStmt ? mysql_stmt_error(dbStmt) : mysql_error(dbConn);
+    if (!quiet) fprintf(stderr, "[?WS] Can't prepare INSERT for table 'ProbeData'\n\t%s\n", err);
+    closeConn();
+    return(false);
+  };
+  return(true);
+};                                         // end openConn()
+
+/* Start of closeConn()
+ *------------------------------------------------------------------------------
+ * Releases the prepared INSERT and the connection
+*/
+static void closeConn(void) {
+  if (dbStmt) mysql_stmt_close(dbStmt);
+  dbStmt = NULL;
+  if (dbConn) mysql_close(dbConn);
+  dbConn = NULL;
+};                                         // end closeConn()
 #endif
+
+/* Start of initRollups()
+ *------------------------------------------------------------------------------
+ * Creates ProbeHourly and ProbeDaily if they don't exist, filling a new one
+ * from ProbeData, and (sqlite3) prepares the statements that read and
+ * replace their rows.  Their columns are period, probe_id, n, and then
+ * <column>_min, _max, _avg, and _n for each of rollCols[].
+*/
+static void initRollups(void) {
+  char sql[4096], cols[1024], sel[2048];
+  boolean existed;
+  int k, c, n;
+
+  for (n=snprintf(cols, sizeof(cols), "period, probe_id, n"), c=0; c<nRollCols; c++)
+    n += snprintf(cols+n, sizeof(cols)-n, ", %s_min, %s_max, %s_avg, %s_n",
+		  rollCols[c].name, rollCols[c].name, rollCols[c].name, rollCols[c].name);
+  for (k=0; k<2; k++) {
+    n = snprintf(sql, sizeof(sql), "CREATE TABLE IF NOT EXISTS %s (period %s NOT NULL, probe_id INT NOT NULL, n INT",
+#ifdef USE_MYSQL
+		 rollTable[k], "VARCHAR(19)");
+#else
+		 rollTable[k], "TEXT");
+#endif
+    for (c=0; c<nRollCols; c++)
+      n += snprintf(sql+n, sizeof(sql)-n, ", %s_min REAL, %s_max REAL, %s_avg REAL, %s_n INT",
+		    rollCols[c].name, rollCols[c].name, rollCols[c].name, rollCols[c].name);
+    snprintf(sql+n, sizeof(sql)-n, ", PRIMARY KEY (period, probe_id))");
+
+    /* The backfill: the same rollups, computed by the database from ProbeData */
+    n = snprintf(sel, sizeof(sel), "INSERT INTO %s (%s) SELECT %s, probe_id, COUNT(*)", rollTable[k], cols,
+#ifdef USE_MYSQL
+		 k==0 ? "DATE_FORMAT(date_time, '%Y-%m-%d %H:00:00')" : "DATE_FORMAT(date_time, '%Y-%m-%d')");
+#else
+		 k==0 ? "SUBSTR(date_time, 1, 13) || ':00:00'" : "SUBSTR(date_time, 1, 10)");
+#endif
+    for (c=0; c<nRollCols; c++) {
+      char v[128];
+
+      if (rollCols[c].lbl < 0) snprintf(v, sizeof(v), "%s", rollCols[c].name);
+	else snprintf(v, sizeof(v), "CASE WHEN ds18_%d_lbl = '**' THEN NULL ELSE %s END",
+		      (rollCols[c].lbl-3)/2, rollCols[c].name);
+      n += snprintf(sel+n, sizeof(sel)-n, ", MIN(%s), MAX(%s), AVG(%s), COUNT(%s)", v, v, v, v);
+    };
+    snprintf(sel+n, sizeof(sel)-n, " FROM ProbeData GROUP BY 1, 2");
+
 #ifdef USE_SQLITE3
-	    /* Open database */
-	    rc = sqlite3_open(DBName, &db);
-	    if ( rc ) {
-	      fprintf(stderr, "[?WS] Can't open database file '%s'\n%s\n", 
-		      DBName, sqlite3_errmsg(db));
-	      exit(EXIT_FAILURE);
-	    };
-
-	    /* Create and execute the INSERT with these data values as parameters*/
-	    strcpy(sqlString,"INSERT INTO ProbeData (date_time, mpl_press, mpl_temp, dht22_temp, dht22_rh,");
-	    strcat(sqlString, "ds18_1_lbl, ds18_1_temp,ds18_2_lbl, ds18_2_temp,ds18_3_lbl, ds18_3_temp, ds18_4_lbl, ds18_4_temp) VALUES ");
-	    strcat(sqlString, lbuf);
-  	    rc = sqlite3_exec(db, sqlString, callback, 0, &zErrMsg);
-	    if ( rc != SQLITE_OK ) {
-	      fprintf(stderr, "[?WS] SQL error during row insert: %s\n", zErrMsg);
-	      fprintf(stderr, "\tCan't write to database file %s: check permissions\n", DBName);
-	      sqlite3_free(zErrMsg);
-	      exit(EXIT_FAILURE);
-	    };
-	    sqlite3_close(db) ;                  // Done with the DB for now so close it
+    sqlite3_stmt *st;
+    char q[1024];
+
+    sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type='table' AND name=?", -1, &st, NULL);
+    sqlite3_bind_text(st, 1, rollTable[k], -1, SQLITE_STATIC);
+    existed = (sqlite3_step(st) == SQLITE_ROW);
+    sqlite3_finalize(st);
+    if ( sqlite3_exec(db, sql, NULL, 0, &zErrMsg) != SQLITE_OK
+	 || (!existed && sqlite3_exec(db, sel, NULL, 0, &zErrMsg) != SQLITE_OK) ) {
+      fprintf(stderr, "[?WS] Can't create table '%s'\n\tSQL error: %s\n", rollTable[k], zErrMsg);
+      exit(EXIT_FAILURE);
+    };
+    if (!existed)
+      fprintf(stdout, "[%WS] Created table '%s', with %d rollups of the rows in 'ProbeData'\n",
+	      rollTable[k], sqlite3_changes(db));
+    snprintf(q, sizeof(q), "SELECT %s FROM %s WHERE period=? AND probe_id=?", cols, rollTable[k]);
+    rc = sqlite3_prepare_v2(db, q, -1, &rollSel[k], NULL);
+    n = snprintf(q, sizeof(q), "REPLACE INTO %s (%s) VALUES (?", rollTable[k], cols);
+    for (c=1; c<3+4*nRollCols; c++) n += snprintf(q+n, sizeof(q)-n, ",?");
+    snprintf(q+n, sizeof(q)-n, ")");
+    if ( rc != SQLITE_OK || sqlite3_prepare_v2(db, q, -1, &rollRep[k], NULL) != SQLITE_OK ) {
+      fprintf(stderr, "[?WS] Can't prepare statements for table '%s'\n", rollTable[k]);
+      fprintf(stderr, "\tSQL error: %s\n", sqlite3_errmsg(db));
+      exit(EXIT_FAILURE);
+    };
 #endif
-}; // end appendToDB
+#ifdef USE_MYSQL
+    MYSQL_RES *res = NULL;
+    char q[128];
+
+    snprintf(q, sizeof(q), "SHOW TABLES LIKE '%s'", rollTable[k]);
+    existed = (mysql_query(dbConn, q) == 0 && (res=mysql_store_result(dbConn)) != NULL
+	       && mysql_num_rows(res) > 0);
+    if (res) mysql_free_result(res);
+    if ( mysql_query(dbConn, sql) != 0 || (!existed && mysql_query(dbConn, sel) != 0) ) {
+      fprintf(stderr, "[?WS] Can't create table '%s'\n\t%s\n", rollTable[k], mysql_error(dbConn));
+      exit(EXIT_FAILURE);
+    };
+    if (!existed)
+      fprintf(stdout, "[%WS] Created table '%s', with %lu rollups of the rows in 'ProbeData'\n",
+	      rollTable[k], (unsigned long) mysql_affected_rows(dbConn));
+#endif
+  };
+};                                         // end initRollups()
+
+/* Start of rollLoad()
+ *------------------------------------------------------------------------------
+ * Reads a period's rollup from its table into e, if it's there
+*/
+static void rollLoad(struct rollup *e) {
+  int c, i;
+
+#ifdef USE_SQLITE3
+  sqlite3_stmt *st = rollSel[e->kind];
+
+  sqlite3_bind_text(st, 1, e->period, -1, SQLITE_STATIC);
+  sqlite3_bind_int(st, 2, e->probeID);
+  if (sqlite3_step(st) == SQLITE_ROW) {
+    e->n = sqlite3_column_int(st, 2);
+    for (c=0, i=3; c<nRollCols; c++, i+=4) {
+      e->min[c] = sqlite3_column_double(st, i);
+      e->max[c] = sqlite3_column_double(st, i+1);
+      e->cn[c]  = sqlite3_column_int(st, i+3);
+      e->sum[c] = sqlite3_column_double(st, i+2) * e->cn[c];
+    };
+  };
+  sqlite3_reset(st);
+#endif
+#ifdef USE_MYSQL
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  char q[1024];
+  int n;
+
+  for (n=snprintf(q, sizeof(q), "SELECT n"), c=0; c<nRollCols; c++)
+    n += snprintf(q+n, sizeof(q)-n, ", %s_min, %s_max, %s_avg, %s_n",
+		  rollCols[c].name, rollCols[c].name, rollCols[c].name, rollCols[c].name);
+  snprintf(q+n, sizeof(q)-n, " FROM %s WHERE period='%s' AND probe_id=%d",
+	   rollTable[e->kind], e->period, e->probeID);
+  if ( mysql_query(dbConn, q) != 0 || (res=mysql_store_result(dbConn)) == NULL ) return;
+  if ( (row=mysql_fetch_row(res)) != NULL ) {
+    e->n = row[0] ? atol(row[0]) : 0;
+    for (c=0, i=1; c<nRollCols; c++, i+=4) {
+      e->min[c] = row[i] ? atof(row[i]) : 0;
+      e->max[c] = row[i+1] ? atof(row[i+1]) : 0;
+      e->cn[c]  = row[i+3] ? atol(row[i+3]) : 0;
+      e->sum[c] = (row[i+2] ? atof(row[i+2]) : 0) * e->cn[c];
+    };
+  };
+  mysql_free_result(res);
+#endif
+};                                         // end rollLoad()
+
+/* Start of rollupAdd()
+ *------------------------------------------------------------------------------
+ * Folds the numeric fields of sample "s", just added to ProbeData, into the
+ * hourly and daily rollups of its period, reading them from the tables
+ * first if they're not already in memory
+*/
+static void rollupAdd(int probeID, struct wsSample *s) {
+  struct rollup *e;
+  char period[20];
+  const char *lbl;
+  double v;
+  int k, c, i;
+
+  for (k=0; k<2; k++) {
+    if (k == 0) snprintf(period, sizeof(period), "%.13s:00:00", s->dt);
+      else snprintf(period, sizeof(period), "%.10s", s->dt);
+    for (i=0; i<nRollCache; i++)
+      if (rollCache[i].kind == k && rollCache[i].probeID == probeID
+	  && strcmp(rollCache[i].period, period) == 0) break;
+    if (i == nRollCache) {                 // not in memory: make room, and read it
+      if (nRollCache == rollCacheMax) {
+	if ( !rollupWrite() ) rollFailed = true;
+	nRollCache = i = 0;
+      };
+      e = &rollCache[nRollCache++];
+      memset(e, 0, sizeof(*e));
+      strcpy(e->period, period);
+      e->kind = k;
+      e->probeID = probeID;
+      rollLoad(e);
+    };
+    e = &rollCache[i];
+    e->n++;
+    for (c=0; c<nRollCols; c++) {
+      if (rollCols[c].lbl >= 0 && sampleField(s, rollCols[c].lbl, NULL, &lbl) && strcmp(lbl, "**") == 0)
+	continue;
+      sampleField(s, rollCols[c].fld, &v, NULL);
+      if (isnan(v)) continue;              // the probe had no reading
+      if (e->cn[c] == 0 || v < e->min[c]) e->min[c] = v;
+      if (e->cn[c] == 0 || v > e->max[c]) e->max[c] = v;
+      e->sum[c] += v;
+      e->cn[c]++;
+    };
+    e->dirty = true;
+  };
+};                                         // end rollupAdd()
+
+/* Start of rollupWrite()
+ *------------------------------------------------------------------------------
+ * Writes the rollups changed since they were last written back to their
+ * tables, in the transaction flushDB() has open.  Returns false if that, or
+ * an earlier write to make room in memory, failed (MySQL) or found the
+ * database busy (sqlite3).
+*/
+static boolean rollupWrite(void) {
+  struct rollup *e;
+  boolean ok = !rollFailed;
+  int r, c;
+
+  rollFailed = false;
+  for (r=0; r<nRollCache; r++) {
+    if ( !(e=&rollCache[r])->dirty ) continue;
+#ifdef USE_SQLITE3
+    sqlite3_stmt *st = rollRep[e->kind];
+
+    sqlite3_bind_text(st, 1, e->period, -1, SQLITE_STATIC);
+    sqlite3_bind_int(st, 2, e->probeID);
+    sqlite3_bind_int64(st, 3, e->n);
+    for (c=0; c<nRollCols; c++)
+      if (e->cn[c] == 0) {                 // no readings: NULL min, max, and mean
+	sqlite3_bind_null(st, 4+4*c);
+	sqlite3_bind_null(st, 5+4*c);
+	sqlite3_bind_null(st, 6+4*c);
+	sqlite3_bind_int64(st, 7+4*c, 0);
+      } else {
+	sqlite3_bind_double(st, 4+4*c, e->min[c]);
+	sqlite3_bind_double(st, 5+4*c, e->max[c]);
+	sqlite3_bind_double(st, 6+4*c, e->sum[c]/e->cn[c]);
+	sqlite3_bind_int64(st, 7+4*c, e->cn[c]);
+      };
+    rc = sqlite3_step(st);
+    sqlite3_reset(st);
+    if ( dbBusy(rc) ) return(false);      // flushDB() rolls back, to try again
+    if (rc != SQLITE_DONE) {
+      fprintf(stderr, "[?WS] SQL error writing to table '%s': %s\n", rollTable[e->kind], sqlite3_errmsg(db));
+      exit(EXIT_FAILURE);
+    };
+#endif
+#ifdef USE_MYSQL
+    char q[2048];
+    int n;
+
+    n = snprintf(q, sizeof(q), "REPLACE INTO %s VALUES ('%s', %d, %ld", rollTable[e->kind],
+		 e->period, e->probeID, e->n);
+    for (c=0; c<nRollCols; c++)
+      if (e->cn[c] == 0) n += snprintf(q+n, sizeof(q)-n, ", NULL, NULL, NULL, 0");
+	else n += snprintf(q+n, sizeof(q)-n, ", %.17g, %.17g, %.17g, %ld",
+			   e->min[c], e->max[c], e->sum[c]/e->cn[c], e->cn[c]);
+    snprintf(q+n, sizeof(q)-n, ")");
+    if (mysql_query(dbConn, q) != 0) ok = false;
+#endif
+    e->dirty = false;
+  };
+  return(ok);
+};                                         // end rollupWrite()
 
 static int callback(void *NotUsed, int argc, char **argv, char **azColName) {
   int i;
@@ -0,0 +1,162 @@
+/*  WS-Events.c
+    Event loop for the WeatherStation controller.
+
+    Rather than sleeping and polling the serial port, ws waits in one
+    place, epoll_wait(), for whichever comes first:
+      o  bytes arriving on the probe's tty (the descriptor opened by rs232.c),
+         or the tty hanging up or failing, e.g., when the probe is unplugged
+      o  the sample timer, a timerfd that fires every SAMPLE_PERIOD seconds
+         on an absolute schedule, so processing time doesn't cause drift
+      o  SIGINT or SIGTERM, delivered through a signalfd and handed on to
+         intHandler() so that "keepReading" works as it always has
+      o  a caller-supplied timeout
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "rs232.h"
+#include "WS.h"
+
+static int epFd = -1;                     // the epoll instance
+static int sigFd = -1;                    // SIGINT/SIGTERM arrive here
+static int tmrFd = -1;                    // sample schedule
+static int sigTag, tmrTag;                // epoll tags for the non-port fds
+
+/* Start of initEvents()
+ *------------------------------------------------------------------------------
+ * Creates the epoll instance and routes SIGINT and SIGTERM to it.  The
+ * signals are blocked so that they are seen only as events.
+*/
+void initEvents(void) {
+  struct epoll_event ev;
+  sigset_t mask;
+
+  if ( (epFd=epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+    perror("[?WS] Can't create event loop");
+    exit(EXIT_FAILURE);
+  };
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  if ( (sigFd=signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC)) < 0 ) {
+    perror("[?WS] Can't create signal descriptor");
+    exit(EXIT_FAILURE);
+  };
+  ev.events = EPOLLIN;
+  ev.data.ptr = &sigTag;
+  epoll_ctl(epFd, EPOLL_CTL_ADD, sigFd, &ev);
+}; // end initEvents()
+
+/* Start of evAddPort()
+ *------------------------------------------------------------------------------
+ * Adds an open probe port to the set watched by evWait().  epoll reports
+ * EPOLLHUP and EPOLLERR on it whether asked to or not.
+*/
+void evAddPort(struct commPort *Uno) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = Uno;
+  if ( epoll_ctl(epFd, EPOLL_CTL_ADD, RS232_GetPortFd(Uno->portNum), &ev) < 0 ) {
+    perror("[?WS] Can't watch probe port");
+    exit(EXIT_FAILURE);
+  };
+}; // end evAddPort()
+
+/* Start of evDropPort()
+ *------------------------------------------------------------------------------
+ * Stops watching a probe port, before it's closed: a hung-up tty stays
+ * "ready" forever, so it would otherwise keep evWait() spinning.
+*/
+void evDropPort(struct commPort *Uno) {
+  epoll_ctl(epFd, EPOLL_CTL_DEL, RS232_GetPortFd(Uno->portNum), NULL);
+}; // end evDropPort()
+
+/* Start of evStartSampling()
+ *------------------------------------------------------------------------------
+ * Arms the sample timer: first sample right away, then every "period" seconds
+*/
+void evStartSampling(int period) {
+  struct itimerspec its;
+  struct epoll_event ev;
+
+  if ( tmrFd < 0 ) {
+    if ( (tmrFd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0 ) {
+      perror("[?WS] Can't create sample timer");
+      exit(EXIT_FAILURE);
+    };
+    ev.events = EPOLLIN;
+    ev.data.ptr = &tmrTag;
+    epoll_ctl(epFd, EPOLL_CTL_ADD, tmrFd, &ev);
+  };
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_nsec = 1;               // "now"
+  its.it_interval.tv_sec = period;
+  timerfd_settime(tmrFd, 0, &its, NULL);
+}; // end evStartSampling()
+
+/* Start of evWait()
+ *------------------------------------------------------------------------------
+ * Waits up to timeoutMs (-1 = forever) for the next event and returns its
+ * type.  For evPort, *port is set to the port that has data waiting; for
+ * evPortDown, to one that has hung up or failed (it may still have lines
+ * to read: a hung-up tty reads as empty, not as end of file).
+*/
+wsEvents evWait(int timeoutMs, struct commPort **port) {
+  struct epoll_event ev;
+  struct signalfd_siginfo si;
+  unsigned long long ticks;
+  int n;
+
+  do
+    n = epoll_wait(epFd, &ev, 1, timeoutMs);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0) return(evTimeout);
+  if (ev.data.ptr == &sigTag) {
+    while ( read(sigFd, &si, sizeof(si)) == sizeof(si) ) intHandler(si.ssi_signo);
+    return(evSignal);
+  };
+  if (ev.data.ptr == &tmrTag) {
+    if ( read(tmrFd, &ticks, sizeof(ticks)) == sizeof(ticks) && ticks > 1 )
+      fprintf(stderr, "[%WS] Fell behind: %llu sample periods elapsed\n", ticks);
+    return(evSample);
+  };
+  *port = (struct commPort *) ev.data.ptr;
+  if (ev.events & (EPOLLHUP|EPOLLERR)) return(evPortDown);
+  return(evPort);
+}; // end evWait()
+
+/* Start of waitForPort()
+ *------------------------------------------------------------------------------
+ * Waits up to timeoutMs for bytes to arrive on one probe port, for use
+ * before the event loop proper is running (e.g., by connectToWP()).
+ * Returns true if there is data to read; false on timeout or ^C.
+*/
+boolean waitForPort(struct commPort *Uno, int timeoutMs) {
+  extern boolean keepReading;
+  struct pollfd pfd[2];
+  struct signalfd_siginfo si;
+  int n;
+
+  pfd[0].fd = RS232_GetPortFd(Uno->portNum);
+  pfd[0].events = POLLIN;
+  pfd[1].fd = sigFd;
+  pfd[1].events = POLLIN;
+  do
+    n = poll(pfd, sigFd<0 ? 1 : 2, timeoutMs);
+  while (n < 0 && errno == EINTR && keepReading);
+  if ( n > 0 && sigFd >= 0 && (pfd[1].revents & POLLIN) )
+    while ( read(sigFd, &si, sizeof(si)) == sizeof(si) ) intHandler(si.ssi_signo);
+  return( n > 0 && (pfd[0].revents & POLLIN) && keepReading );
+}; // end waitForPort()
@@ -0,0 +1,490 @@
+/*  WS-HTTP.c
+    A small HTTP server in ws, for dashboards: "ws -H [addr:]port".
+
+    Two requests are answered, as JSON:
+      GET /latest[?probe=n]
+          the last sample from each probe (or from probe n), from the copy
+          ws keeps in shared memory (see WS-Latest.c), read without a lock:
+          {"samples":[{"probe_id":0,"date_time":"2017-09-19 08:12:07",
+          "recorded_ms":1505822527123,"mpl_press":83813,...},...]}
+      GET /history?field=mpl_press[&start=-7d][&end=now][&n=500 | &r=1h]
+                  [&a=raw|lttb|minmax|avg][&probe=n][&format=json|csv|bin]
+          a field over a time range, as wsq would answer it (see WS-Query.c),
+          from the database or column store ws is recording to
+    and, to see how ws itself is keeping up,
+      GET /stats
+          the counts of each queue between ws's ingest stages (see
+          WS-Ring.c): {"queues":[{"queue":"probes->parser","passed":1234,...
+
+    So a page view no longer opens the database and reads a week of whole
+    rows: the latest sample costs nothing, and a chart reads one field,
+    through the key, downsampled, or from the rollup tables.
+
+    The listening socket is watched by an acceptor thread, which hands each
+    connection to a fixed pool of httpWorkers threads through a queue of at
+    most httpQueueMax; a connection that arrives when the queue is full is
+    answered "503" and closed.  So however many viewers there are, no more
+    than httpWorkers requests are being answered -- and no more than that
+    many readers are at the database -- at once.  A worker keeps a
+    connection open (HTTP/1.1 keep-alive) for up to httpMaxRequests requests,
+    until it has been idle httpIdleSecs, or until another connection is
+    waiting for a worker.  The whole of each request's headers must arrive
+    within httpIdleSecs, however it's dribbled in, so a client that sends a
+    byte now and then can't hold a worker for long.
+
+    Every response carries an ETag made from the count of samples recorded
+    (and, for /history, the query), and "Cache-Control: no-cache", so a
+    browser asks again each time but is told "304 Not Modified", with no
+    body and no database read, until there is a new sample.  The last
+    httpCacheSize /history answers are kept, too, so that viewers who all
+    ask for the same chart are answered from one read.  In sql mode, a
+    sample is in the table, and so in /history, only once its batch is
+    committed (see flushDB()): up to dbBatchSecs after /latest shows it.
+    The /history ETag counts committed rows, so it changes then, too.
+
+    The workers run with SIGINT and SIGTERM blocked, as the event loop set
+    them, so those still end ws through its loop.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#define _GNU_SOURCE                       // accept4(), memmem(), strcasestr()
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "WS.h"
+
+extern storeModes storeMode;
+extern char *tsDir, *dbName;
+extern long dbRowsAdded;
+
+static int listenFd = -1;
+static boolean httpStopping = false;
+
+static int connQueue[httpQueueMax];       // connections waiting for a worker
+static int cqHead = 0, cqCount = 0;
+static pthread_mutex_t cqLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cqNotEmpty = PTHREAD_COND_INITIALIZER;
+
+static struct {                           // recent /history answers
+  char key[httpReqMax];
+  unsigned long version;
+  char *body;
+  size_t len;
+} histCache[httpCacheSize];
+static int hcNext = 0;
+static pthread_mutex_t histLock = PTHREAD_MUTEX_INITIALIZER;
+
+static long nRequests = 0, nNotModified = 0, nRefused = 0;
+
+/* Send all of buf, or give up */
+static boolean sendAll(int fd, const char *buf, size_t len, int more) {
+  ssize_t n;
+
+  while (len > 0) {
+    if ( (n=send(fd, buf, len, MSG_NOSIGNAL | more)) <= 0 ) {
+      if (n < 0 && errno == EINTR) continue;
+      return(false);
+    };
+    buf += n;
+    len -= n;
+  };
+  return(true);
+};
+
+/* Send a response: status line, headers, and (unless HEAD) the body */
+static boolean respond(int fd, int status, const char *type, const char *etag,
+		       const char *body, size_t len, boolean keep, boolean head) {
+  char hdr[512];
+  int n;
+  const char *reason = (status == 200) ? "OK" : (status == 304) ? "Not Modified"
+    : (status == 400) ? "Bad Request" : (status == 404) ? "Not Found"
+    : (status == 405) ? "Method Not Allowed" : (status == 503) ? "Service Unavailable"
+    : "Internal Server Error";
+
+  n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d %s\r\n", status, reason);
+  if (status != 304)
+    n += snprintf(hdr+n, sizeof(hdr)-n, "Content-Type: %s\r\nContent-Length: %zu\r\n", type, len);
+  if (etag)
+    n += snprintf(hdr+n, sizeof(hdr)-n, "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+  n += snprintf(hdr+n, sizeof(hdr)-n, "Access-Control-Allow-Origin: *\r\nConnection: %s\r\n\r\n",
+		keep ? "keep-alive" : "close");
+  if (status == 304 || head || len == 0) return( sendAll(fd, hdr, n, 0) );
+  return( sendAll(fd, hdr, n, MSG_MORE) && sendAll(fd, body, len, 0) );
+};
+
+/* An error, as JSON */
+static boolean respondError(int fd, int status, const char *why, boolean keep) {
+  char body[256];
+  int n = snprintf(body, sizeof(body), "{\"error\":\"%s\"}\n", why);
+
+  return( respond(fd, status, "application/json", NULL, body, n, keep, false) );
+};
+
+/* The value of parameter "name" in query string "qs", %-decoded, or NULL */
+static char *param(const char *qs, const char *name, char *val, int size) {
+  const char *p;
+  int n = strlen(name), i = 0, c;
+
+  for (p=qs; p && *p; p=strchr(p, '&'), p=p ? p+1 : NULL) {
+    if (strncmp(p, name, n) != 0 || p[n] != '=') continue;
+    for (p+=n+1; *p && *p != '&' && i < size-1; p++) {
+      if (*p == '+') c = ' ';
+      else if (*p == '%' && isxdigit(p[1]) && isxdigit(p[2]) && sscanf(p+1, "%2x", &c) == 1) p += 2;
+      else c = *p;
+      val[i++] = c;
+    };
+    val[i] = 0;
+    return(val);
+  };
+  return(NULL);
+};
+
+/* Start of getLatest()
+ *------------------------------------------------------------------------------
+ * Answers /latest, from the samples ws publishes as it records them
+*/
+static boolean getLatest(int fd, const char *qs, const char *inm, boolean keep, boolean head) {
+  struct latestShm *ls = latestMap();
+  struct latestSlot slot;
+  char body[maxProbes*httpLatestMax+32], etag[32], val[16];
+  int i, probe = -1, len, n;
+  unsigned long version;
+
+  if (param(qs, "probe", val, sizeof(val))) probe = atoi(val);
+  version = __atomic_load_n(&ls->samples, __ATOMIC_ACQUIRE);
+  snprintf(etag, sizeof(etag), "\"L%lu\"", version);
+  if (inm && strstr(inm, etag)) {
+    __sync_fetch_and_add(&nNotModified, 1);
+    return( respond(fd, 304, NULL, etag, NULL, 0, keep, head) );
+  };
+  len = snprintf(body, sizeof(body), "{\"samples\":[");
+  for (i=0; i<maxProbes; i++)
+    if ((probe < 0 || probe == i) && latestRead(ls, i, &slot)) {
+      if (body[len-1] != '[') body[len++] = ',';
+      if ( (n=latestJSON(i, &slot, body+len, sizeof(body)-len)) > 0 ) len += n;
+    };
+  len += snprintf(body+len, sizeof(body)-len, "]}\n");
+  return( respond(fd, 200, "application/json", etag, body, len, keep, head) );
+}; // end getLatest()
+
+/* Start of getStats()
+ *------------------------------------------------------------------------------
+ * Answers /stats, with the ingest queues' counts as they are now
+*/
+static boolean getStats(int fd, boolean keep, boolean head) {
+  char body[1024];
+  int len, n;
+
+  len = snprintf(body, sizeof(body), "{\"queues\":");
+  if ( (n=ringsJSON(body+len, sizeof(body)-len-4)) < 0 )
+    return( respondError(fd, 500, "too many queues", keep) );
+  len += n;
+  len += snprintf(body+len, sizeof(body)-len, "}\n");
+  return( respond(fd, 200, "application/json", NULL, body, len, keep, head) );
+}; // end getStats()
+
+/* Start of getHistory()
+ *------------------------------------------------------------------------------
+ * Answers /history: a wsq query, from the recent answers if it's one of them
+*/
+static boolean getHistory(int fd, const char *qs, const char *inm, boolean keep, boolean head) {
+  struct wsQuery q;
+  const char *why, *format = "json", *type;
+  char val[64], etag[48], *body = NULL;
+  unsigned long version, hash = 5381;
+  const char *p;
+  size_t len = 0;
+  FILE *out;
+  boolean ok;
+  int i;
+
+  if (storeMode != sqlMode && storeMode != tsMode)
+    return( respondError(fd, 404, "ws is not recording to a database or column store", keep) );
+  version = (storeMode == sqlMode) ? (unsigned long) __atomic_load_n(&dbRowsAdded, __ATOMIC_RELAXED)
+                                   : __atomic_load_n(&latestMap()->samples, __ATOMIC_RELAXED);
+  for (p=qs; *p; p++) hash = hash*33 + (unsigned char) *p;
+  snprintf(etag, sizeof(etag), "\"H%lu-%lx\"", version, hash);
+  if (inm && strstr(inm, etag)) {
+    __sync_fetch_and_add(&nNotModified, 1);
+    return( respond(fd, 304, NULL, etag, NULL, 0, keep, head) );
+  };
+
+  if (param(qs, "format", val, sizeof(val))) {
+    if (strcmp(val, "csv") == 0) format = "csv";
+    else if (strcmp(val, "bin") == 0) format = "bin";
+    else if (strcmp(val, "json") != 0) return( respondError(fd, 400, "format is json, csv, or bin", keep) );
+  };
+  type = (format[0] == 'j') ? "application/json" : (format[0] == 'c') ? "text/csv" : "application/octet-stream";
+
+  pthread_mutex_lock(&histLock);              // asked for lately?
+  for (i=0; i<httpCacheSize && body==NULL; i++)
+    if (histCache[i].body && histCache[i].version == version && strcmp(histCache[i].key, qs) == 0
+	&& (body=malloc(histCache[i].len)) != NULL) {
+      memcpy(body, histCache[i].body, histCache[i].len);   // not sent under the lock
+      len = histCache[i].len;
+    };
+  pthread_mutex_unlock(&histLock);
+  if (body) {
+    ok = respond(fd, 200, type, etag, body, len, keep, head);
+    free(body);
+    return(ok);
+  };
+
+  memset(&q, 0, sizeof(q));
+  q.probe = -1;
+  q.t1 = time(NULL);
+  q.t0 = q.t1 - 86400;
+  if (param(qs, "field", val, sizeof(val))) {
+    if (strlen(val) >= sizeof(q.field)) return( respondError(fd, 400, "no field has a name that long", keep) );
+    strcpy(q.field, val);
+  };
+  if (param(qs, "start", val, sizeof(val)) && (q.t0=wsqTime(val)) < 0)
+    return( respondError(fd, 400, "start isn't a time", keep) );
+  if (param(qs, "end", val, sizeof(val)) && (q.t1=wsqTime(val)) < 0)
+    return( respondError(fd, 400, "end isn't a time", keep) );
+  if (param(qs, "probe", val, sizeof(val))) q.probe = atoi(val);
+  if (param(qs, "n", val, sizeof(val))) q.points = atol(val);
+  if (param(qs, "r", val, sizeof(val)) && (q.width=wsqSeconds(val)) <= 0)
+    return( respondError(fd, 400, "r is a resolution, such as 300 or 1h", keep) );
+  if (param(qs, "a", val, sizeof(val))) {
+    if (strcmp(val, "raw") == 0) q.mode = aRaw;
+    else if (strcmp(val, "lttb") == 0) q.mode = aLTTB;
+    else if (strcmp(val, "minmax") == 0) q.mode = aMinMax;
+    else if (strcmp(val, "avg") == 0) q.mode = aAvg;
+    else return( respondError(fd, 400, "a is raw, lttb, minmax, or avg", keep) );
+  };
+  if ( !wsqPrepare(&q, &why) ) return( respondError(fd, 400, why, keep) );
+
+  ok = (storeMode == tsMode) ? wsqReadTS(&q, tsDir) : wsqReadSQL(&q, dbName);
+  if (ok) {
+    wsqDownsample(&q);
+    if ( (out=open_memstream(&body, &len)) == NULL ) ok = false;
+    else {
+      wsqOutput(&q, out, format);
+      fclose(out);
+    };
+  };
+  wsqFree(&q);
+  if (!ok) {
+    free(body);
+    return( respondError(fd, 500, "the query failed; see ws's log", keep) );
+  };
+  ok = respond(fd, 200, type, etag, body, len, keep, head);
+
+  pthread_mutex_lock(&histLock);              // keep it for the next viewer
+  if (strlen(qs) < httpReqMax) {
+    free(histCache[hcNext].body);
+    snprintf(histCache[hcNext].key, httpReqMax, "%s", qs);
+    histCache[hcNext].version = version;
+    histCache[hcNext].body = body;
+    histCache[hcNext].len = len;
+    hcNext = (hcNext+1) % httpCacheSize;
+    body = NULL;
+  };
+  pthread_mutex_unlock(&histLock);
+  free(body);
+  return(ok);
+}; // end getHistory()
+
+/* Start of serve()
+ *------------------------------------------------------------------------------
+ * Answers the requests on one connection, keeping it open while the client
+ * asks for that and no other connection is waiting.  Each request's headers
+ * must all arrive within httpIdleSecs of our starting to wait for them.
+*/
+static void serve(int fd) {
+  char req[httpReqMax+1], *end, *line, *next, *target, *qs, *version, *inm;
+  int len = 0, n, nReq, hdrLen, left;
+  boolean keep, head, ok;
+  struct pollfd pfd = {fd, POLLIN, 0};
+  struct timespec t0, t1;
+
+  n = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &n, sizeof(n));
+  for (nReq=1; ; nReq++) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while ( (end=memmem(req, len, "\r\n\r\n", 4)) == NULL ) {
+      if (len == httpReqMax) {
+	respondError(fd, 400, "request too long", false);
+	return;
+      };
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      left = httpIdleSecs*1000 - ((t1.tv_sec-t0.tv_sec)*1000 + (t1.tv_nsec-t0.tv_nsec)/1000000);
+      if ( left <= 0 || poll(&pfd, 1, left) <= 0 ) return;         // idle, or too slow
+      if ( (n=recv(fd, req+len, httpReqMax-len, 0)) <= 0 ) return;   // closed
+      len += n;
+    };
+    hdrLen = end+4 - req;
+    *end = 0;
+    __sync_fetch_and_add(&nRequests, 1);
+
+    /* The request line: method, target, version */
+    line = req;
+    next = strstr(line, "\r\n");
+    if (next) *next = 0;
+    target = strchr(line, ' ');
+    version = target ? strchr(target+1, ' ') : NULL;
+    if (!target || !version) {
+      respondError(fd, 400, "not an HTTP request", false);
+      return;
+    };
+    *target++ = 0;
+    *version++ = 0;
+    keep = (strcmp(version, "HTTP/1.1") == 0);
+
+    /* The headers we care about: Connection and If-None-Match */
+    inm = NULL;
+    for (line=next ? next+2 : NULL; line && *line; line=next ? next+2 : NULL) {
+      if ( (next=strstr(line, "\r\n")) != NULL ) *next = 0;
+      if (strncasecmp(line, "Connection:", 11) == 0) {
+	if (strcasestr(line+11, "close")) keep = false;
+	if (strcasestr(line+11, "keep-alive")) keep = true;
+      }
+      else if (strncasecmp(line, "If-None-Match:", 14) == 0) inm = line+14;
+      else if (strncasecmp(line, "Content-Length:", 15) == 0 && atoi(line+15) > 0) {
+	respondError(fd, 400, "requests have no body", false);
+	return;
+      };
+    };
+    pthread_mutex_lock(&cqLock);            // let the next connection have this worker?
+    if (cqCount > 0 || nReq >= httpMaxRequests || httpStopping) keep = false;
+    pthread_mutex_unlock(&cqLock);
+
+    head = (strcmp(req, "HEAD") == 0);
+    if ( (qs=strchr(target, '?')) != NULL ) *qs++ = 0;
+      else qs = "";
+    if (!head && strcmp(req, "GET") != 0) ok = respondError(fd, 405, "only GET and HEAD", keep);
+    else if (strcmp(target, "/latest") == 0) ok = getLatest(fd, qs, inm, keep, head);
+    else if (strcmp(target, "/history") == 0) ok = getHistory(fd, qs, inm, keep, head);
+    else if (strcmp(target, "/stats") == 0) ok = getStats(fd, keep, head);
+    else ok = respondError(fd, 404, "try /latest, /history?field=mpl_press, or /stats", keep);
+    if (!ok || !keep) return;
+
+    memmove(req, req+hdrLen, len-hdrLen);     // a pipelined request may follow
+    len -= hdrLen;
+  };
+}; // end serve()
+
+/* A worker: answers connections from the queue, one at a time */
+static void *worker(void *arg) {
+  int fd;
+
+#ifdef USE_MYSQL
+  mysql_thread_init();
+#endif
+  while (true) {
+    pthread_mutex_lock(&cqLock);
+    while (cqCount == 0) pthread_cond_wait(&cqNotEmpty, &cqLock);
+    fd = connQueue[cqHead];
+    cqHead = (cqHead+1) % httpQueueMax;
+    cqCount--;
+    pthread_mutex_unlock(&cqLock);
+    serve(fd);
+    close(fd);
+  };
+  return(NULL);
+};
+
+/* The acceptor: queues each connection for a worker, or refuses it */
+static void *acceptor(void *arg) {
+  static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"
+    "Retry-After: 1\r\nConnection: close\r\n\r\n";
+  int fd;
+
+  while (!httpStopping) {
+    if ( (fd=accept4(listenFd, NULL, NULL, SOCK_CLOEXEC)) < 0 ) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+	if (errno == EMFILE || errno == ENFILE) sleep(1);
+	continue;
+      };
+      break;                                  // closeHTTP() shut the socket
+    };
+    pthread_mutex_lock(&cqLock);
+    if (cqCount < httpQueueMax) {
+      connQueue[(cqHead+cqCount++) % httpQueueMax] = fd;
+      pthread_cond_signal(&cqNotEmpty);
+      fd = -1;
+    };
+    pthread_mutex_unlock(&cqLock);
+    if (fd >= 0) {                            // all busy, and too many waiting
+      __sync_fetch_and_add(&nRefused, 1);
+      send(fd, busy, sizeof(busy)-1, MSG_NOSIGNAL);
+      close(fd);
+    };
+  };
+  return(NULL);
+};
+
+/* Start of initHTTP()
+ *------------------------------------------------------------------------------
+ * Listens on "[addr:]port" (all addresses if addr isn't given) and starts the
+ * acceptor and the workers.  Call after initEvents(), so that the threads
+ * inherit its blocking of SIGINT and SIGTERM.
+*/
+void initHTTP(char *spec) {
+  struct addrinfo hints, *ai, *a;
+  char host[128] = "", *port;
+  pthread_t tid;
+  int i, on = 1, rc;
+
+  if ( (port=strrchr(spec, ':')) != NULL ) {
+    snprintf(host, sizeof(host), "%.*s", (int) (port-spec), spec);
+    port++;
+  }
+  else port = spec;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ( (rc=getaddrinfo(host[0] ? host : NULL, port, &hints, &ai)) != 0 ) {
+    fprintf(stderr, "[?WS] Can't serve HTTP on %s: %s\n", spec, gai_strerror(rc));
+    exit(EXIT_FAILURE);
+  };
+  for (a=ai; a; a=a->ai_next) {
+    if ( (listenFd=socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol)) < 0 ) continue;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(listenFd, a->ai_addr, a->ai_addrlen) == 0 && listen(listenFd, 64) == 0) break;
+    close(listenFd);
+    listenFd = -1;
+  };
+  freeaddrinfo(ai);
+  if (listenFd < 0) {
+    fprintf(stderr, "[?WS] Can't serve HTTP on %s: %s\n", spec, strerror(errno));
+    exit(EXIT_FAILURE);
+  };
+  for (i=0; i<httpWorkers; i++)
+    if ( pthread_create(&tid, NULL, worker, NULL) != 0 ) {
+      fprintf(stderr, "[?WS] Can't start the HTTP workers\n");
+      exit(EXIT_FAILURE);
+    };
+  if ( pthread_create(&tid, NULL, acceptor, NULL) != 0 ) {
+    fprintf(stderr, "[?WS] Can't start the HTTP server\n");
+    exit(EXIT_FAILURE);
+  };
+  fprintf(stdout, "[%WS] Serving /latest and /history over HTTP on %s, with %d workers\n",
+	  spec, httpWorkers);
+}; // end initHTTP()
+
+/* Start of closeHTTP()
+ *------------------------------------------------------------------------------
+ * Stops taking connections and reports what was served.  Requests being
+ * answered are cut off when ws exits.
+*/
+void closeHTTP(void) {
+  if (listenFd < 0) return;
+  httpStopping = true;
+  shutdown(listenFd, SHUT_RDWR);              // wakes the acceptor
+  fprintf(stderr, "[%WS] Answered %ld HTTP requests (%ld not modified); refused %ld connections\n",
+	  nRequests, nNotModified, nRefused);
+}; // end closeHTTP()
@@ -0,0 +1,244 @@
+/*  WS-Import.c
+    Bulk import of archived samples into the ProbeData table: "ws import".
+
+    Each file named is either an XML data file of the kind ws and the probe
+    write (weather.xml, live-data.xml, and the .xml.gz files from ws -r),
+    or a CSV capture: the probe's csv lines, ('2017-09-01 12:53:08',85266,
+    ...), ws_xml_inp's output, or the same fields without the parentheses.
+    Files may be gzip'd; "-" is stdin.  The kind is decided by the first
+    character that isn't white space: '<' for XML.
+
+    A parser thread reads the files -- XML with the streaming reader from
+    WSxml/ws_xml_stream.c, in constant memory -- and turns each sample into
+    a probe csv line, and gives it a probe_id: in an XML file written by ws
+    from several probes, each sample is tagged with its probe's
+    <source_loc>, and each source is numbered by its place in the -p list,
+    if one is given (e.g., "ws -p ttyACM0,ttyACM1 import"), or else in the
+    order in which the sources first appear.  Untagged samples are probe 0's.
+    The parser then parses and checks each line as ws does a probe's (see
+    parseSample()), setting aside any that fail.  It passes the samples
+    through a bounded queue to the main thread, which hands them to
+    appendToDB().  So the database is kept
+    busy while the next file is being parsed, and a slow database holds the
+    parser back rather than letting the queue grow.  Rows are committed
+    dbBatchMax at a time through the prepared INSERT, and a row whose
+    date_time is already in the table for that probe is counted and
+    skipped, not reported one by one.  A ^C stops the import at once; the
+    batches already committed stay in the table, and since a sample already
+    there is skipped, the same files can simply be imported again.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "WS.h"
+#include "../WSxml/ws_xml_stream.h"
+
+#define importQueueMax 4096               // samples between parser and inserter
+#define importBadMax     10               // bad samples reported one by one
+
+static struct {                          // a sample, and the probe_id it's from
+  int probe;
+  struct wsSample smp;} importQueue[importQueueMax];
+static int qHead = 0, qCount = 0;
+static boolean parserDone = false;
+static pthread_mutex_t qLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  qNotEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  qNotFull = PTHREAD_COND_INITIALIZER;
+
+extern struct commPort probes[];          // the -p list, from WS-5.c
+extern int nProbes;
+extern boolean probesNamed;
+
+static char **importFiles;                // the files, and how many
+static int nImportFiles;
+static long nSamples, nUnread, nBad;      // samples queued, lines not understood, samples refused
+static long nUnplaced;                    //   and from sources not given a probe_id
+static int nFailed;                       // files that couldn't be opened or read through
+static char sources[maxProbes][FIELD_MAX];   // <source_loc>s seen, by probe_id,
+static int nSources;                      //   when there's no -p list
+
+/* The probe_id for samples tagged <source_loc>"src": its place in the -p
+   list, if one was given, or else among the sources seen so far; -1 if
+   it's not in the list, or there are more sources than probe_ids        */
+static int probeOf(const char *src) {
+  int i;
+
+  if (*src == 0) return(0);                 // untagged: from a one-probe file
+  if (probesNamed) {
+    for (i=0; i<nProbes; i++)
+      if (strcmp(probes[i].devName, src) == 0) return(i);
+    return(-1);
+  };
+  for (i=0; i<nSources; i++)
+    if (strcmp(sources[i], src) == 0) return(i);
+  if (nSources == maxProbes) return(-1);
+  snprintf(sources[nSources], FIELD_MAX, "%s", src);
+  return(nSources++);
+};
+
+/* Parse a line and queue its sample, from probe "probe", for the inserter,
+   waiting while the queue is full */
+static void enqueue(char *line, int probe) {
+  struct wsSample smp;
+  const char *why;
+
+  if ( !parseSample(line, &smp, &why) ) {
+    if (nBad++ < importBadMax) fprintf(stderr, "[%WS] Sample %s; not imported:\n\t%s", why, line);
+    return;
+  };
+  pthread_mutex_lock(&qLock);
+  while (qCount == importQueueMax) pthread_cond_wait(&qNotFull, &qLock);
+  importQueue[(qHead+qCount) % importQueueMax].probe = probe;
+  importQueue[(qHead+qCount) % importQueueMax].smp = smp;
+  if (qCount++ == 0) pthread_cond_signal(&qNotEmpty);
+  pthread_mutex_unlock(&qLock);
+  nSamples++;
+};
+
+/* Copy up to n characters of a field value, without its quotes or blanks */
+static char *unquote(char *dst, const char *src, int n) {
+  while (isspace(*src) || *src == '\'') src++;
+  snprintf(dst, n, "%s", src);
+  for (n=strlen(dst); n>0 && (isspace(dst[n-1]) || dst[n-1]=='\''); n--) dst[n-1] = 0;
+  return(dst);
+};
+
+/* An XML sample, as the probe would have sent it in csv mode: sensors
+   that are missing read 0, as they do from the probe, and the DS18
+   readings are padded to dsMax with '**' dummies                          */
+static void fromXML(struct sample *s, void *arg) {
+  char line[oBufSize], dt[FIELD_MAX], a[FIELD_MAX], b[FIELD_MAX], c[FIELD_MAX], d[FIELD_MAX];
+  int i, n, probe;
+
+  if ( (probe=probeOf(unquote(a, s->source_loc, FIELD_MAX))) < 0 ) {
+    nUnplaced++;
+    return;
+  };
+  n = snprintf(line, sizeof(line), "('%s',%s,%s,%s,%s", unquote(dt, s->date_time, FIELD_MAX),
+	       s->have_mpl ? unquote(a, s->mpl_press, FIELD_MAX) : "0",
+	       s->have_mpl ? unquote(b, s->mpl_temp, FIELD_MAX) : "0.0",
+	       s->have_dht ? unquote(c, s->dht_temp, FIELD_MAX) : "0.0",
+	       s->have_dht ? unquote(d, s->dht_rh, FIELD_MAX) : "0");
+  for (i=0; i<dsMax && n<oBufSize; i++)
+    n += snprintf(line+n, oBufSize-n, i<s->n_ds18 ? ",'%s',%s" : ",'**',00.0",
+		  unquote(a, s->ds18_lbl[i], FIELD_MAX), unquote(b, s->ds18_temp[i], FIELD_MAX));
+  if (n < oBufSize) snprintf(line+n, oBufSize-n, ")\n");
+  enqueue(line, probe);
+};
+
+/* A CSV capture: each line that starts like a sample is queued as a probe
+   csv line; anything else (a header, say) is counted and skipped          */
+static void fromCSV(gzFile in) {
+  char buf[lBufSize], line[oBufSize], *p;
+  int n;
+
+  while ( gzgets(in, buf, sizeof(buf)) != NULL ) {
+    for (p=buf; isspace(*p); p++) ;
+    for (n=strlen(p); n>0 && isspace(p[n-1]); n--) p[n-1] = 0;
+    if (*p == 0) continue;
+    if (*p == '(') snprintf(line, sizeof(line), "%s\n", p);
+    else if (*p == '\'' || isdigit(*p)) snprintf(line, sizeof(line), "(%s)\n", p);
+    else {
+      nUnread++;
+      continue;
+    };
+    enqueue(line, 0);
+  };
+};
+
+/* The parser thread: reads each file in turn, then says it's done */
+static void *parser(void *arg) {
+  gzFile in;
+  long count;
+  int f, c;
+
+  for (f=0; f<nImportFiles; f++) {
+    if ( (in=(strcmp(importFiles[f], "-") == 0) ? gzdopen(0, "rb") : gzopen(importFiles[f], "rb")) == NULL ) {
+      fprintf(stderr, "[?WS] Cannot open %s; not imported\n", importFiles[f]);
+      nFailed++;
+      continue;
+    };
+    while ( (c=gzgetc(in)) != -1 && isspace(c) ) ;
+    gzungetc(c, in);                        // the reader starts from it
+    if (c != '<') fromCSV(in);
+    else if ( read_gz_samples(in, importFiles[f], fromXML, NULL, &count) != 0 ) {
+      fprintf(stderr, "[?WS] %s is not well-formed XML; stopped after %ld samples\n",
+	      importFiles[f], count);
+      nFailed++;
+    };
+    gzclose(in);
+  };
+  pthread_mutex_lock(&qLock);
+  parserDone = true;
+  pthread_cond_signal(&qNotEmpty);
+  pthread_mutex_unlock(&qLock);
+  return(NULL);
+};
+
+/* Start of importToDB()
+ *------------------------------------------------------------------------------
+ * Imports the samples in files[0..n-1] into the database opened by initDBMgr()
+ * and reports what was done.  Called in place of the event loop, before its
+ * signal handling is set up, so ^C simply ends the program.  Returns false
+ * if a file couldn't be opened or wasn't read to its end.
+*/
+boolean importToDB(char *files[], int n) {
+  extern int dbBatchRows;
+  extern long dbRowsAdded, dbDuplicates;
+  extern boolean dbReportDups;
+  struct wsSample smp;
+  struct timespec t0, t1;
+  int probe;
+  pthread_t tid;
+  double secs;
+
+  importFiles = files;
+  nImportFiles = n;
+  dbBatchRows = dbBatchMax;                 // big transactions
+  dbReportDups = false;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if ( pthread_create(&tid, NULL, parser, NULL) != 0 ) {
+    fprintf(stderr, "[?WS] Can't start the import parser\n");
+    exit(EXIT_FAILURE);
+  };
+
+  while (true) {
+    pthread_mutex_lock(&qLock);
+    while (qCount == 0 && !parserDone) pthread_cond_wait(&qNotEmpty, &qLock);
+    if (qCount == 0) {                      // parser is done, and so are we
+      pthread_mutex_unlock(&qLock);
+      break;
+    };
+    probe = importQueue[qHead].probe;
+    smp = importQueue[qHead].smp;
+    qHead = (qHead+1) % importQueueMax;
+    if (qCount-- == importQueueMax) pthread_cond_signal(&qNotFull);
+    pthread_mutex_unlock(&qLock);
+    appendToDB(probe, &smp);
+  };
+  flushDB();
+  pthread_join(tid, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  secs = (t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)/1e9;
+  fprintf(stderr, "[%WS] Imported %ld of %ld samples from %d file%s in %.1f sec (%.0f samples/sec)\n",
+	  dbRowsAdded, nSamples, n, n>1 ? "s" : "", secs, secs>0 ? nSamples/secs : 0.0);
+  if (dbDuplicates > 0)
+    fprintf(stderr, "[%WS] %ld were already in the table and were skipped\n", dbDuplicates);
+  if (nUnread > 0)
+    fprintf(stderr, "[%WS] %ld lines that aren't samples were skipped\n", nUnread);
+  if (nBad > 0)
+    fprintf(stderr, "[%WS] %ld samples that failed their checks were skipped\n", nBad);
+  if (nUnplaced > 0)
+    fprintf(stderr, "[%WS] %ld samples from %s were skipped\n", nUnplaced,
+	    probesNamed ? "sources not in the -p list" : "more sources than there are probe_ids");
+  if (nFailed > 0)
+    fprintf(stderr, "[?WS] %d file%s could not be imported in full\n", nFailed, nFailed>1 ? "s" : "");
+  return(nFailed == 0);
+}; // end importToDB()
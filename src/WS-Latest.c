@@ -0,0 +1,179 @@
+/*  WS-Latest.c
+    The latest sample from each probe, for readers in and out of ws.
+
+    As ws records a sample it also keeps it, decoded, as that probe's
+    latest, in a small segment of shared memory, /dev/shm/WeatherStation
+    (latestShmName).  Any program on the Pi -- ws's own HTTP server, "wsq
+    -l", a display, an alarm -- can map that file read-only and read the
+    current conditions with no system call, no database, and nothing asked
+    of ws.
+
+    Each probe's slot is guarded by a sequence lock: the writer makes the
+    slot's sequence number odd, writes the sample, and makes it even again;
+    a reader copies the slot and takes the copy only if the sequence number
+    was the same even number before and after.  So readers never block the
+    writer, and never see a sample half-written.  There is one writer, ws's
+    store thread (storeSample() and recordSample() in WS.c), so it needs no
+    lock of its own.  A reader gives up on a slot that stays mid-write --
+    ws was killed between its two stores -- rather than wait forever.
+
+    The segment stays when ws stops, with its pid set to 0, so the last
+    conditions can still be read.  If it can't be made, ws keeps the
+    samples in its own memory, for its HTTP server.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "WS.h"
+
+static struct latestShm *lsw = NULL;      // the segment, as ws writes it
+
+/* Start of initLatest()
+ *------------------------------------------------------------------------------
+ * Creates (or takes over) the shared segment, emptied, for nProbes probes
+*/
+void initLatest(int nProbes) {
+  int fd;
+
+  if ( (fd=shm_open(latestShmName, O_RDWR|O_CREAT|O_CLOEXEC, 0644)) < 0
+       || ftruncate(fd, sizeof(struct latestShm)) < 0
+       || (lsw=mmap(NULL, sizeof(struct latestShm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ) {
+    fprintf(stderr, "[%WS] Can't share the latest samples in /dev/shm%s: %s; keeping them to ws\n",
+	    latestShmName, strerror(errno));
+    if ( (lsw=calloc(1, sizeof(struct latestShm))) == NULL ) {
+      fprintf(stderr, "[?WS] No memory for the latest samples\n");
+      exit(EXIT_FAILURE);
+    };
+  }
+  else memset(lsw, 0, sizeof(struct latestShm));
+  if (fd >= 0) close(fd);
+  memcpy(lsw->magic, latestMagic, sizeof(lsw->magic));
+  lsw->nProbes = nProbes;
+  lsw->pid = getpid();
+}; // end initLatest()
+
+/* Start of latestSample()
+ *------------------------------------------------------------------------------
+ * Publishes sample "s", just recorded from probe "probeID", as its latest
+*/
+void latestSample(int probeID, struct wsSample *s) {
+  struct latestSlot *slot;
+  struct timespec now;
+
+  if (lsw == NULL || probeID < 0 || probeID >= maxProbes) return;
+  slot = &lsw->slot[probeID];
+  clock_gettime(CLOCK_REALTIME, &now);
+  __atomic_store_n(&slot->seq, slot->seq+1, __ATOMIC_RELAXED);   // odd: writing
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->sample = *s;
+  slot->recordedMs = now.tv_sec*1000LL + now.tv_nsec/1000000;
+  slot->count++;
+  __atomic_store_n(&slot->seq, slot->seq+1, __ATOMIC_RELEASE);   // even: done
+  __atomic_fetch_add(&lsw->samples, 1, __ATOMIC_RELEASE);
+}; // end latestSample()
+
+/* Start of closeLatest()
+ *------------------------------------------------------------------------------
+ * Marks the segment as no longer being written; the samples stay
+*/
+void closeLatest(void) {
+  if (lsw) __atomic_store_n(&lsw->pid, 0, __ATOMIC_RELEASE);
+}; // end closeLatest()
+
+/* Start of latestMap()
+ *------------------------------------------------------------------------------
+ * For a reader: the segment ws is writing, in this process's memory, or NULL
+ * if there isn't one.  Within ws, it's the one being written.
+*/
+struct latestShm *latestMap(void) {
+  struct latestShm *ls;
+  int fd;
+
+  if (lsw) return(lsw);
+  if ( (fd=shm_open(latestShmName, O_RDONLY|O_CLOEXEC, 0)) < 0 ) return(NULL);
+  ls = mmap(NULL, sizeof(struct latestShm), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ls == MAP_FAILED) return(NULL);
+  if (memcmp(ls->magic, latestMagic, sizeof(ls->magic)) != 0) {
+    munmap(ls, sizeof(struct latestShm));
+    return(NULL);
+  };
+  return(ls);
+}; // end latestMap()
+
+/* Start of latestRead()
+ *------------------------------------------------------------------------------
+ * Copies probe "probeID"'s latest sample from segment "ls" into *slot, as it
+ * was between writes.  Returns false if there isn't one, or if the slot is
+ * still being written after latestTries looks (its writer died, or is stuck).
+*/
+boolean latestRead(struct latestShm *ls, int probeID, struct latestSlot *slot) {
+  unsigned int seq;
+  int tries;
+
+  if (ls == NULL || probeID < 0 || probeID >= maxProbes) return(false);
+  for (tries=0; tries<latestTries; tries++) {
+    if ( (seq=__atomic_load_n(&ls->slot[probeID].seq, __ATOMIC_ACQUIRE)) & 1 ) {
+      usleep(100);                         // let the writer finish
+      continue;
+    };
+    memcpy(slot, (void *) &ls->slot[probeID], sizeof(*slot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&ls->slot[probeID].seq, __ATOMIC_RELAXED) == seq) return(slot->count > 0);
+  };
+  return(false);
+}; // end latestRead()
+
+/* A reading as JSON: null if the probe had none */
+static char *jsonNum(char *b, double v) {
+  if (isnan(v)) return("null");
+  snprintf(b, 24, "%.10g", v);
+  return(b);
+};
+
+/* Text as a JSON string's contents: quotes, backslashes, and any byte that
+   isn't printable ASCII escaped, so whatever is in the segment, the JSON is
+   good.  b must hold 6 times the text.                                   */
+static char *jsonStr(char *b, const char *s) {
+  char *p = b;
+
+  for ( ; *s; s++)
+    if (*s == '"' || *s == '\\') p += sprintf(p, "\\%c", *s);
+    else if (*s < ' ' || *s > '~') p += sprintf(p, "\\u%04x", (unsigned char) *s);
+    else *p++ = *s;
+  *p = 0;
+  return(b);
+};
+
+/* Start of latestJSON()
+ *------------------------------------------------------------------------------
+ * Renders a probe's latest sample into buf as a JSON object, with when it
+ * was recorded.  Returns the length, or -1 if it didn't fit.
+*/
+int latestJSON(int probeID, struct latestSlot *slot, char *buf, int size) {
+  struct wsSample *s = &slot->sample;
+  char b[4][24], t[6*sizeof(s->dt)];
+  int i, n;
+
+  s->dt[sizeof(s->dt)-1] = 0;               // it's a copy: make sure of the ends
+  for (i=0; i<dsMax; i++) s->dsLabel[i][sizeof(s->dsLabel[i])-1] = 0;
+  n = snprintf(buf, size, "{\"probe_id\":%d,\"date_time\":\"%s\",\"recorded_ms\":%lld,"
+	       "\"mpl_press\":%s,\"mpl_temp\":%s,\"dht22_temp\":%s,\"dht22_rh\":%s",
+	       probeID, jsonStr(t, s->dt), slot->recordedMs, jsonNum(b[0], s->mplPress), jsonNum(b[1], s->mplTemp),
+	       jsonNum(b[2], s->dhtTemp), jsonNum(b[3], s->dhtRH));
+  for (i=0; i<dsMax && n<size; i++)
+    n += snprintf(buf+n, size-n, ",\"ds18_%d_lbl\":\"%s\",\"ds18_%d_temp\":%s",
+		  i+1, jsonStr(t, s->dsLabel[i]), i+1, jsonNum(b[0], s->dsTemp[i]));
+  if (n < size) n += snprintf(buf+n, size-n, "}");
+  return( n<size ? n : -1 );
+}; // end latestJSON()
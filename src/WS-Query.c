@@ -0,0 +1,538 @@
+/*  WS-Query.c
+    Queries of one field over a time range, for wsq and for ws's HTTP server.
+
+    A query asks for "field X from T1 to T2 at resolution R" and is
+    answered from whichever store ws records to -- the ProbeData table
+    (sqlite3 or MySQL, as compiled), or the column store of "ws ts" --
+    reading only the one field and date_time (and probe_id, or a DS18's
+    label):
+
+      o  From ProbeData, through its (date_time, probe_id) key, so a time
+         range is an index range scan, not a scan of the table.  Buckets of
+         whole hours or days are taken from the rollup tables, ProbeHourly
+         and ProbeDaily, rather than from the samples.
+      o  From a column store, through its block index: only the blocks in
+         the time range are read, and a min/max over blocks that lie
+         wholly in one bucket is taken from the index entries.
+
+    Downsampling is by:
+      lttb    Largest-Triangle-Three-Buckets, to at most "points" points
+              that keep the shape of the series for a line chart
+      minmax  the min and max in each bucket of "width" seconds
+      avg     the mean, and the count, in each bucket
+      raw     every sample
+
+    A DS18 reading labeled "**" (no sensor) is left out, as it is from the
+    rollups.  Times are the probe's local time, as in ProbeData.  Buckets
+    of whole days start at local midnights, so a day that a change to or
+    from daylight saving time makes 23 or 25 hours long is still one bucket.
+
+    Everything a query needs is in its struct wsQuery, and each read opens
+    its own database connection or column store, so queries may run in
+    several threads at once.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <math.h>
+#include "WS.h"
+
+/* The bucket that time t falls in: the last whose start is at or before it */
+static long bucketOf(struct wsQuery *q, long long t) {
+  long lo, hi, mid;
+
+  if (q->starts == NULL) return( (t-q->t0)/q->width );
+  for (lo=0, hi=q->nBkts-1; lo<hi; ) {
+    mid = (lo+hi+1)/2;
+    if (q->starts[mid] <= t) lo = mid;
+      else hi = mid-1;
+  };
+  return(lo);
+};
+
+/* And when bucket i starts */
+static long long bucketStart(struct wsQuery *q, long i) {
+  return( q->starts ? q->starts[i] : q->t0 + i*q->width );
+};
+
+/* Start of addPoint()
+ *------------------------------------------------------------------------------
+ * Takes in one sample: into its bucket, or onto the list of samples
+*/
+static void addPoint(struct wsQuery *q, long long t, double v) {
+  struct wsBucket *b;
+  struct wsPoint *p;
+
+  if (t < q->t0 || t > q->t1) return;
+  if (q->mode == aMinMax || q->mode == aAvg) {
+    b = &q->bkts[bucketOf(q, t)];
+    if (b->n == 0 || v < b->min) b->min = v;
+    if (b->n == 0 || v > b->max) b->max = v;
+    b->sum += v;
+    b->n++;
+    return;
+  };
+  if (q->nPts == q->maxPts) {
+    if ( (p=realloc(q->pts, (q->maxPts ? 2*q->maxPts : 65536) * sizeof(struct wsPoint))) == NULL ) {
+      if (!q->failed) fprintf(stderr, "[?WS] Out of memory after %ld samples of %s\n", q->nPts, q->field);
+      q->failed = true;
+      return;
+    };
+    q->pts = p;
+    q->maxPts = q->maxPts ? 2*q->maxPts : 65536;
+  };
+  q->pts[q->nPts].t = t;
+  q->pts[q->nPts++].v = v;
+}; // end addPoint()
+
+/* Start of addRollup()
+ *------------------------------------------------------------------------------
+ * Takes in the rollup of a period that lies within one bucket
+*/
+static void addRollup(struct wsQuery *q, long long t, double min, double max, double sum, long n) {
+  struct wsBucket *b;
+
+  if (n <= 0 || t < q->t0 || t > q->t1) return;
+  b = &q->bkts[bucketOf(q, t)];
+  if (b->n == 0 || min < b->min) b->min = min;
+  if (b->n == 0 || max > b->max) b->max = max;
+  b->sum += sum;
+  b->n += n;
+}; // end addRollup()
+
+/* Local time <-> "yyyy-mm-dd hh:mm:ss", as ProbeData keeps it */
+static long long fromText(const char *s) {
+  struct tm tm;
+  int n;
+
+  memset(&tm, 0, sizeof(tm));
+  n = sscanf(s, "%d-%d-%d%*[ T]%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+	     &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+  if (n < 3) return(-1);
+  tm.tm_year -= 1900;
+  tm.tm_mon--;
+  tm.tm_isdst = -1;
+  return( mktime(&tm) );
+};
+static char *toText(long long t, char *buf) {
+  time_t tt = t;
+  struct tm tm;
+
+  strftime(buf, 20, "%Y-%m-%d %H:%M:%S", localtime_r(&tt, &tm));
+  return(buf);
+};
+
+/* Seconds in "30", "15m", "1h", "7d", "1w"; 0 if it isn't one of those */
+long long wsqSeconds(const char *s) {
+  char *end;
+  double v = strtod(s, &end);
+
+  switch (*end) {
+    case 0: case 's': break;
+    case 'm': v *= 60; break;
+    case 'h': v *= 3600; break;
+    case 'd': v *= 86400; break;
+    case 'w': v *= 7*86400; break;
+    default:  return(0);
+  };
+  return( (end == s || (*end && end[1])) ? 0 : (long long) v );
+};
+
+/* A time: a date, "now", or an offset from now such as -7d; -1 if none */
+long long wsqTime(const char *s) {
+  long long t = time(NULL);
+
+  if (strcmp(s, "now") == 0) return(t);
+  if (*s == '-' || *s == '+') return( t + (*s=='-' ? -1 : 1) * wsqSeconds(s+1) );
+  return( fromText(s) );
+};
+
+/* The start of the local hour, or day, that t is in */
+static long long periodStart(long long t, long long period) {
+  time_t tt = t;
+  struct tm tm;
+
+  localtime_r(&tt, &tm);
+  tm.tm_sec = tm.tm_min = 0;
+  if (period >= 86400) tm.tm_hour = 0;
+  tm.tm_isdst = -1;
+  return( mktime(&tm) );
+};
+
+/* True if buckets from t0 of "width" seconds hold whole periods of "period"
+   seconds, i.e., start on a local hour (or midnight) and are whole ones   */
+static boolean aligned(struct wsQuery *q, long long period) {
+  return( q->width % period == 0 && periodStart(q->t0, period) == q->t0 );
+};
+
+/* Buckets of whole days from a local midnight: each starts at a midnight,
+   by the calendar, not a multiple of 86400 seconds after t0.  Sets
+   q->starts and q->nBkts; false if there are too many                   */
+static boolean dayStarts(struct wsQuery *q) {
+  time_t tt = q->t0;
+  struct tm tm, day;
+  long n, max = (q->t1-q->t0)/q->width + 2;
+
+  if ( max > 10000000 || (q->starts=malloc(max * sizeof(long long))) == NULL ) return(false);
+  localtime_r(&tt, &tm);
+  for (n=0; n<max; n++) {
+    day = tm;
+    day.tm_mday += n * (q->width/86400);
+    day.tm_hour = day.tm_min = day.tm_sec = 0;
+    day.tm_isdst = -1;
+    if ( (q->starts[n]=mktime(&day)) > q->t1 ) break;
+  };
+  q->nBkts = n;
+  return(true);
+};
+
+/* Start of wsqPrepare()
+ *------------------------------------------------------------------------------
+ * Checks a query filled in by the caller -- field, probe (-1 for all), t0, t1,
+ * and mode, width, and points, any of which may be 0 for the default -- and
+ * readies it to be read.  Returns false, with *why set, if it can't be run.
+*/
+boolean wsqPrepare(struct wsQuery *q, const char **why) {
+  char *p;
+
+  q->pts = NULL;
+  q->bkts = NULL;
+  q->starts = NULL;
+  q->nPts = q->maxPts = q->nBkts = 0;
+  q->failed = false;
+  if (q->field[0] == 0) {
+    *why = "no field was given";
+    return(false);
+  };
+  for (p=q->field; *p; p++)                 // it goes into the SQL: a name, nothing else
+    if ( !isalnum(*p) && *p != '_' ) {
+      *why = "a field is a column name";
+      return(false);
+    };
+  if (q->t0 < 0 || q->t1 < q->t0) {
+    *why = "the time range is empty";
+    return(false);
+  };
+  if (q->mode == aAuto) q->mode = (q->width > 0) ? aMinMax : (q->points > 0) ? aLTTB : aRaw;
+  if (q->mode == aMinMax || q->mode == aAvg) {
+    if (q->width <= 0) q->width = (q->points > 0) ? (q->t1-q->t0)/q->points + 1 : 3600;
+    if (q->width % 86400 == 0 && periodStart(q->t0, 86400) == q->t0) {
+      if ( !dayStarts(q) ) {
+	*why = "there are too many buckets";
+	return(false);
+      };
+    }
+    else q->nBkts = (q->t1-q->t0)/q->width + 1;
+    if ( q->nBkts > 10000000 || (q->bkts=calloc(q->nBkts, sizeof(struct wsBucket))) == NULL ) {
+      wsqFree(q);
+      *why = "there are too many buckets";
+      return(false);
+    };
+  };
+  if (q->mode == aLTTB && q->points <= 0) q->points = 1000;
+  return(true);
+}; // end wsqPrepare()
+
+/* The database: open it, run a SELECT of samples or of rollups through
+   addPoint() or addRollup(), and close it                                */
+#ifdef USE_SQLITE3
+typedef sqlite3 *sqlConn;
+
+static sqlConn openSQL(char *dbFile) {
+  sqlite3 *db;
+
+  if ( sqlite3_open_v2(dbFile, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ) {
+    fprintf(stderr, "[?WS] Can't open database %s: %s\n", dbFile, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return(NULL);
+  };
+  sqlite3_busy_timeout(db, 5000);           // ws may be committing
+  return(db);
+};
+
+static boolean runSQL(struct wsQuery *q, sqlConn db, char *sql, boolean rollups) {
+  sqlite3_stmt *st;
+
+  if ( sqlite3_prepare_v2(db, sql, -1, &st, NULL) != SQLITE_OK ) {
+    fprintf(stderr, "[?WS] Can't query the database for %s: %s\n", q->field, sqlite3_errmsg(db));
+    return(false);
+  };
+  while (sqlite3_step(st) == SQLITE_ROW) {
+    if (sqlite3_column_type(st, 1) == SQLITE_NULL) continue;
+    if (rollups)
+      addRollup(q, fromText((char *) sqlite3_column_text(st, 0)), sqlite3_column_double(st, 1),
+		sqlite3_column_double(st, 2), sqlite3_column_double(st, 3), sqlite3_column_int(st, 4));
+    else
+      addPoint(q, fromText((char *) sqlite3_column_text(st, 0)), sqlite3_column_double(st, 1));
+  };
+  sqlite3_finalize(st);
+  return(true);
+};
+
+static void closeSQL(sqlConn db) {
+  sqlite3_close(db);
+};
+#endif
+
+#ifdef USE_MYSQL
+typedef MYSQL *sqlConn;
+
+static sqlConn openSQL(char *dbase) {
+  MYSQL *conn;
+
+  if ( (conn=mysql_init(NULL)) == NULL
+       || mysql_real_connect(conn, myHost, myUsrName, myPwd, dbase, 0, NULL, 0) == NULL ) {
+    fprintf(stderr, "[?WS] Can't connect to MySQL database %s: %s\n", dbase, conn ? mysql_error(conn) : "");
+    if (conn) mysql_close(conn);
+    return(NULL);
+  };
+  return(conn);
+};
+
+static boolean runSQL(struct wsQuery *q, sqlConn conn, char *sql, boolean rollups) {
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  if ( mysql_query(conn, sql) != 0 || (res=mysql_use_result(conn)) == NULL ) {
+    fprintf(stderr, "[?WS] Can't query the database for %s: %s\n", q->field, mysql_error(conn));
+    return(false);
+  };
+  while ( (row=mysql_fetch_row(res)) != NULL ) {
+    if (row[1] == NULL) continue;
+    if (rollups)
+      addRollup(q, fromText(row[0]), atof(row[1]), atof(row[2]), atof(row[3]), row[4] ? atol(row[4]) : 0);
+    else
+      addPoint(q, fromText(row[0]), atof(row[1]));
+  };
+  mysql_free_result(res);
+  return(true);
+};
+
+static void closeSQL(sqlConn conn) {
+  mysql_close(conn);
+};
+#endif
+
+/* Start of wsqReadSQL()
+ *------------------------------------------------------------------------------
+ * Reads the query's field from t0 to t1 from ProbeData, by a range of its key.
+ * When the buckets hold whole hours or days, the whole ones in the range are
+ * read from ProbeHourly or ProbeDaily instead, and only the samples after the
+ * last of them from ProbeData.
+*/
+boolean wsqReadSQL(struct wsQuery *q, char *dbase) {
+  char sql[512], from[20], to[20], who[32] = "", lbl[32] = "";
+  const char *table = NULL;
+  long long period = 0, tR = q->t0;
+  boolean ok = true;
+  sqlConn db;
+
+  if (q->probe >= 0) snprintf(who, sizeof(who), " AND probe_id = %d", q->probe);
+  if (q->mode == aMinMax || q->mode == aAvg) {
+    if (aligned(q, 86400)) {
+      table = "ProbeDaily";
+      period = 86400;
+    }
+    else if (aligned(q, 3600)) {
+      table = "ProbeHourly";
+      period = 3600;
+    };
+  };
+  if ( (db=openSQL(dbase)) == NULL ) return(false);
+  if (table && (tR=periodStart(q->t1+1, period)) > q->t0) {
+    toText(q->t0, from);
+    toText(tR, to);
+    if (period == 86400) from[10] = to[10] = 0;   // ProbeDaily's periods are dates
+    snprintf(sql, sizeof(sql), "SELECT period, %s_min, %s_max, %s_avg * %s_n, %s_n FROM %s"
+	     " WHERE period >= '%s' AND period < '%s' AND %s_n > 0%s", q->field, q->field, q->field,
+	     q->field, q->field, table, from, to, q->field, who);
+    ok = runSQL(q, db, sql, true);
+  }
+  else tR = q->t0;
+  if (ok && tR <= q->t1) {
+    if (strncmp(q->field, "ds18_", 5) == 0)  // leave out absent DS18s
+      snprintf(lbl, sizeof(lbl), " AND ds18_%c_lbl <> '**'", q->field[5]);
+    snprintf(sql, sizeof(sql), "SELECT date_time, %s FROM ProbeData"
+	     " WHERE date_time >= '%s' AND date_time <= '%s' AND %s IS NOT NULL%s%s ORDER BY date_time",
+	     q->field, toText(tR, from), toText(q->t1, to), q->field, who, lbl);
+    ok = runSQL(q, db, sql, false);
+  };
+  closeSQL(db);
+  return(ok && !q->failed);
+}; // end wsqReadSQL()
+
+/* Start of wsqReadTS()
+ *------------------------------------------------------------------------------
+ * Reads the query's field from t0 to t1 from the column store in "dir", a
+ * block at a time
+*/
+boolean wsqReadTS(struct wsQuery *q, char *dir) {
+  struct tsStore *ts;
+  struct tsBlock *e;
+  long long first, last, b, r, n;
+  unsigned char *tv, *fv, *pv, *lv;
+  int c, pc, lc = -1;
+  char lbl[16];
+
+  if ( (ts=tsOpen(dir, NULL)) == NULL ) return(false);
+  if ( (c=tsColumnOf(ts, q->field)) < 0 || (ts->col[c].type != tsInt && ts->col[c].type != tsReal) ) {
+    fprintf(stderr, "[?WS] %s is not a numeric column of the store in %s\n", q->field, dir);
+    tsClose(ts);
+    return(false);
+  };
+  pc = tsColumnOf(ts, "probe_id");
+  if (strncmp(q->field, "ds18_", 5) == 0) { // leave out absent DS18s
+    snprintf(lbl, sizeof(lbl), "ds18_%c_lbl", q->field[5]);
+    lc = tsColumnOf(ts, lbl);
+  };
+  if ( !tsRowRange(ts, q->t0, q->t1, &first, &last) ) {
+    tsClose(ts);
+    return(true);
+  };
+  for (b=first/tsBlockRows; b*tsBlockRows<last; b++) {
+    e = tsBlockAt(ts, b);
+    n = (b+1)*tsBlockRows > ts->rows ? ts->rows - b*tsBlockRows : tsBlockRows;
+    if (e->tMax < q->t0 || e->tMin > q->t1) continue;
+    if ( q->mode == aMinMax && q->probe < 0 && lc < 0 && n == tsBlockRows   // the index has the answer
+	 && e->tMin >= q->t0 && e->tMax <= q->t1
+	 && bucketOf(q, e->tMin) == bucketOf(q, e->tMax) ) {
+      if (e->min[c] <= e->max[c]) addRollup(q, e->tMin, e->min[c], e->max[c], 0, n);
+      continue;                            // (if it had any readings)
+    };
+    tv = tsBlockData(ts, ts->timeCol, b);
+    fv = tsBlockData(ts, c, b);
+    pv = (q->probe >= 0 && pc >= 0) ? tsBlockData(ts, pc, b) : NULL;
+    lv = (lc >= 0) ? tsBlockData(ts, lc, b) : NULL;
+    if (!tv || !fv || (q->probe >= 0 && pc >= 0 && !pv) || (lc >= 0 && !lv)) continue;
+    for (r=0; r<n; r++) {
+      if (pv && ((int *) pv)[r] != q->probe) continue;
+      if (lv && strncmp((char *) lv + 4*r, "**", 2) == 0) continue;
+      if (ts->col[c].type == tsInt ? ((int *) fv)[r] == tsIntNull : isnan(((float *) fv)[r]))
+	continue;                          // the probe had no reading
+      addPoint(q, ((long long *) tv)[r],
+	       ts->col[c].type == tsInt ? ((int *) fv)[r] : ((float *) fv)[r]);
+    };
+  };
+  tsClose(ts);
+  return(!q->failed);
+}; // end wsqReadTS()
+
+/* Start of wsqDownsample()
+ *------------------------------------------------------------------------------
+ * For lttb, Largest-Triangle-Three-Buckets: reduces the samples read to
+ * "points", in place.  The first and last are kept; from each of the buckets
+ * between, the sample that makes the largest triangle with the one kept from
+ * the bucket before and the mean of the bucket after.
+*/
+void wsqDownsample(struct wsQuery *q) {
+  struct wsPoint *pts = q->pts;
+  double every, ax, ay, mx, my, area, best;
+  long i, j, a = 0, k = 1, from, to, nextFrom, nextTo, pick, want = q->points;
+
+  if (q->mode != aLTTB || want >= q->nPts || want < 3) return;
+  every = (double) (q->nPts-2) / (want-2);
+  for (i=0; i<want-2; i++) {
+    from = (long) (i*every) + 1;
+    to = (long) ((i+1)*every) + 1;
+    nextFrom = to;
+    nextTo = (long) ((i+2)*every) + 1;
+    if (nextTo > q->nPts) nextTo = q->nPts;
+    for (mx=my=0, j=nextFrom; j<nextTo; j++) {
+      mx += pts[j].t;
+      my += pts[j].v;
+    };
+    if (nextTo > nextFrom) {
+      mx /= nextTo-nextFrom;
+      my /= nextTo-nextFrom;
+    };
+    ax = pts[a].t;
+    ay = pts[a].v;
+    for (best=-1, pick=from, j=from; j<to; j++) {
+      area = (ax-mx)*(pts[j].v-ay) - (ax-pts[j].t)*(my-ay);
+      if (area < 0) area = -area;
+      if (area > best) {
+	best = area;
+	pick = j;
+      };
+    };
+    pts[k++] = pts[pick];                   // k <= pick: safe in place
+    a = pick;
+  };
+  pts[k++] = pts[q->nPts-1];
+  q->nPts = k;
+}; // end wsqDownsample()
+
+/* Start of wsqOutput()
+ *------------------------------------------------------------------------------
+ * Writes the samples, or the buckets that have any, to "out" as "csv", "json",
+ * or "bin".  A bucket is timed by its start.  Values are written to 7
+ * significant digits, all that the floats of MySQL's FLOAT columns and of
+ * the column store hold, so 68.4 isn't written as 68.40000153.
+*/
+void wsqOutput(struct wsQuery *q, FILE *out, const char *format) {
+  static const char *names[5][2] = {{"value"}, {"value"}, {"value"}, {"min", "max"}, {"avg", "n"}};
+  int k = (q->mode == aMinMax || q->mode == aAvg) ? 2 : 1, j, first = 1;
+  long i, n = (k == 2) ? q->nBkts : q->nPts;
+  double v[2];
+  long long t;
+  char ts[20];
+
+  if (strcmp(format, "json") == 0) {
+    fprintf(out, "{\"field\":\"%s\",\"columns\":[\"t\"", q->field);
+    for (j=0; j<k; j++) fprintf(out, ",\"%s\"", names[q->mode][j]);
+    fprintf(out, "],\"data\":[");
+  }
+  else if (strcmp(format, "bin") == 0) {
+    int32_t kk = k;
+    fwrite("WSQ1", 1, 4, out);
+    fwrite(&kk, sizeof(kk), 1, out);
+  }
+  else {
+    fprintf(out, "date_time");
+    for (j=0; j<k; j++) fprintf(out, ",%s", names[q->mode][j]);
+    fprintf(out, "\n");
+  };
+
+  for (i=0; i<n; i++) {
+    if (k == 2) {
+      if (q->bkts[i].n == 0) continue;
+      t = bucketStart(q, i);
+      v[0] = (q->mode == aMinMax) ? q->bkts[i].min : q->bkts[i].sum / q->bkts[i].n;
+      v[1] = (q->mode == aMinMax) ? q->bkts[i].max : q->bkts[i].n;
+    } else {
+      t = q->pts[i].t;
+      v[0] = q->pts[i].v;
+    };
+    if (strcmp(format, "json") == 0) {
+      fprintf(out, "%s[%lld", first ? "" : ",", t);
+      for (j=0; j<k; j++) fprintf(out, (q->mode == aAvg && j == 1) ? ",%.0f" : ",%.7g", v[j]);
+      fprintf(out, "]");
+    }
+    else if (strcmp(format, "bin") == 0) {
+      fwrite(&t, sizeof(t), 1, out);
+      fwrite(v, sizeof(double), k, out);
+    }
+    else {
+      fprintf(out, "%s", toText(t, ts));
+      for (j=0; j<k; j++) fprintf(out, (q->mode == aAvg && j == 1) ? ",%.0f" : ",%.7g", v[j]);
+      fprintf(out, "\n");
+    };
+    first = 0;
+  };
+  if (strcmp(format, "json") == 0) fprintf(out, "]}\n");
+}; // end wsqOutput()
+
+/* Releases what a query read */
+void wsqFree(struct wsQuery *q) {
+  free(q->pts);
+  free(q->bkts);
+  free(q->starts);
+  q->pts = NULL;
+  q->bkts = NULL;
+  q->starts = NULL;
+};
@@ -0,0 +1,193 @@
+/*  WS-Ring.c
+    Bounded single-producer, single-consumer rings, for ws's ingest pipeline.
+
+    ws takes in samples in three stages, each on a thread of its own: the
+    event loop reads the probes, a parser checks and parses what they send,
+    and a store thread writes it (see main() in WS.c).  So a slow commit or
+    a full disk holds up the store thread, not the reading of the ports.
+    Each pair of stages is joined by a ring of fixed-size slots: the
+    producer fills the slot at "tail" and then advances tail; the consumer
+    uses the slot at "head" in place and then advances head.  Each index is
+    written by one thread only, so neither needs a lock.
+
+    A stage with nothing to do sleeps on an eventfd rather than spinning.
+    It sets a flag before it looks one last time, and the other stage,
+    having moved its index, wakes it only if the flag is set -- so while
+    samples are flowing the rings make no system calls.  The producer wakes
+    its consumer once for a burst of slots, with ringFlush(), not for each
+    one: a probe's xml sample is 27 lines, and on a Pi Zero each wake-up is
+    a trip through the scheduler.
+
+    Each ring counts the times its producer found it full -- the stage after
+    it is the bottleneck -- and its consumer found it empty, and the most
+    slots ever in use.  ws reports them when it stops, and ws -H serves
+    them as /stats.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "WS.h"
+
+#define ringsMax 4
+
+static struct wsRing *rings[ringsMax];    // for the reports
+static int nRings = 0;
+
+/* Sleep until "fd" is signalled or timeoutMs (-1 = forever) passes */
+static boolean waitFd(int fd, int timeoutMs) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  unsigned long long n;
+  int rc;
+
+  do
+    rc = poll(&pfd, 1, timeoutMs);
+  while (rc < 0 && errno == EINTR);
+  if (rc <= 0) return(false);
+  if ( read(fd, &n, sizeof(n)) < 0 ) return(false);
+  return(true);
+};
+
+static void wake(int fd) {
+  unsigned long long one = 1;
+
+  if ( write(fd, &one, sizeof(one)) < 0 ) ;  // already signalled: that's fine
+};
+
+/* Start of ringInit()
+ *------------------------------------------------------------------------------
+ * Makes "r" an empty ring of nSlots (a power of 2) slots of slotSize bytes
+*/
+void ringInit(struct wsRing *r, char *name, unsigned nSlots, size_t slotSize) {
+  memset(r, 0, sizeof(*r));
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->nSlots = nSlots;
+  r->slotSize = slotSize;
+  if ( (nSlots & (nSlots-1)) != 0 || (r->slot=calloc(nSlots, slotSize)) == NULL
+       || (r->dataFd=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0
+       || (r->roomFd=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0 ) {
+    fprintf(stderr, "[?WS] Can't make the %s queue\n", name);
+    exit(EXIT_FAILURE);
+  };
+  if (nRings < ringsMax) rings[nRings++] = r;
+}; // end ringInit()
+
+/* Start of ringSlot()
+ *------------------------------------------------------------------------------
+ * For the producer: the next slot to fill, waiting while the ring is full.
+ * Taking it again without ringPush() gives the same slot.
+*/
+void *ringSlot(struct wsRing *r) {
+  unsigned tail = r->tail;
+
+  if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->nSlots) {
+    r->fulls++;                             // the consumer is behind
+    ringFlush(r);
+    while (true) {
+      __atomic_store_n(&r->fullWait, true, __ATOMIC_SEQ_CST);
+      if (tail - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) < r->nSlots) break;
+      waitFd(r->roomFd, -1);
+    };
+    __atomic_store_n(&r->fullWait, false, __ATOMIC_RELAXED);
+  };
+  return( r->slot + (tail & (r->nSlots-1)) * r->slotSize );
+}; // end ringSlot()
+
+/* Start of ringPush()
+ *------------------------------------------------------------------------------
+ * For the producer: hands the slot it has filled to the consumer, which
+ * may be asleep until ringFlush()
+*/
+void ringPush(struct wsRing *r) {
+  unsigned depth = r->tail+1 - __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+  if (depth > r->deepest) r->deepest = depth;
+  r->items++;
+  __atomic_store_n(&r->tail, r->tail+1, __ATOMIC_SEQ_CST);
+}; // end ringPush()
+
+/* Start of ringFlush()
+ *------------------------------------------------------------------------------
+ * For the producer, when it has pushed what it has for now: wakes the
+ * consumer if it's asleep
+*/
+void ringFlush(struct wsRing *r) {
+  if ( __atomic_load_n(&r->emptyWait, __ATOMIC_SEQ_CST) ) wake(r->dataFd);
+}; // end ringFlush()
+
+/* Start of ringNext()
+ *------------------------------------------------------------------------------
+ * For the consumer: the next full slot, waiting for up to timeoutMs
+ * (-1 = forever) for one; NULL if none came
+*/
+void *ringNext(struct wsRing *r, int timeoutMs) {
+  unsigned head = r->head;
+
+  if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+    r->empties++;                           // the producer is behind (or idle)
+    while (true) {
+      __atomic_store_n(&r->emptyWait, true, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != head) break;
+      if ( !waitFd(r->dataFd, timeoutMs) ) {
+	__atomic_store_n(&r->emptyWait, false, __ATOMIC_RELAXED);
+	return(NULL);
+      };
+    };
+    __atomic_store_n(&r->emptyWait, false, __ATOMIC_RELAXED);
+  };
+  return( r->slot + (head & (r->nSlots-1)) * r->slotSize );
+}; // end ringNext()
+
+/* Start of ringPop()
+ *------------------------------------------------------------------------------
+ * For the consumer: gives the slot it has used back to the producer
+*/
+void ringPop(struct wsRing *r) {
+  __atomic_store_n(&r->head, r->head+1, __ATOMIC_SEQ_CST);
+  if ( __atomic_load_n(&r->fullWait, __ATOMIC_SEQ_CST) ) wake(r->roomFd);
+}; // end ringPop()
+
+/* Start of ringsReport()
+ *------------------------------------------------------------------------------
+ * Prints each ring's counts to "out"
+*/
+void ringsReport(FILE *out) {
+  struct wsRing *r;
+  int i;
+
+  for (i=0; i<nRings; i++) {
+    r = rings[i];
+    fprintf(out, "[%WS] %s: %lu passed, at most %u of %u waiting; "
+	    "full %lu time%s, empty %lu time%s\n", r->name, r->items, r->deepest, r->nSlots,
+	    r->fulls, r->fulls==1 ? "" : "s", r->empties, r->empties==1 ? "" : "s");
+  };
+}; // end ringsReport()
+
+/* Start of ringsJSON()
+ *------------------------------------------------------------------------------
+ * Renders each ring's counts, as they are now, into buf as a JSON array.
+ * Returns the length, or -1 if it didn't fit.
+*/
+int ringsJSON(char *buf, int size) {
+  struct wsRing *r;
+  int i, n;
+
+  n = snprintf(buf, size, "[");
+  for (i=0; i<nRings && n<size; i++) {
+    r = rings[i];
+    n += snprintf(buf+n, size-n, "%s{\"queue\":\"%s\",\"passed\":%lu,\"waiting\":%u,\"deepest\":%u,"
+		  "\"slots\":%u,\"full\":%lu,\"empty\":%lu}", i ? "," : "", r->name,
+		  __atomic_load_n(&r->items, __ATOMIC_RELAXED),
+		  __atomic_load_n(&r->tail, __ATOMIC_RELAXED) - __atomic_load_n(&r->head, __ATOMIC_RELAXED),
+		  __atomic_load_n(&r->deepest, __ATOMIC_RELAXED), r->nSlots,
+		  __atomic_load_n(&r->fulls, __ATOMIC_RELAXED), __atomic_load_n(&r->empties, __ATOMIC_RELAXED));
+  };
+  if (n < size) n += snprintf(buf+n, size-n, "]");
+  return( n<size ? n : -1 );
+}; // end ringsJSON()
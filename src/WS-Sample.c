@@ -0,0 +1,358 @@
+/*  WS-Sample.c
+    Binary sample frames for the WeatherStation controller.
+
+    In "binary" mode the probe sends each sample as one fixed-layout frame
+    of frameLen (40) bytes, CRC-checked, rather than as lines of text (see
+    WP/WP.h for the layout).  These routines check and decode those frames
+    and render a decoded sample in the text formats the probe itself would
+    have sent -- report, csv, or xml -- so that what ws records is the same
+    whichever way the sample crossed the serial link.  The probe simulator,
+    wpsim, uses them the other way around, to speak as the probe does.
+
+    A csv tuple, the probe's or a capture's, is read back into a sample by
+    parseSample(), field by field as fieldList[] has them, in place and
+    without sscanf(): a date_time that isn't one, a field that isn't a
+    number, a value no sensor could report, or one field too few or too
+    many, and the line is refused before it gets near a store.  A decoded
+    frame has its values put to the same checks, by checkSample().  So a line
+    garbled on the serial link is never stored, and the stores bind the
+    sample's values as they are rather than having the text re-read.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include "WS.h"
+
+/* Little-endian fields of a frame, and readings in tenths, NAN if there's none */
+#define get16(p) ((short) ((p)[0] | (p)[1]<<8))
+#define get32(p) ((int) ((p)[0] | (p)[1]<<8 | (p)[2]<<16 | (unsigned) (p)[3]<<24))
+#define getTenths(p) (get16(p) == frameNoReading16 ? NAN : get16(p)/10.0)
+
+/* Start of crc16()
+ *------------------------------------------------------------------------------
+ * CRC-16/CCITT, poly 0x1021, init 0xFFFF: the same computation as the probe's
+*/
+unsigned short crc16(const unsigned char *p, int n) {
+  unsigned short crc = 0xFFFF;
+  int i;
+
+  while (n--) {
+    crc ^= *p++ << 8;
+    for (i=0; i<8; i++) crc = (crc & 0x8000) ? (crc<<1) ^ 0x1021 : crc<<1;
+  };
+  return(crc);
+}; // end crc16()
+
+/* Start of checkFrame()
+ *------------------------------------------------------------------------------
+ * Looks at the "avail" bytes received starting at f, which begin with
+ * frameMagic0.  Returns frameLen if they start with a complete frame whose
+ * header and CRC are good, 0 if they could be the start of one but more bytes
+ * are needed to tell, and -1 if they aren't a good frame.
+*/
+int checkFrame(const unsigned char *f, int avail) {
+  if (avail < 2) return(0);
+  if (f[1] != frameMagic1) return(-1);
+  if (avail < 4) return(0);
+  if (f[2] != frameVersion || f[3] != framePayloadLen) return(-1);
+  if (avail < frameLen) return(0);
+  if ( crc16(f+2, framePayloadLen+2) != (unsigned short) get16(f+frameLen-2) ) return(-1);
+  return(frameLen);
+}; // end checkFrame()
+
+/* Start of decodeFrame()
+ *------------------------------------------------------------------------------
+ * Unpacks a frame that checkFrame() has passed into a sample.  A field
+ * holding its "no reading" value decodes as NAN, as "nan" does from the
+ * probe's text.  Returns false if the date-time in it isn't plausible.
+*/
+boolean decodeFrame(const unsigned char *f, struct wsSample *s) {
+  const unsigned char *p = f+4;
+  int i;
+
+  if ( p[2]<1 || p[2]>12 || p[3]<1 || p[3]>31 || p[4]>23 || p[5]>59 || p[6]>60 ) return(false);
+  snprintf(s->dt, sizeof(s->dt), "%04d-%02d-%02d %02d:%02d:%02d",
+	   (unsigned short) get16(p), p[2], p[3], p[4], p[5], p[6]);
+  p += 7;
+  s->mplPress = get32(p) == frameNoReading32 ? NAN : get32(p); p += 4;
+  s->mplTemp  = getTenths(p); p += 2;
+  s->mplAlt   = getTenths(p); p += 2;
+  s->dhtTemp  = getTenths(p); p += 2;
+  s->dhtRH    = *p == frameNoReadingRH ? NAN : *p;
+  p++;
+  for (i=0; i<dsMax; i++) {
+    s->dsLabel[i][0] = *p++;
+    s->dsLabel[i][1] = *p++;
+    s->dsLabel[i][2] = 0;
+    s->dsTemp[i] = getTenths(p); p += 2;
+  };
+  return(true);
+}; // end decodeFrame()
+
+/* Start of encodeFrame()
+ *------------------------------------------------------------------------------
+ * The reverse of decodeFrame(), as the probe's sendFrame() does it: packs a
+ * sample into frame f, which must have room for frameLen bytes.  Used by the
+ * probe simulator, wpsim.
+*/
+#define put16(p,v) do { int v_ = (v); (p)[0] = v_ & 0xFF; (p)[1] = (v_>>8) & 0xFF; p += 2; } while (0)
+#define put32(p,v) do { int v32_ = (v); put16(p, v32_ & 0xFFFF); put16(p, (v32_>>16) & 0xFFFF); } while (0)
+#define tenths(x)  (isnan(x) ? frameNoReading16 : (int) ((x)*10 + ((x)<0 ? -0.5 : 0.5)))
+
+void encodeFrame(struct wsSample *s, unsigned char *f) {
+  unsigned char *p = f;
+  int i;
+
+  *p++ = frameMagic0;
+  *p++ = frameMagic1;
+  *p++ = frameVersion;
+  *p++ = framePayloadLen;
+  put16(p, atoi(s->dt));
+  for (i=5; i<=17; i+=3) *p++ = atoi(s->dt+i);
+  put32(p, isnan(s->mplPress) ? frameNoReading32 : (int) (s->mplPress + 0.5));
+  put16(p, tenths(s->mplTemp));
+  put16(p, tenths(s->mplAlt));
+  put16(p, tenths(s->dhtTemp));
+  *p++ = isnan(s->dhtRH) ? frameNoReadingRH : (int) (s->dhtRH + 0.5);
+  for (i=0; i<dsMax; i++) {
+    *p++ = s->dsLabel[i][0];
+    *p++ = s->dsLabel[i][1];
+    put16(p, tenths(s->dsTemp[i]));
+  };
+  i = crc16(f+2, framePayloadLen+2);
+  put16(p, i);
+}; // end encodeFrame()
+#undef put16
+#undef put32
+#undef tenths
+
+/* Start of formatSample()
+ *------------------------------------------------------------------------------
+ * Renders a sample into buf as the probe would have sent it in "mode":
+ * one report line, one csv tuple, or one xml <sample>...</sample>.
+ * Returns the length of the text, or -1 if it didn't fit.
+*/
+int formatSample(storeModes mode, struct wsSample *s, char *buf, int size) {
+  int i, n = 0;
+
+#define emit(...) do { n += snprintf(buf+n, n<size ? size-n : 0, __VA_ARGS__); } while (0)
+  switch (mode) {
+    case rptMode:
+      emit("%s  MPL: Altitude=%.1fm Pressure=%.0fPa Temp=%.1f\xB0""F", s->dt, s->mplAlt, s->mplPress, s->mplTemp);
+      emit("  DHT22: Temp=%.1f\xB0""F @ %.0f%% RH  DS18: ", s->dhtTemp, s->dhtRH);
+      for (i=0; i<dsMax; i++) emit("%s=%.1f\xB0""F ", s->dsLabel[i], s->dsTemp[i]);
+      emit("\r\n");
+      break;
+    case sqlMode:
+    case tsMode:                            // ws stores the csv tuple in columns
+      emit("('%s',%.0f,%.1f,%.1f,%.0f", s->dt, s->mplPress, s->mplTemp, s->dhtTemp, s->dhtRH);
+      for (i=0; i<dsMax; i++)
+	if (strcmp(s->dsLabel[i], "**") == 0) emit(",'**',00.0");
+	else emit(",'%s',%.1f", s->dsLabel[i], s->dsTemp[i]);
+      emit(")\r\n");
+      break;
+    case xmlMode:
+      emit("<sample>\r\n<date_time>'%s'</date_time>\r\n", s->dt);
+      emit("<MPL3115A2>\r\n<mpl_press p_unit=\"Pa\">%.0f</mpl_press>\r\n", s->mplPress);
+      emit("<mpl_temp t_scale=\"F\">%.1f</mpl_temp>\r\n</MPL3115A2>\r\n", s->mplTemp);
+      emit("<DHT22>\r\n<dht_temp t_scale=\"F\">%.1f</dht_temp>\r\n", s->dhtTemp);
+      emit("<dht_rh unit=\"%%\">%.0f</dht_rh>\r\n</DHT22>\r\n", s->dhtRH);
+      for (i=0; i<dsMax; i++)
+	if (strcmp(s->dsLabel[i], "**") == 0)
+	  emit("<DS18>\n<ds18_lbl>**</ds18_lbl>\n<ds18_temp t_scale=\"F\">00.0</ds18_temp>\n</DS18>\r\n");
+	else
+	  emit("<DS18>\r\n<ds18_lbl>%s</ds18_lbl>\r\n<ds18_temp t_scale=\"F\">%.1f</ds18_temp>\r\n</DS18>\r\n",
+	       s->dsLabel[i], s->dsTemp[i]);
+      emit("</sample>\r\n");
+      break;
+    default:
+      break;
+  };
+#undef emit
+  return( n<size ? n : -1 );
+}; // end formatSample()
+
+/* ProbeData's columns, less probe_id (fieldList[] in WS.c), in the order of
+   a csv tuple: where each is in a wsSample, and the values a probe can
+   report for it.  A sensor that's missing reads 0; temperatures are F.    */
+static const struct sampleCol {
+  char *name;
+  size_t off;
+  char kind;                              // 'd' date_time, 'i' whole, 'r' real, 'l' DS18 label
+  double lo, hi;
+} sampleCols[nSampleFields] = {
+  {"date_time",   offsetof(struct wsSample, dt),         'd'},
+  {"mpl_press",   offsetof(struct wsSample, mplPress),   'i', 0, 120000},
+  {"mpl_temp",    offsetof(struct wsSample, mplTemp),    'r', -100, 260},
+  {"dht22_temp",  offsetof(struct wsSample, dhtTemp),    'r', -100, 260},
+  {"dht22_rh",    offsetof(struct wsSample, dhtRH),      'i', 0, 100},
+  {"ds18_1_lbl",  offsetof(struct wsSample, dsLabel[0]), 'l'},
+  {"ds18_1_temp", offsetof(struct wsSample, dsTemp[0]),  'r', -100, 260},
+  {"ds18_2_lbl",  offsetof(struct wsSample, dsLabel[1]), 'l'},
+  {"ds18_2_temp", offsetof(struct wsSample, dsTemp[1]),  'r', -100, 260},
+  {"ds18_3_lbl",  offsetof(struct wsSample, dsLabel[2]), 'l'},
+  {"ds18_3_temp", offsetof(struct wsSample, dsTemp[2]),  'r', -100, 260},
+  {"ds18_4_lbl",  offsetof(struct wsSample, dsLabel[3]), 'l'},
+  {"ds18_4_temp", offsetof(struct wsSample, dsTemp[3]),  'r', -100, 260}};
+
+/* A number as the probe prints it, [-]digits[.digits], or "nan" for a
+   failed reading, up to the end of the field; returns what follows it, or
+   NULL if it isn't one.  Up to
+   15 digits are exact in a double, so dividing by the power of ten rounds
+   the same way strtod() would.                                            */
+static const char *number(const char *p, double *v) {
+  static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+				 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+  long long m = 0;
+  int digits = 0, frac = 0;
+  boolean neg = false, point = false;
+
+  if (*p == '-' || *p == '+') neg = (*p++ == '-');
+  if (strncmp(p, "nan", 3) == 0 || strncmp(p, "NAN", 3) == 0) {
+    *v = NAN;
+    return(p+3);
+  };
+  for ( ; ; p++)
+    if (*p >= '0' && *p <= '9') {
+      if (++digits > 15) return(NULL);
+      m = m*10 + (*p - '0');
+      if (point) frac++;
+    }
+    else if (*p == '.' && !point) point = true;
+    else break;
+  if (digits == 0 || (*p != ',' && *p != ')' && *p != ' ')) return(NULL);
+  *v = (neg ? -m : m) / pow10[frac];
+  return(p);
+};
+
+/* A date_time, "yyyy-mm-dd hh:mm:ss", with its fields in range */
+static boolean isDateTime(const char *p) {
+  static const char form[] = "dddd-dd-dd dd:dd:dd";
+  int i, mon, day, hr, min, sec;
+
+  for (i=0; form[i]; i++)
+    if ( form[i] == 'd' ? (p[i] < '0' || p[i] > '9') : p[i] != form[i] ) return(false);
+#define two(i) ((p[i]-'0')*10 + p[(i)+1]-'0')
+  mon = two(5); day = two(8); hr = two(11); min = two(14); sec = two(17);
+#undef two
+  return( mon >= 1 && mon <= 12 && day >= 1 && day <= 31 && hr < 24 && min < 60 && sec < 61 );
+};
+
+static boolean refuse(const char **why, const char *reason) {
+  if (why) *why = reason;
+  return(false);
+};
+
+/* Start of parseSample()
+ *------------------------------------------------------------------------------
+ * Reads a csv tuple, as the probe sends it (and formatSample() writes it),
+ * back into a sample, checking each field.  Returns false, and why, if it
+ * isn't one.
+*/
+boolean parseSample(const char *line, struct wsSample *s, const char **why) {
+  const struct sampleCol *c;
+  const char *p = line;
+  double *v;
+  int i, n;
+
+  memset(s, 0, sizeof(*s));
+  while (*p == ' ') p++;
+  if (*p++ != '(') return(refuse(why, "isn't a csv tuple"));
+  for (i=0; i<nSampleFields; i++) {
+    c = &sampleCols[i];
+    while (*p == ' ') p++;
+    switch (c->kind) {
+      case 'd':
+	if (*p != '\'' || !isDateTime(p+1) || p[20] != '\'')
+	  return(refuse(why, "has a date_time that isn't one"));
+	memcpy(s->dt, p+1, 19);
+	p += 21;
+	break;
+      case 'l':
+	for (n=0; n<3 && p[n+1] && p[n+1] != '\'' && p[n+1] != ','; n++) ;
+	if (*p != '\'' || n == 0 || n > 2 || p[n+1] != '\'')
+	  return(refuse(why, "has a DS18 label that isn't 1 or 2 characters"));
+	memcpy((char *) s + c->off, p+1, n);
+	p += n+2;
+	break;
+      default:
+	v = (double *) ((char *) s + c->off);
+	if ( (p=number(p, v)) == NULL ) return(refuse(why, "has a field that isn't a number"));
+	break;
+    };
+    while (*p == ' ') p++;
+    if (*p != (i < nSampleFields-1 ? ',' : ')'))
+      return(refuse(why, *p == ',' ? "has too many fields" : "has too few fields"));
+    p++;
+  };
+  return( checkSample(s, why) );
+}; // end parseSample()
+
+/* Start of checkSample()
+ *------------------------------------------------------------------------------
+ * Checks a sample's values, however it arrived -- parsed from a csv tuple or
+ * decoded from a frame: a date_time that is one, each reading (but a failed
+ * one, NAN) in its sensor's range, and DS18 labels of 1 or 2 printable
+ * characters other than quotes, commas, and backslashes.  Returns false,
+ * and why, if one isn't.
+*/
+boolean checkSample(const struct wsSample *s, const char **why) {
+  const struct sampleCol *c;
+  const char *p;
+  double v;
+  int i, n;
+
+  for (i=0; i<nSampleFields; i++) {
+    c = &sampleCols[i];
+    p = (const char *) s + c->off;
+    switch (c->kind) {
+      case 'd':
+	if ( !isDateTime(p) || p[19] != 0 ) return(refuse(why, "has a date_time that isn't one"));
+	break;
+      case 'l':
+	for (n=0; n<3 && p[n]; n++)
+	  if ( p[n] < ' ' || p[n] > '~' || strchr("'\",\\", p[n]) )
+	    return(refuse(why, "has a DS18 label that isn't printable"));
+	if (n == 0 || n > 2) return(refuse(why, "has a DS18 label that isn't 1 or 2 characters"));
+	break;
+      default:
+	v = *(const double *) p;
+	if ( !isnan(v) && (v < c->lo || v > c->hi) )
+	  return(refuse(why, "has a reading no sensor could make"));
+	break;
+    };
+  };
+  return(true);
+}; // end checkSample()
+
+/* Start of sampleColumn()
+ *------------------------------------------------------------------------------
+ * Where column "name" of ProbeData is among a sample's fields, or -1
+*/
+int sampleColumn(const char *name) {
+  int c;
+
+  for (c=0; c<nSampleFields && strcmp(sampleCols[c].name, name) != 0; c++) ;
+  return( c<nSampleFields ? c : -1 );
+}; // end sampleColumn()
+
+/* Start of sampleField()
+ *------------------------------------------------------------------------------
+ * Field c of sample s, as the stores bind it: a number in *v, or the text
+ * of date_time or a label in *text.  Returns the field's kind: 'd', 'i',
+ * 'r', or 'l'.
+*/
+char sampleField(const struct wsSample *s, int c, double *v, const char **text) {
+  const char *p = (const char *) s + sampleCols[c].off;
+
+  if (sampleCols[c].kind == 'd' || sampleCols[c].kind == 'l') {
+    if (text) *text = p;
+  }
+  else if (v) *v = *(const double *) p;
+  return(sampleCols[c].kind);
+}; // end sampleField()
@@ -0,0 +1,244 @@
+/*  WS-TSCodec.c
+    Compression of column store blocks, for "ws ts".
+
+    Successive samples differ very little: the time advances by the same
+    period each time, the pressure by a few Pa, the temperatures by a tenth
+    of a degree or not at all, and the labels and probe_id never change.
+    So a full block of a column (tsBlockRows values) is stored as the
+    changes from one value to the next, packed into as few bits as they
+    need, in the manner of Facebook's Gorilla:
+
+      o  Whole numbers -- date_time, the INT fields, probe_id, and the
+         labels, taken 4 characters at a time as a number -- are stored as
+         their delta-of-delta: the change in the difference between
+         successive values.  It's 0 for a steady period or a steady value,
+         which costs 1 bit; small ones cost 9 to 16 bits.
+      o  REAL fields that are all in tenths, as the probe reports them, are
+         stored the same way as whole numbers of tenths.
+      o  Other REAL fields are stored as the XOR of each float with the one
+         before: 1 bit when it's unchanged, otherwise just the bits that
+         changed.
+
+    Values that jump about (none of the probe's do) can take more space
+    encoded than not; such a block is stored as it is.  A block starts
+    with one byte saying which encoding it uses.  Decoding
+    writes the values back in the column's fixed-width form, so the reader
+    handles a decoded block and an uncompressed one in the same way.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "WS.h"
+
+#define codecDoD    'D'                   // delta-of-delta of whole numbers
+#define codecTenths 'S'                   //   of tenths, for REALs
+#define codecXOR    'X'                   // XOR of successive floats
+#define codecRaw    'R'                   // as they were, if nothing else is smaller
+
+/* Bits written to, or read from, a byte buffer, most significant first */
+struct bitBuf {
+  unsigned char *p;
+  long len, max;                          // bytes used (writing) or available (reading)
+  unsigned long long acc;                 // bits not yet stored, or not yet used
+  int nAcc;
+  boolean over;                           // ran off the end
+};
+
+static void putBits(struct bitBuf *b, unsigned long long v, int n) {
+  if (n == 64) {                          // in two pieces: acc holds < 64 more
+    putBits(b, v>>32, 32);
+    putBits(b, v & 0xFFFFFFFF, 32);
+    return;
+  };
+  b->acc = (b->acc << n) | (v & ((1ULL<<n)-1));
+  b->nAcc += n;
+  while (b->nAcc >= 8) {
+    b->nAcc -= 8;
+    if (b->len < b->max) b->p[b->len++] = (unsigned char) (b->acc >> b->nAcc);
+    else b->over = true;
+  };
+};
+
+static void flushBits(struct bitBuf *b) {
+  if (b->nAcc > 0) putBits(b, 0, 8-b->nAcc);
+};
+
+static unsigned long long getBits(struct bitBuf *b, int n) {
+  unsigned long long v;
+
+  if (n == 64) {
+    v = getBits(b, 32) << 32;
+    return( v | getBits(b, 32) );
+  };
+  while (b->nAcc < n) {
+    b->acc = (b->acc << 8) | (b->len < b->max ? b->p[b->len] : 0);
+    if (b->len++ >= b->max) b->over = true;
+    b->nAcc += 8;
+  };
+  b->nAcc -= n;
+  return( (b->acc >> b->nAcc) & ((1ULL<<n)-1) );
+};
+
+/* Zig-zag: small negative and positive numbers both become small */
+#define zigzag(v)   ( ((unsigned long long) (v) << 1) ^ (unsigned long long) ((v) >> 63) )
+#define unzigzag(u) ( (long long) ((u) >> 1) ^ -(long long) ((u) & 1) )
+
+/* The delta-of-delta buckets: a prefix of 1s ended by a 0, then the bits */
+static const int dodBits[] = {0, 7, 9, 12, 64};
+
+static void putDoD(struct bitBuf *b, const long long v[], int n) {
+  long long delta = 0, d;
+  unsigned long long z;
+  int i, k;
+
+  putBits(b, v[0], 64);
+  for (i=1; i<n; i++) {
+    d = v[i] - v[i-1];
+    z = zigzag(d - delta);
+    delta = d;
+    for (k=0; k<4 && z >= (1ULL<<dodBits[k]); k++) ;
+    putBits(b, (1ULL<<(k+1)) - 2 + (k==4), k<4 ? k+1 : 4);   // k 1s, then 0 unless k==4
+    if (k > 0) putBits(b, z, dodBits[k]);
+  };
+};
+
+static void getDoD(struct bitBuf *b, long long v[], int n) {
+  unsigned long long z;
+  long long delta = 0;
+  int i, k;
+
+  v[0] = (long long) getBits(b, 64);
+  for (i=1; i<n; i++) {
+    for (k=0; k<4 && getBits(b, 1); k++) ;
+    if (k > 0) {
+      z = getBits(b, dodBits[k]);
+      delta += unzigzag(z);
+    };
+    v[i] = v[i-1] + delta;
+  };
+};
+
+/* Gorilla's XOR encoding, for 32-bit floats: 0 = same as the last value;
+   10 = the changed bits fit the last window; 11 = a new window follows   */
+static void putXOR(struct bitBuf *b, const unsigned int v[], int n) {
+  int i, lead = 33, trail = 0, l, t;
+  unsigned int x;
+
+  putBits(b, v[0], 32);
+  for (i=1; i<n; i++) {
+    if ( (x = v[i] ^ v[i-1]) == 0 ) {
+      putBits(b, 0, 1);
+      continue;
+    };
+    l = __builtin_clz(x);
+    t = __builtin_ctz(x);
+    if (l >= lead && t >= trail && lead <= 32) {
+      putBits(b, 2, 2);
+      putBits(b, x >> trail, 32-lead-trail);
+      continue;
+    };
+    lead = (l > 31) ? 31 : l;
+    trail = t;
+    putBits(b, 3, 2);
+    putBits(b, lead, 5);
+    putBits(b, 32-lead-trail-1, 5);        // 1..32 bits, as 0..31
+    putBits(b, x >> trail, 32-lead-trail);
+  };
+};
+
+static void getXOR(struct bitBuf *b, unsigned int v[], int n) {
+  int i, lead = 0, len = 32;
+
+  v[0] = (unsigned int) getBits(b, 32);
+  for (i=1; i<n; i++) {
+    if (getBits(b, 1) == 0) {
+      v[i] = v[i-1];
+      continue;
+    };
+    if (getBits(b, 1) == 1) {
+      lead = (int) getBits(b, 5);
+      len = (int) getBits(b, 5) + 1;
+    };
+    v[i] = v[i-1] ^ ((unsigned int) getBits(b, len) << (32-lead-len));
+  };
+};
+
+/* Start of tsEncode()
+ *------------------------------------------------------------------------------
+ * Compresses n values of a column of "type", in the column's fixed-width
+ * form at "raw", into out[0..max-1].  Returns the bytes used, or -1 if they
+ * didn't fit.
+*/
+int tsEncode(tsTypes type, const unsigned char *raw, int n, unsigned char *out, int max) {
+  struct bitBuf b = {out, 1, max, 0, 0, false};
+  long long *v;
+  float f;
+  int i, w;
+
+  if (n < 1 || max < 1) return(-1);
+  if ( (v=malloc(n * sizeof(long long))) == NULL ) return(-1);
+  out[0] = codecDoD;
+  for (i=0; i<n; i++)
+    switch (type) {
+      case tsTime:  v[i] = ((long long *) raw)[i]; break;
+      case tsInt:   v[i] = ((int *) raw)[i]; break;
+      case tsLabel: v[i] = ((unsigned int *) raw)[i]; break;
+      case tsReal:                         // in tenths, if it's exactly so
+	f = ((float *) raw)[i];
+	v[i] = llrint(f*10.0);
+	if ( !isfinite(f) || fabs(f) > 1e8 || (float) (v[i]/10.0) != f ) out[0] = codecXOR;
+	break;
+    };
+  if (type == tsReal && out[0] == codecDoD) out[0] = codecTenths;
+  if (out[0] == codecXOR) putXOR(&b, (unsigned int *) raw, n);
+    else putDoD(&b, v, n);
+  flushBits(&b);
+  free(v);
+  w = (type == tsTime) ? 8 : 4;
+  if ( b.over || b.len > 1 + (long) n*w ) {  // no smaller: store the values as they are
+    if (1 + n*w > max) return(-1);
+    out[0] = codecRaw;
+    memcpy(out+1, raw, n*w);
+    return(1 + n*w);
+  };
+  return( (int) b.len );
+}; // end tsEncode()
+
+/* Start of tsDecode()
+ *------------------------------------------------------------------------------
+ * Expands the len bytes at "in", made by tsEncode(), back into n values of
+ * a column of "type" at "raw".  Returns false if they don't decode.
+*/
+boolean tsDecode(tsTypes type, const unsigned char *in, int len, unsigned char *raw, int n) {
+  struct bitBuf b = {(unsigned char *) in, 1, len, 0, 0, false};
+  long long *v;
+  int i;
+
+  if (len < 1 || n < 1) return(false);
+  if (in[0] == codecRaw) {
+    if (len != 1 + n*((type == tsTime) ? 8 : 4)) return(false);
+    memcpy(raw, in+1, len-1);
+    return(true);
+  };
+  if (in[0] == codecXOR) {
+    if (type != tsReal) return(false);
+    getXOR(&b, (unsigned int *) raw, n);
+    return(!b.over);
+  };
+  if ( (in[0] != codecDoD && in[0] != codecTenths) || (v=malloc(n * sizeof(long long))) == NULL )
+    return(false);
+  getDoD(&b, v, n);
+  for (i=0; i<n; i++)
+    switch (type) {
+      case tsTime:  ((long long *) raw)[i] = v[i]; break;
+      case tsInt:   ((int *) raw)[i] = (int) v[i]; break;
+      case tsLabel: ((unsigned int *) raw)[i] = (unsigned int) v[i]; break;
+      case tsReal:  ((float *) raw)[i] = (in[0] == codecTenths) ? (float) (v[i]/10.0) : (float) v[i]; break;
+    };
+  free(v);
+  return(!b.over);
+}; // end tsDecode()
@@ -0,0 +1,533 @@
+/*  WS-TSMgr.c
+    Procedures to record meteorological data in a column store, "ws ts".
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+
+    ProbeData keeps a sample as one wide row, keyed by its date_time as
+    text, so a chart of one field over a month reads every column of every
+    row and compares strings all the way.  The column store keeps each
+    field of fieldList[] in a file of its own, <dir>/<field>.col, as an
+    array of fixed-width binary values, one per row: date_time as 64-bit
+    epoch seconds, INT fields as 32-bit integers, REAL fields as floats,
+    and the DS18 labels as 4 characters.  A reading the probe sent as
+    "nan" is stored as a NAN float, or as tsIntNull.  A query reads only
+    the columns it asks for.
+
+    <dir>/index.ts holds the column list and the number of rows stored,
+    followed by an entry for each block of tsBlockRows rows giving the
+    earliest and latest date_time in the block and the smallest and largest
+    value of each numeric column.  A time-range query looks at the entries
+    to find the blocks it needs and reads nothing else; a downsampling
+    query that wants a min/max over a whole block can take it from the
+    entry without reading the block at all.
+
+    Once a block is full, each of its columns is compressed (WS-TSCodec.c)
+    and appended to <dir>/<field>.tsz, and its place there recorded in the
+    block's index entry; the block's space in the .col file is then given
+    back to the file system as a hole, leaving the .col files sparse and
+    the recent, incomplete block as the only uncompressed data on disk.
+    The compressed copy is synced before the index points to it, and the
+    index before the hole is punched, so a crash at any point leaves one
+    copy or the other; a full block found uncompressed when the store is
+    opened (after a crash, say) is compressed then.  Readers decompress a
+    block at a time, with tsBlockData(), which returns the block's values
+    in their uncompressed form whichever way they're stored.  A reader in
+    another process may be copying a block just as ws seals it, so an
+    entry's zOff is written before its zLen, which is stored with release
+    semantics, and tsBlockData() looks at zLen again after copying a block
+    from the .col file, taking the compressed copy instead if it has since
+    appeared -- the hole may have been punched under the copy.
+
+    The files are memory-mapped, shared, and appended to in place.  They are
+    extended tsGrowRows rows at a time, ahead of need, and trimmed to what
+    has been stored when ws terminates.  A row's values and its block entry
+    are written before the row count is advanced, so a reader -- or ws after
+    a crash -- never sees a partial row.  The maps are msync()'d at most
+    every tsSyncSecs, so a power failure loses at most that much data.
+
+    tsOpen() and the tsGet()/tsRowRange() helpers are for readers, too: they
+    open a store read-only when given no field list.
+*/
+
+#define _GNU_SOURCE                       // for mremap(), fallocate()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "WS.h"
+
+#define tsMagic "WSTS0002"
+
+/* The start of index.ts */
+struct tsHeader {
+  char magic[8];
+  int nCols, blockRows;
+  long long rows;
+  struct {
+    char name[tsNameMax];
+    int type;
+  } col[tsColMax];
+};
+#define tsHdr(ts) ((struct tsHeader *) (ts)->idxMap)
+
+static struct tsStore *tsW = NULL;        // the store ws is recording to
+static time_t tsLastSync;
+static int tsField[tsColMax];             // each column's field in a sample; -1 for probe_id
+
+static boolean sealBlock(struct tsStore *ts, long long b);
+
+/* Bytes of index needed for "rows" rows */
+static size_t idxBytes(long long rows) {
+  return( tsHdrSize + (rows+tsBlockRows-1)/tsBlockRows * sizeof(struct tsBlock) );
+};
+
+/* A column's type, from its SQL attributes in fieldList[] */
+static tsTypes typeOf(struct fieldDesc *f) {
+  if (strcmp(f->fieldName, "date_time") == 0) return(tsTime);
+  if (strncmp(f->fieldAttributes, "INT", 3) == 0) return(tsInt);
+  if (strncmp(f->fieldAttributes, "REAL", 4) == 0) return(tsReal);
+  return(tsLabel);
+};
+
+/* Maps "len" bytes of fd, or returns NULL (with errno) */
+static unsigned char *mapFile(int fd, size_t len, boolean writable) {
+  void *p;
+
+  if (len == 0) return(NULL);
+  p = mmap(NULL, len, writable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  return( p == MAP_FAILED ? NULL : (unsigned char *) p );
+};
+
+/* Makes room for "capacity" rows in every file and re-maps them */
+static boolean resize(struct tsStore *ts, long long capacity) {
+  struct tsColumn *col;
+  size_t len;
+  void *p;
+  int c;
+
+  for (c=0; c<ts->nCols; c++) {
+    col = &ts->col[c];
+    len = capacity * col->width;
+    if ( ftruncate(col->fd, len) < 0 ) return(false);
+    p = col->map ? mremap(col->map, col->mapLen, len, MREMAP_MAYMOVE) : mapFile(col->fd, len, true);
+    if (p == MAP_FAILED || p == NULL) return(false);
+    col->map = p;
+    col->mapLen = len;
+  };
+  len = idxBytes(capacity);
+  if ( ftruncate(ts->idxFd, len) < 0
+       || (p=mremap(ts->idxMap, ts->idxLen, len, MREMAP_MAYMOVE)) == MAP_FAILED ) return(false);
+  ts->idxMap = p;
+  ts->idxLen = len;
+  ts->capacity = capacity;
+  return(true);
+};
+
+/* Start of tsOpen()
+ *------------------------------------------------------------------------------
+ * Opens the column store in "dir".  Given the field list, opens it to append
+ * to, creating it if need be, and checks that it has those columns; given
+ * NULL, opens it read-only with the columns it has.  Returns NULL, with a
+ * message, if that can't be done.
+*/
+struct tsStore *tsOpen(char *dir, struct fieldDesc fields[]) {
+  struct tsStore *ts;
+  struct tsHeader *h;
+  struct stat st;
+  char path[512];
+  boolean writable = (fields != NULL), fresh;
+  long long b;
+  int c, flags = writable ? O_RDWR|O_CREAT : O_RDONLY;
+
+  if ( (ts=calloc(1, sizeof(struct tsStore))) == NULL ) return(NULL);
+  for (c=0; c<tsColMax; c++) {
+    ts->col[c].fd = ts->col[c].zFd = -1;
+    ts->col[c].blkNo = -1;
+  };
+  snprintf(ts->dir, sizeof(ts->dir), "%s", dir);
+  ts->writable = writable;
+  if (writable && mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "[?WS] Can't create column store directory %s: %s\n", dir, strerror(errno));
+    free(ts);
+    return(NULL);
+  };
+
+  /* The index first: it says what columns there are and how many rows */
+  snprintf(path, sizeof(path), "%s/index.ts", dir);
+  if ( (ts->idxFd=open(path, flags, 0644)) < 0 || fstat(ts->idxFd, &st) < 0 ) {
+    fprintf(stderr, "[?WS] Can't open column store index %s: %s\n", path, strerror(errno));
+    free(ts);
+    return(NULL);
+  };
+  fresh = (st.st_size == 0);
+  if ( (fresh && !writable) || (!fresh && st.st_size < tsHdrSize) ) {
+    fprintf(stderr, "[?WS] %s is not a column store index\n", path);
+    close(ts->idxFd);
+    free(ts);
+    return(NULL);
+  };
+  if ( (fresh && ftruncate(ts->idxFd, tsHdrSize) < 0)
+       || (ts->idxMap=mapFile(ts->idxFd, ts->idxLen=fresh ? tsHdrSize : st.st_size, writable)) == NULL ) {
+    fprintf(stderr, "[?WS] Can't map column store index %s: %s\n", path, strerror(errno));
+    close(ts->idxFd);
+    free(ts);
+    return(NULL);
+  };
+  h = tsHdr(ts);
+  if (fresh) {                             // a new store: record its columns
+    memcpy(h->magic, tsMagic, 8);
+    h->blockRows = tsBlockRows;
+    for (c=0; c<tsColMax && fields[c].fieldName!=NULL; c++) {
+      snprintf(h->col[c].name, tsNameMax, "%s", fields[c].fieldName);
+      h->col[c].type = typeOf(&fields[c]);
+    };
+    h->nCols = c;
+  };
+  if ( memcmp(h->magic, tsMagic, 8) != 0 || h->blockRows != tsBlockRows
+       || h->nCols < 1 || h->nCols > tsColMax ) {
+    fprintf(stderr, "[?WS] %s is not a column store index\n", path);
+    tsClose(ts);
+    return(NULL);
+  };
+  for (c=0; writable && c<=h->nCols; c++)  // an existing store must match
+    if ( (c == h->nCols) != (fields[c].fieldName == NULL)
+	 || (c < h->nCols && (strcmp(h->col[c].name, fields[c].fieldName) != 0
+			      || h->col[c].type != typeOf(&fields[c]))) ) {
+      fprintf(stderr, "[?WS] Column store %s doesn't have the columns ws records; use another directory\n", dir);
+      tsClose(ts);
+      return(NULL);
+    };
+
+  /* Then each column */
+  ts->nCols = h->nCols;
+  ts->rows = h->rows;
+  ts->timeCol = -1;
+  for (c=0; c<ts->nCols; c++) {
+    struct tsColumn *col = &ts->col[c];
+
+    strcpy(col->name, h->col[c].name);
+    col->type = h->col[c].type;
+    col->width = (col->type == tsTime) ? 8 : 4;
+    if (col->type == tsTime && ts->timeCol < 0) ts->timeCol = c;
+    snprintf(path, sizeof(path), "%s/%s.col", dir, col->name);
+    if ( (col->fd=open(path, flags, 0644)) < 0 || fstat(col->fd, &st) < 0
+	 || (!writable && st.st_size < ts->rows*col->width) ) {
+      fprintf(stderr, "[?WS] Column file %s is missing or short\n", path);
+      tsClose(ts);
+      return(NULL);
+    };
+    snprintf(path, sizeof(path), "%s/%s.tsz", dir, col->name);
+    if ( (col->zFd=open(path, writable ? O_RDWR|O_CREAT|O_APPEND : O_RDONLY, 0644)) < 0
+	 || (col->blk=malloc(tsBlockRows * col->width)) == NULL ) {
+      fprintf(stderr, "[?WS] Can't open compressed column file %s: %s\n", path, strerror(errno));
+      tsClose(ts);
+      return(NULL);
+    };
+    if ( !writable && ts->rows > 0
+	 && (col->map=mapFile(col->fd, col->mapLen=ts->rows*col->width, false)) == NULL ) {
+      fprintf(stderr, "[?WS] Can't map column file %s: %s\n", path, strerror(errno));
+      tsClose(ts);
+      return(NULL);
+    };
+  };
+  if (ts->timeCol < 0) {
+    fprintf(stderr, "[?WS] Column store %s has no date_time column\n", dir);
+    tsClose(ts);
+    return(NULL);
+  };
+  if (!writable) ts->capacity = ts->rows;
+  if ( !writable && ts->idxLen < idxBytes(ts->rows) ) {
+    fprintf(stderr, "[?WS] Column store index in %s is short\n", dir);
+    tsClose(ts);
+    return(NULL);
+  };
+  if ( writable && !resize(ts, (ts->rows/tsGrowRows + 1) * tsGrowRows) ) {
+    fprintf(stderr, "[?WS] Can't extend column store %s: %s\n", dir, strerror(errno));
+    tsClose(ts);
+    return(NULL);
+  };
+  for (b=0; writable && b<ts->rows/tsBlockRows; b++)   // full blocks left uncompressed
+    if ( !sealBlock(ts, b) ) {
+      tsClose(ts);
+      return(NULL);
+    };
+  return(ts);
+}; // end tsOpen()
+
+/* Start of tsClose()
+ *------------------------------------------------------------------------------
+ * Releases a store opened by tsOpen().  One opened for writing is synced and
+ * its files trimmed to the rows stored (unless it never got that far).
+*/
+void tsClose(struct tsStore *ts) {
+  boolean trim = ts->writable && ts->capacity > 0;
+  int c;
+
+  for (c=0; c<ts->nCols; c++) {
+    if (ts->col[c].map) {
+      if (ts->writable) msync(ts->col[c].map, ts->col[c].mapLen, MS_SYNC);
+      munmap(ts->col[c].map, ts->col[c].mapLen);
+    };
+    if (trim) ftruncate(ts->col[c].fd, ts->rows*ts->col[c].width);
+    if (ts->col[c].fd >= 0) close(ts->col[c].fd);
+    if (ts->col[c].zFd >= 0) close(ts->col[c].zFd);
+    free(ts->col[c].blk);
+  };
+  if (ts->idxMap) {
+    if (ts->writable) msync(ts->idxMap, ts->idxLen, MS_SYNC);
+    munmap(ts->idxMap, ts->idxLen);
+  };
+  if (trim) ftruncate(ts->idxFd, idxBytes(ts->rows));
+  close(ts->idxFd);
+  free(ts);
+}; // end tsClose()
+
+/* Start of tsColumnOf()
+ *------------------------------------------------------------------------------
+ * Returns the number of the column called "name", or -1 if there's none
+*/
+int tsColumnOf(struct tsStore *ts, char *name) {
+  int c;
+
+  for (c=0; c<ts->nCols; c++)
+    if (strcmp(ts->col[c].name, name) == 0) return(c);
+  return(-1);
+}; // end tsColumnOf()
+
+/* Start of tsBlockData()
+ *------------------------------------------------------------------------------
+ * Returns the values of column c in block b, in their fixed-width form, in
+ * the column's block buffer (good until the next call for another block of
+ * the column): copied from the column file, or, if the block is compressed,
+ * decompressed.  Returns NULL if the block can't be read.  For readers: the
+ * rows are those there were when the store was opened.
+*/
+unsigned char *tsBlockData(struct tsStore *ts, int c, long long b) {
+  struct tsColumn *col = &ts->col[c];
+  struct tsBlock *e = tsBlockAt(ts, b);
+  long long rows = ts->rows - b*tsBlockRows;
+  unsigned char *z;
+  boolean ok;
+  int zLen;
+
+  if (col->blkNo == b) return(col->blk);
+  if ( (zLen=__atomic_load_n(&e->zLen[c], __ATOMIC_ACQUIRE)) == 0 ) {
+    /* Not compressed -- unless ws seals the block while we copy it and
+       punches it out of the column file: keep the copy only if it didn't */
+    memcpy(col->blk, col->map + b*tsBlockRows*col->width,
+	   (rows < tsBlockRows ? rows : tsBlockRows) * col->width);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ( (zLen=__atomic_load_n(&e->zLen[c], __ATOMIC_RELAXED)) == 0 ) {
+      col->blkNo = b;
+      return(col->blk);
+    };
+  };
+  if ( (z=malloc(zLen)) == NULL ) return(NULL);
+  ok = pread(col->zFd, z, zLen, e->zOff[c]) == zLen
+       && tsDecode(col->type, z, zLen, col->blk, tsBlockRows);
+  free(z);
+  if (!ok) {
+    fprintf(stderr, "[?WS] Compressed block %lld of column %s in %s is damaged\n", b, col->name, ts->dir);
+    col->blkNo = -1;
+    return(NULL);
+  };
+  col->blkNo = b;
+  return(col->blk);
+}; // end tsBlockData()
+
+/* Start of tsValueAt()
+ *------------------------------------------------------------------------------
+ * Returns a pointer to the value in row r of column c, in its fixed-width form
+ * (see tsBlockData()), or NULL if it can't be read
+*/
+unsigned char *tsValueAt(struct tsStore *ts, int c, long long r) {
+  unsigned char *d = tsBlockData(ts, c, r/tsBlockRows);
+
+  return( d ? d + (r%tsBlockRows)*ts->col[c].width : NULL );
+}; // end tsValueAt()
+
+/* Start of tsGet()
+ *------------------------------------------------------------------------------
+ * Returns the value in row r of column c, as a number (0 for a label, or
+ * for a value that can't be read)
+*/
+double tsGet(struct tsStore *ts, int c, long long r) {
+  unsigned char *v = tsValueAt(ts, c, r);
+
+  if (v == NULL) return(0);
+  switch (ts->col[c].type) {
+    case tsTime: return( *(long long *) v );
+    case tsInt:  return( *(int *) v == tsIntNull ? NAN : *(int *) v );
+    case tsReal: return( *(float *) v );
+    default:     return(0);
+  };
+}; // end tsGet()
+
+/* Start of tsRowRange()
+ *------------------------------------------------------------------------------
+ * Finds, from the block index alone, the rows that can hold samples taken
+ * from t0 to t1 (epoch seconds, inclusive): *first up to but not including
+ * *last.  Rows in that range outside t0..t1 are the caller's to skip.
+ * Returns false if no block overlaps t0..t1.
+*/
+boolean tsRowRange(struct tsStore *ts, long long t0, long long t1, long long *first, long long *last) {
+  long long b, nBlocks = (ts->rows+tsBlockRows-1)/tsBlockRows;
+  struct tsBlock *e;
+
+  *first = *last = -1;
+  for (b=0; b<nBlocks; b++) {
+    e = tsBlockAt(ts, b);
+    if (e->tMax < t0 || e->tMin > t1) continue;
+    if (*first < 0) *first = b*tsBlockRows;
+    *last = (b+1)*tsBlockRows;
+  };
+  if (*last > ts->rows) *last = ts->rows;
+  return(*first >= 0);
+}; // end tsRowRange()
+
+/* Start of sealBlock()
+ *------------------------------------------------------------------------------
+ * Compresses each column of full block b that isn't already, appends it to
+ * the column's .tsz file, records where it is in the index, and punches the
+ * block out of the .col file.  Returns false, with a message, if it can't.
+*/
+static boolean sealBlock(struct tsStore *ts, long long b) {
+  static unsigned char z[tsBlockRows*9 + 16];  // worst case: 64 bits and a prefix per value
+  struct tsBlock *e = tsBlockAt(ts, b);
+  struct tsColumn *col;
+  off_t off[tsColMax];
+  int c, n[tsColMax];
+  boolean any = false;
+
+  for (c=0; c<ts->nCols; c++) {
+    col = &ts->col[c];
+    n[c] = 0;
+    if (e->zLen[c] > 0) continue;
+    if ( (n[c]=tsEncode(col->type, col->map + b*tsBlockRows*col->width, tsBlockRows, z, sizeof(z))) < 0
+	 || (off[c]=lseek(col->zFd, 0, SEEK_END)) < 0
+	 || write(col->zFd, z, n[c]) != n[c] || fdatasync(col->zFd) < 0 ) {
+      fprintf(stderr, "[?WS] Can't write compressed column %s in %s: %s\n", col->name, ts->dir,
+	      n[c] < 0 ? "encoding failed" : strerror(errno));
+      return(false);
+    };
+    any = true;
+  };
+  if (!any) return(true);
+  for (c=0; c<ts->nCols; c++)
+    if (n[c] > 0) {                         // where, then how much: a reader that
+      e->zOff[c] = off[c];                  //   sees the length sees the offset
+      __atomic_store_n(&e->zLen[c], n[c], __ATOMIC_RELEASE);
+    };
+  msync(ts->idxMap, ts->idxLen, MS_SYNC);   // the index points at the copies before
+  for (c=0; c<ts->nCols; c++) {             //   the originals go; a file system that
+    col = &ts->col[c];                      //   can't punch holes just keeps them
+    if (n[c] > 0)
+      fallocate(col->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		b*tsBlockRows*col->width, tsBlockRows*col->width);
+  };
+  return(true);
+}; // end sealBlock()
+
+/* Start of initTSMgr()
+ *------------------------------------------------------------------------------
+ * Opens (or creates) the column store ws records to, for the life of the run
+*/
+void initTSMgr(char *dir, struct fieldDesc fields[]) {
+  int c;
+
+  if ( (tsW=tsOpen(dir, fields)) == NULL ) exit(EXIT_FAILURE);
+  for (c=0; c<tsW->nCols; c++)
+    if ( (tsField[c]=sampleColumn(tsW->col[c].name)) < 0 && strcmp(tsW->col[c].name, "probe_id") != 0 ) {
+      fprintf(stderr, "[?WS] Column %s of store %s isn't a field of a sample\n", tsW->col[c].name, dir);
+      exit(EXIT_FAILURE);
+    };
+  tsLastSync = time(NULL);
+  fprintf(stdout, "[%WS] Opened column store %s: %d columns, %lld rows\n", dir, tsW->nCols, tsW->rows);
+}; // end initTSMgr()
+
+/* Start of appendToTS()
+ *------------------------------------------------------------------------------
+ * Appends sample "s" as a row, in binary, updating the block's index entry;
+ * probe_id is the probe the sample came from
+*/
+void appendToTS(int probeID, struct wsSample *s) {
+  struct tsStore *ts = tsW;
+  struct tsBlock *e;
+  struct tm tm;
+  const char *text[tsColMax];
+  long long t = 0;
+  double v[tsColMax];
+  int c;
+
+  for (c=0; c<ts->nCols; c++) {
+    if (tsField[c] < 0) {
+      v[c] = probeID;
+      continue;
+    };
+    sampleField(s, tsField[c], &v[c], &text[c]);
+    if (ts->col[c].type == tsTime) {       // parseSample() has checked its form
+      memset(&tm, 0, sizeof(tm));
+      sscanf(text[c], "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+	     &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+      tm.tm_year -= 1900;
+      tm.tm_mon--;
+      tm.tm_isdst = -1;                    // the probe keeps local time
+      v[c] = t = mktime(&tm);
+    };
+  };
+
+  if ( ts->rows == ts->capacity && !resize(ts, ts->capacity + tsGrowRows) ) {
+    fprintf(stderr, "[?WS] Can't extend column store %s: %s\n", ts->dir, strerror(errno));
+    exit(EXIT_FAILURE);
+  };
+  e = tsBlockAt(ts, ts->rows/tsBlockRows);
+  if (ts->rows % tsBlockRows == 0) {       // first row of a block
+    memset(e, 0, sizeof(*e));
+    e->tMin = e->tMax = t;
+    for (c=0; c<ts->nCols; c++) {          // until a reading is seen
+      e->min[c] = INFINITY;
+      e->max[c] = -INFINITY;
+    };
+  };
+  if (t < e->tMin) e->tMin = t;
+  if (t > e->tMax) e->tMax = t;
+  for (c=0; c<ts->nCols; c++) {
+    unsigned char *p = ts->col[c].map + ts->rows*ts->col[c].width;
+
+    switch (ts->col[c].type) {
+      case tsTime:  *(long long *) p = (long long) v[c]; break;
+      case tsInt:   *(int *) p = isnan(v[c]) ? tsIntNull : (int) lrint(v[c]);  break;
+      case tsReal:  *(float *) p = (float) v[c]; break;
+      case tsLabel: strncpy((char *) p, text[c], 4); break;
+    };
+    if ( (ts->col[c].type == tsInt || ts->col[c].type == tsReal) && !isnan(v[c]) ) {
+      if (v[c] < e->min[c]) e->min[c] = v[c];
+      if (v[c] > e->max[c]) e->max[c] = v[c];
+    };
+  };
+  __sync_synchronize();                     // the row is complete before it's counted
+  tsHdr(ts)->rows = ++ts->rows;
+  if (ts->rows % tsBlockRows == 0 && !sealBlock(ts, ts->rows/tsBlockRows - 1))
+    exit(EXIT_FAILURE);
+
+  if (time(NULL) - tsLastSync >= tsSyncSecs) {
+    for (c=0; c<ts->nCols; c++) msync(ts->col[c].map, ts->col[c].mapLen, MS_SYNC);
+    msync(ts->idxMap, ts->idxLen, MS_SYNC);
+    tsLastSync = time(NULL);
+  };
+}; // end appendToTS()
+
+/* Start of closeTSMgr()
+ *------------------------------------------------------------------------------
+ * Syncs the column store and trims its files to the rows stored
+*/
+void closeTSMgr(void) {
+  if (tsW) tsClose(tsW);
+  tsW = NULL;
+}; // end closeTSMgr()
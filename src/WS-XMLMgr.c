@@ -0,0 +1,348 @@
+/*  WS-XMLMgr.c
+    Procedures to append meteorological data to the XML data file.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+
+    The file named on the command line is opened once, in initXMLMgr(),
+    and held open for the life of the run.  Lines are collected in a
+    large stdio buffer and written out together when a sample is complete,
+    so a sample costs one write() rather than an open/write/close for each
+    of its lines.
+
+    The document on disk is kept well-formed: every write of a sample
+    carries the closing "</samples>" after it, and the next sample is
+    written over that trailer.  The file is fdatasync()'d at a sample
+    boundary at most every xmlSyncSecs, so a crash or power failure loses
+    at most that much data, and never leaves a half-written sample or a
+    missing trailer behind.
+
+    A file left by a crash under an older ws, or cut short some other way,
+    is repaired at startup: anything after the last complete </sample> is
+    removed and "</samples>" is put back.  Either way, the new samples
+    continue the document already in the file, and the probe's prolog
+    (<?xml ...>, <!DOCTYPE ...>, <samples>) is dropped rather than repeated.
+
+    With no file name, samples go to stdout as they always have, flushed at
+    each sample boundary, and "</samples>" is written at the end.
+
+    Rotation ("-r day", "-r 100M", or both, "-r day,100M") keeps any one
+    file from growing without limit.  At the first sample boundary after
+    the calendar day changes, or after the file reaches the size limit,
+    the file is closed as it stands -- a complete document -- and renamed
+    with the date (and, for size rotation, the time) it was started:
+    weather.xml becomes weather-2017-09-01.xml or weather-2017-09-01-134500.xml.
+    ws carries on with a new weather.xml that starts with its own prolog.
+    A rotated file is gzip-compressed (to weather-2017-09-01.xml.gz) by a
+    background thread, so that sampling isn't held up, and the uncompressed
+    copy is removed once the compressed one is safely written.  libxml2
+    reads the .gz files directly.
+*/
+
+#define _GNU_SOURCE                       // for memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include "WS.h"
+
+#define xmlTrailer "</samples>\n"
+#define xmlTailMax 65536                  // how far back to look for the last sample
+#define xmlPrologue "<?xml version=\"1.0\" ?>\r\n<!DOCTYPE samples SYSTEM \"weather_data.dtd\">\r\n"
+#define gzQueueMax 16                     // rotated files waiting to be compressed
+
+static FILE *xmlout = NULL;
+static boolean xmlToFile;
+static char *xmlName;
+static char xmlBuf[xmlBufSize];
+static boolean inDoc;                     // <samples> has been written
+static long xmlEnd;                       // where the trailer starts, in the file
+static time_t lastSync;
+static long rotateBytes = 0;              // -r size limit; 0 = none
+static boolean rotateDaily = false;       // -r day
+static time_t started;                    // when the current file was begun
+
+static pthread_t gzThread;                // compresses rotated files
+static boolean gzRunning = false, gzStop = false;
+static pthread_mutex_t gzLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gzReady = PTHREAD_COND_INITIALIZER;
+static char gzQueue[gzQueueMax][PATH_MAX];
+static int gzHead = 0, gzCount = 0;
+
+static long findEnd(int fd, off_t size, boolean *clean);
+static void openXML(int flags);
+static void rotateXML(void);
+static void *gzWorker(void *arg);
+
+/* The local calendar day that "t" falls in, as one number */
+static int dayOf(time_t t) {
+  struct tm tm;
+
+  localtime_r(&t, &tm);
+  return( tm.tm_year*1000 + tm.tm_yday );
+};
+
+/* Start of initXMLMgr()
+ *------------------------------------------------------------------------------
+ * Opens "name" (stdout if NULL), creating it if necessary, and gets it
+ * ready for appendToXML(): checks that an existing file ends with a complete
+ * sample and the </samples> trailer, repairing it if not.
+*/
+void initXMLMgr(char *name) {
+  struct stat st;
+  boolean clean;
+  long end;
+  int fd;
+
+  xmlToFile = (name != NULL);
+  xmlName = name;
+  if (!xmlToFile) {
+    xmlout = stdout;
+    setvbuf(xmlout, xmlBuf, _IOFBF, xmlBufSize);
+    return;
+  };
+  openXML(O_RDWR|O_CREAT);
+  fd = fileno(xmlout);
+  fstat(fd, &st);
+  if (st.st_size == 0) return;              // new document: the probe's prolog starts it
+  started = st.st_mtime;                    // (as near as we can tell)
+
+  if ( (end=findEnd(fd, st.st_size, &clean)) < 0 ) {
+    fprintf(stderr, "[?WS] %s is not a ws xml data file; not appending to it\n", name);
+    exit(EXIT_FAILURE);
+  };
+  inDoc = true;
+  if (!clean) {
+    fprintf(stderr, "[%WS] %s was not closed properly: %ld bytes after the last sample "
+	    "replaced by %s", name, (long) st.st_size - end, xmlTrailer);
+    if ( ftruncate(fd, end) < 0 || fseek(xmlout, end, SEEK_SET) < 0
+	 || fputs(xmlTrailer, xmlout) == EOF || fflush(xmlout) == EOF || fdatasync(fd) < 0 ) {
+      fprintf(stderr, "[?WS] Cannot repair %s\n", name);
+      exit(EXIT_FAILURE);
+    };
+  };
+  fseek(xmlout, end, SEEK_SET);             // new samples go over the trailer
+  xmlEnd = end;
+}; // end initXMLMgr
+
+/* Start of appendToXML()
+ *------------------------------------------------------------------------------
+ * Adds "text" (one or more lines) to the document.  At the end of a sample
+ * ("endsSample"), or of the prolog, the buffered lines are written out with
+ * the trailer after them, and synced to disk if xmlSyncSecs have passed.
+*/
+void appendToXML(char *text, boolean endsSample) {
+  boolean isPrologue = strncmp(text, "<?xml", 5) == 0 || strncmp(text, "<!DOCTYPE", 9) == 0
+                       || strncmp(text, "<samples>", 9) == 0;
+  time_t now;
+
+  if (isPrologue && inDoc) return;          // continuing a document: already has one
+  fputs(text, xmlout);
+  if (strncmp(text, "<samples>", 9) == 0) endsSample = inDoc = true;
+  if (!endsSample) return;
+  if (!xmlToFile) {
+    fflush(xmlout);
+    return;
+  };
+  fputs(xmlTrailer, xmlout);
+  if ( fflush(xmlout) == EOF ) {
+    fprintf(stderr, "[?WS] Cannot write to %s\n", xmlName);
+    exit(EXIT_FAILURE);
+  };
+  fseek(xmlout, -(long) strlen(xmlTrailer), SEEK_CUR);
+  xmlEnd = ftell(xmlout);
+  now = time(NULL);
+  if ( (rotateBytes > 0 && xmlEnd >= rotateBytes) || (rotateDaily && dayOf(now) != dayOf(started)) ) {
+    rotateXML();
+    return;
+  };
+  if (now - lastSync >= xmlSyncSecs) {
+    fdatasync(fileno(xmlout));
+    lastSync = now;
+  };
+}; // end appendToXML
+
+/* Start of setXMLRotation()
+ *------------------------------------------------------------------------------
+ * Sets rotation from a "-r" argument: "day", a size in bytes with an
+ * optional K, M, or G, or both separated by a comma.  False if it's neither.
+*/
+boolean setXMLRotation(char *spec) {
+  char *p, *end;
+  double size;
+
+  for (p=spec; *p; p=end+(*end==',')) {
+    if (strncasecmp(p, "day", 3) == 0) {
+      rotateDaily = true;
+      end = p+3;
+    }
+    else {
+      size = strtod(p, &end);
+      switch (*end) {
+        case 'k': case 'K': size *= 1024; end++; break;
+        case 'm': case 'M': size *= 1024*1024; end++; break;
+        case 'g': case 'G': size *= 1024*1024*1024; end++; break;
+      };
+      if (end == p || size < 4096) return(false);
+      rotateBytes = (long) size;
+    };
+    if (*end != ',' && *end != 0) return(false);
+  };
+  return(true);
+}; // end setXMLRotation
+
+/* Start of closeXMLMgr()
+ *------------------------------------------------------------------------------
+ * Ends the document and closes the file.  A sample that was only partly
+ * received is dropped: the file is cut back to the last complete one.
+*/
+void closeXMLMgr(void) {
+  if (!xmlToFile) {
+    fputs(xmlTrailer, xmlout);
+    fflush(xmlout);
+    return;
+  };
+  fflush(xmlout);
+  if ( inDoc && ftruncate(fileno(xmlout), xmlEnd) == 0 && fseek(xmlout, xmlEnd, SEEK_SET) == 0 )
+    fputs(xmlTrailer, xmlout);
+  fflush(xmlout);
+  fdatasync(fileno(xmlout));
+  fclose(xmlout);
+  if (gzRunning) {                          // let the compressor finish its queue
+    pthread_mutex_lock(&gzLock);
+    gzStop = true;
+    pthread_cond_signal(&gzReady);
+    pthread_mutex_unlock(&gzLock);
+    pthread_join(gzThread, NULL);
+  };
+}; // end closeXMLMgr
+
+/* Opens xmlName for reading and writing with the open(2) "flags", with
+   the big output buffer                                                    */
+static void openXML(int flags) {
+  int fd;
+
+  if ( (fd=open(xmlName, flags, 0644)) < 0 || (xmlout=fdopen(fd, "r+")) == NULL ) {
+    fprintf(stderr, "[?WS] Cannot open %s for output\n", xmlName);
+    exit(EXIT_FAILURE);
+  };
+  setvbuf(xmlout, xmlBuf, _IOFBF, xmlBufSize);
+  lastSync = started = time(NULL);
+  inDoc = false;
+  xmlEnd = 0;
+}; // end openXML
+
+/* Closes the current file, which ends with its trailer and so is a complete
+   document, gives it its dated name, hands it to the compressor, and
+   starts the next document under the original name                       */
+static void rotateXML(void) {
+  char stem[PATH_MAX], when[32], rotated[PATH_MAX], gz[PATH_MAX];
+  struct stat st;
+  int n, seq;
+
+  fdatasync(fileno(xmlout));
+  fclose(xmlout);
+
+  n = strlen(xmlName);
+  if (n > 4 && strcasecmp(xmlName+n-4, ".xml") == 0) n -= 4;
+  snprintf(stem, sizeof(stem), "%.*s", n, xmlName);
+  strftime(when, sizeof(when), rotateBytes>0 ? "%Y-%m-%d-%H%M%S" : "%Y-%m-%d", localtime(&started));
+  for (seq=0; seq<1000; seq++) {            // never overwrite an earlier rotation
+    if (seq == 0) snprintf(rotated, sizeof(rotated), "%s-%s.xml", stem, when);
+      else snprintf(rotated, sizeof(rotated), "%s-%s.%d.xml", stem, when, seq);
+    snprintf(gz, sizeof(gz), "%s.gz", rotated);
+    if ( stat(rotated, &st) < 0 && stat(gz, &st) < 0 ) break;
+  };
+  if ( rename(xmlName, rotated) < 0 ) {
+    fprintf(stderr, "[?WS] Cannot rename %s to %s: %s\n", xmlName, rotated, strerror(errno));
+    exit(EXIT_FAILURE);
+  };
+
+  pthread_mutex_lock(&gzLock);
+  if (!gzRunning)
+    gzRunning = ( pthread_create(&gzThread, NULL, gzWorker, NULL) == 0 );
+  if (gzRunning && gzCount < gzQueueMax) {
+    snprintf(gzQueue[(gzHead+gzCount++) % gzQueueMax], PATH_MAX, "%s", rotated);
+    pthread_cond_signal(&gzReady);
+  }
+  else
+    fprintf(stderr, "[%WS] Compressor is behind; %s left uncompressed\n", rotated);
+  pthread_mutex_unlock(&gzLock);
+
+  openXML(O_RDWR|O_CREAT|O_TRUNC);
+  appendToXML(xmlPrologue, false);
+  appendToXML("<samples>\r\n", false);
+}; // end rotateXML
+
+/* The compressor thread: gzips each file queued by rotateXML() to <file>.gz,
+   writing to a temporary name and renaming it when it's complete, then
+   removes the original.  Exits when told to and the queue is empty.       */
+static void *gzWorker(void *arg) {
+  char name[PATH_MAX], tmp[PATH_MAX+8], gz[PATH_MAX+4], buf[65536];
+  gzFile out;
+  FILE *in;
+  size_t n;
+  boolean ok;
+
+  while (true) {
+    pthread_mutex_lock(&gzLock);
+    while (gzCount == 0 && !gzStop) pthread_cond_wait(&gzReady, &gzLock);
+    if (gzCount == 0) {
+      pthread_mutex_unlock(&gzLock);
+      return(NULL);
+    };
+    strcpy(name, gzQueue[gzHead]);
+    gzHead = (gzHead+1) % gzQueueMax;
+    gzCount--;
+    pthread_mutex_unlock(&gzLock);
+
+    snprintf(gz, sizeof(gz), "%s.gz", name);
+    snprintf(tmp, sizeof(tmp), "%s.gz.tmp", name);
+    ok = ( (in=fopen(name, "r")) != NULL );
+    if ( ok && (out=gzopen(tmp, "wb6")) != NULL ) {
+      while ( ok && (n=fread(buf, 1, sizeof(buf), in)) > 0 )
+        ok = ( gzwrite(out, buf, n) == (int) n );
+      ok = ( gzclose(out) == Z_OK ) && ok && !ferror(in);
+    }
+    else ok = false;
+    if (in) fclose(in);
+    if ( ok && rename(tmp, gz) == 0 )
+      unlink(name);
+    else {
+      fprintf(stderr, "[%WS] Could not compress %s; left as it is\n", name);
+      unlink(tmp);
+    };
+  };
+}; // end gzWorker
+
+/* Finds where the next sample should go in an existing file of "size" bytes:
+   just after the last complete </sample>, or after <samples> if there are
+   none yet.  "clean" is set if what follows that point is just the trailer.
+   Returns -1 if neither is in the last xmlTailMax bytes.                   */
+static long findEnd(int fd, off_t size, boolean *clean) {
+  static char tail[xmlTailMax+1];
+  char *p, *last = NULL;
+  off_t base = size > xmlTailMax ? size-xmlTailMax : 0;
+  int n, tagLen;
+
+  if ( (n=pread(fd, tail, size-base, base)) <= 0 ) return(-1);
+  tail[n] = 0;
+  tagLen = strlen("</sample>");
+  for (p=tail; (p=memmem(p, n-(p-tail), "</sample>", tagLen)) != NULL; p += tagLen) last = p;
+  if (last == NULL) {
+    tagLen = strlen("<samples>");
+    for (p=tail; (p=memmem(p, n-(p-tail), "<samples>", tagLen)) != NULL; p += tagLen) last = p;
+  };
+  if (last == NULL) return(-1);
+  p = last + tagLen;
+  if (*p == '\r') p++;
+  if (*p == '\n') p++;
+  *clean = ( strcmp(p, xmlTrailer) == 0 || strcmp(p, "</samples>\r\n") == 0 );
+  return( base + (p-tail) );
+}; // end findEnd
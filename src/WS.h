@@ -8,6 +8,10 @@
 #define myPwd      "BetterNotBeRaspberry"
 #define myDB       "weather"
 #define sqlite3DB "~/WeatherData.db"
+#define insertCols "INSERT INTO ProbeData (date_time, mpl_press, mpl_temp, dht22_temp, dht22_rh," \
+                   "ds18_1_lbl, ds18_1_temp,ds18_2_lbl, ds18_2_temp,ds18_3_lbl, ds18_3_temp, ds18_4_lbl, ds18_4_temp," \
+                   "probe_id) "
+#define dbBatchMax 8192               // most rows queued between database commits
 
 #ifdef USE_SQLITE3
   #include <sqlite3.h>
@@ -20,24 +24,255 @@
   #include <mysql.h>
 #endif // end USE_MYSQL
 
-#define SAMPLE_PERIOD 288             // 5 min between samples less 12 sec for processing
+#define SAMPLE_PERIOD 300             // 5 min between samples, on a fixed timer schedule
+#define streamMax    3600             // longest -t period (STREAM_MAX in WP.h)
+#define latestStaleMs 120000          // a probe's "latest" sample older than this is
+                                      //   reported (2 x UPDATE_DELAY in WP.h)
 #define rBufSize 4096
 #define lBufSize 4096
 #define oBufSize  256
+#define sBufSize 4096                 // one complete XML sample
+#define xmlBufSize 65536              // XML output is written a sample at a time from here
+#define xmlSyncSecs   10              // most seconds of XML output a crash can lose
+#define maxProbes   8                 // most probes one ws will service
+#define baseBaud    9600              // the probe's rate after reset
+#define baudChecks     5              // round trips that must succeed at a new rate
+#define baudConfirmMs 3000            // probe reverts a rate change not confirmed by then
+                                      //   (BAUD_CONFIRM in WP.h)
+#define benchWindowMax 256            // most "sample"s outstanding per probe with -w
+#define tsDefaultDir "/var/databases/WeatherTS"  // column store, if "ts" isn't given one
+#define tsBlockRows  4096             // rows summarized by each block index entry
+#define tsGrowRows  65536             // column files are extended this many rows at a time
+#define tsSyncSecs     10             // most seconds of column data a crash can lose
+#define tsColMax       16             // most columns in a store
+#define tsNameMax      20             // longest column name, with its NUL
+#define tsIntNull (-2147483647-1)     // an INT column's value for a reading of "nan"
+#define httpWorkers     4             // requests ws -H answers at once
+#define httpQueueMax   32             // connections waiting for a worker; more are refused
+#define httpIdleSecs    5             // a request's headers, or the next, must come within this
+#define httpMaxRequests 100           //   or after this many requests
+#define httpCacheSize  16             // /history answers kept for the next viewer
+#define httpReqMax   2048             // longest request line and headers
+#define httpLatestMax 1024            // one probe's latest sample, as JSON
+#define pipeSlots    1024             // lines, or samples, queued between ingest stages
+#define pipeLineMax   512             // longest line passed between them
+#define rejoinTries     5             // seconds a lost probe that's back has to answer
 typedef enum  {false=0, true=~0} boolean;
-typedef enum {noMode=0, rptMode, sqlMode, xmlMode} storeModes;
+typedef enum {noMode=0, rptMode, sqlMode, xmlMode, tsMode, importMode} storeModes;
+typedef enum {evTimeout=0, evPort, evSample, evSignal, evPortDown} wsEvents;
+
+/* Binary sample frame sent by the probe in "binary" mode.  The layout is
+   described, and must be kept the same, in WP/WP.h.                      */
+#define frameMagic0     0xA5
+#define frameMagic1     0x5A
+#define frameVersion    1
+#define framePayloadLen 34
+#define frameLen        (4+framePayloadLen+2)
+#define frameNoReading32 (-2147483647-1) // a failed reading (NaN): int32 fields
+#define frameNoReading16 (-32768)     //   int16 fields
+#define frameNoReadingRH 0xFF         //   RH
+#define dsMax           4             // DS18 readings in a sample (DSMAX in WP.h)
+struct wsSample {                     // one decoded sample
+  char dt[20];                        // "yyyy-mm-dd hh:mm:ss"
+  double mplPress, mplTemp, mplAlt;   // Pa, F, m
+  double dhtTemp, dhtRH;              // F, %
+  char dsLabel[dsMax][3];             // "**" for an absent DS18
+  double dsTemp[dsMax];};             // F; NAN (SQL NULL) where the probe sent "nan"
+#define nSampleFields  13             // its fields, as a csv tuple: fieldList[] less probe_id
+struct fieldDesc {                    // a ProbeData column: name, SQL type
+  char *fieldName;
+  char *fieldAttributes;};
+
+/* Column store ("ws ts"): one memory-mapped file per column, plus an index
+   with the row count and, for each block of tsBlockRows rows, the range of
+   date_time and of each numeric column in it, and where the compressed
+   copy of each column of the block is.  See WS-TSMgr.c and WS-TSCodec.c. */
+typedef enum {tsTime=0, tsInt, tsReal, tsLabel} tsTypes;
+struct tsColumn {
+  char name[tsNameMax];
+  tsTypes type;
+  int width;                          // bytes per value
+  int fd;
+  unsigned char *map;                 // the values, row 0 first
+  size_t mapLen;
+  int zFd;                            // full blocks, compressed
+  unsigned char *blk;                 // one block, decompressed for reading
+  long long blkNo;};                  //   which one, or -1
+struct tsBlock {                      // index entry for one block of rows
+  long long tMin, tMax;               // epoch seconds
+  float min[tsColMax], max[tsColMax];   // numeric columns only
+  long long zOff[tsColMax];           // compressed block in <column>.tsz,
+  int zLen[tsColMax];};               //   or zLen 0 if not (yet) compressed
+struct tsStore {
+  char dir[256];
+  boolean writable;
+  int nCols, timeCol;                 // timeCol: the date_time column
+  struct tsColumn col[tsColMax];
+  long long rows, capacity;           // rows stored, rows the files have room for
+  int idxFd;
+  unsigned char *idxMap;              // header, then the block entries
+  size_t idxLen;};
+#define tsHdrSize 512
+#define tsBlockAt(ts,b) ((struct tsBlock *) ((ts)->idxMap + tsHdrSize) + (b))
+
+/* A bounded single-producer, single-consumer ring of fixed-size slots,
+   joining two stages of ws's ingest pipeline: see WS-Ring.c.  head is
+   written only by the consumer and tail only by the producer, each on a
+   cache line of its own.                                                  */
+struct wsRing {
+  char name[24];
+  unsigned char *slot;                // nSlots slots of slotSize bytes
+  unsigned nSlots;                    // a power of 2
+  size_t slotSize;
+  unsigned head __attribute__((aligned(64)));  // next slot to use
+  boolean emptyWait;                  // consumer is asleep on dataFd
+  unsigned long empties;              // times the consumer found nothing to do
+  unsigned tail __attribute__((aligned(64)));  // next slot to fill
+  boolean fullWait;                   // producer is asleep on roomFd
+  unsigned long items, fulls;         // slots filled; times the producer found none free
+  unsigned deepest;                   // most slots full at once
+  int dataFd, roomFd;};               // eventfds that wake the consumer, the producer
+struct pipeItem {                     // a line from a probe, or what the parser made of it
+  struct commPort *port;              // the probe; NULL at the end of the data
+  int len;                            // of the text; 0 if it has been parsed into "sample"
+  struct wsSample sample;
+  unsigned char text[pipeLineMax];};
+
+/* The latest sample from each probe, in shared memory: see WS-Latest.c */
+#define latestShmName "/WeatherStation"   // /dev/shm/WeatherStation
+#define latestMagic   "WSLATE01"
+#define latestTries   1000            // 0.1 msec waits for a slot being written, at most
+struct latestSlot {                   // one probe's latest sample
+  unsigned int seq;                   // odd while ws is writing it
+  unsigned long count;                // samples recorded from the probe
+  long long recordedMs;               // when, epoch milliseconds
+  struct wsSample sample;};
+struct latestShm {
+  char magic[8];
+  int pid;                            // ws's, or 0 once it has stopped
+  int nProbes;
+  unsigned long samples;              // recorded from all the probes
+  struct latestSlot slot[maxProbes];};
+
+/* A query of one field over a time range, by wsq or ws's HTTP server: see
+   WS-Query.c.  The caller fills in field, probe, t0, t1, and, optionally,
+   mode, width, and points; the samples or buckets read come back in it.  */
+typedef enum {aAuto=0, aRaw, aLTTB, aMinMax, aAvg} aggModes;
+struct wsPoint {                      // a sample
+  long long t;                        // epoch seconds
+  double v;};
+struct wsBucket {                     // what fell in one bucket, or a rollup of it
+  double min, max, sum;
+  long n;};
+struct wsQuery {
+  char field[tsNameMax];
+  int probe;                          // probe_id, or -1 for all
+  long long t0, t1;                   // time range, inclusive
+  aggModes mode;
+  long long width;                    // bucket width, seconds, for minmax and avg
+  long points;                        // points wanted, for lttb
+  struct wsPoint *pts;                // the samples read, in time order
+  long nPts, maxPts;
+  struct wsBucket *bkts;              // or the buckets they went into
+  long nBkts;
+  long long *starts;                  // each bucket's start, when they're local days
+  boolean failed;};
+
 struct commPort {
   int portNum;                        // port number
-  int baudRate;                       // baud rate
+  int probeID;                        // position on the command line; tags its data
+  char devName[32];                   // e.g., "ttyACM0"
+  int baudRate;                       // baud rate, as negotiated with the probe
+  char version[24];                   // probe's answer to "WhoRU"
   char commMode[4];                   // communication protocol modes
-  unsigned char rBuf[rBufSize];       // receive buffer
-  int rBufLen;};                      // length of current buffer contents
+  unsigned char rBuf[rBufSize+1];     // receive buffer; lines are framed in place
+  int rBufHead;                       // start of the first line not yet returned
+  int rBufScan;                       // no '\n' in rBuf[rBufHead..rBufScan-1]
+  int rBufLen;                        // end of what's been received
+  unsigned char rBufSaved;            // byte displaced by the NUL ending the last line
+  boolean rBufOverlong;               // discarding a line longer than rBufSize
+  boolean heard;                      // probe sent data since the last sample period
+  int quiet;                          // sample periods in a row it hasn't
+  boolean streamed;                   // probe samples on its own timer ("stream")
+  unsigned long seq;                  // number of the last sample it pushed
+  unsigned long lost;                 // pushed samples that never arrived
+  boolean latest;                     // asked for its latest sample, not a new one (-l)
+  boolean binary;                     // probe sends binary frames, not text
+  boolean down;                       // its port hung up or failed, and was closed
+  char sBuf[sBufSize];                // XML sample being assembled, in xml mode
+  int sBufLen;};                      // length of that partial sample
 
 void intHandler(int sigType);
-void appendToDB(unsigned char lBuf[]);
-boolean getDataLine(struct commPort *Uno, unsigned char lBuf[]);
+void appendToDB(int probeID, struct wsSample *s);
+int getDataLine(struct commPort *Uno, unsigned char **line);
+void resetDataLines(struct commPort *Uno);
 storeModes setStoreMode(int argc, char *argv[]);
 void initDBMgr();
-boolean connectToWP(struct commPort *Uno);
+void closeDBMgr(void);
+boolean flushDB(void);
+int dbSecsToFlush(void);
+void initXMLMgr(char *name);
+void appendToXML(char *text, boolean endsSample);
+void closeXMLMgr(void);
+boolean setXMLRotation(char *spec);
+boolean importToDB(char *files[], int n);
+void initTSMgr(char *dir, struct fieldDesc fields[]);
+void appendToTS(int probeID, struct wsSample *s);
+void closeTSMgr(void);
+struct tsStore *tsOpen(char *dir, struct fieldDesc fields[]);
+void tsClose(struct tsStore *ts);
+int tsColumnOf(struct tsStore *ts, char *name);
+double tsGet(struct tsStore *ts, int c, long long r);
+unsigned char *tsBlockData(struct tsStore *ts, int c, long long b);
+unsigned char *tsValueAt(struct tsStore *ts, int c, long long r);
+int tsEncode(tsTypes type, const unsigned char *raw, int n, unsigned char *out, int max);
+boolean tsDecode(tsTypes type, const unsigned char *in, int len, unsigned char *raw, int n);
+boolean tsRowRange(struct tsStore *ts, long long t0, long long t1, long long *first, long long *last);
+long long wsqSeconds(const char *s);
+long long wsqTime(const char *s);
+boolean wsqPrepare(struct wsQuery *q, const char **why);
+boolean wsqReadSQL(struct wsQuery *q, char *dbase);
+boolean wsqReadTS(struct wsQuery *q, char *dir);
+void wsqDownsample(struct wsQuery *q);
+void wsqOutput(struct wsQuery *q, FILE *out, const char *format);
+void wsqFree(struct wsQuery *q);
+void ringInit(struct wsRing *r, char *name, unsigned nSlots, size_t slotSize);
+void *ringSlot(struct wsRing *r);
+void ringPush(struct wsRing *r);
+void ringFlush(struct wsRing *r);
+void *ringNext(struct wsRing *r, int timeoutMs);
+void ringPop(struct wsRing *r);
+void ringsReport(FILE *out);
+int ringsJSON(char *buf, int size);
+void initHTTP(char *spec);
+void closeHTTP(void);
+void initLatest(int nProbes);
+void latestSample(int probeID, struct wsSample *s);
+void closeLatest(void);
+struct latestShm *latestMap(void);
+boolean latestRead(struct latestShm *ls, int probeID, struct latestSlot *slot);
+int latestJSON(int probeID, struct latestSlot *slot, char *buf, int size);
+boolean connectToWP(struct commPort *Uno, int tries);
+boolean startStream(struct commPort *Uno, int secs);
+void initEvents(void);
+void evAddPort(struct commPort *Uno);
+void evDropPort(struct commPort *Uno);
+void evStartSampling(int period);
+wsEvents evWait(int timeoutMs, struct commPort **port);
+boolean waitForPort(struct commPort *Uno, int timeoutMs);
+unsigned short crc16(const unsigned char *p, int n);
+int checkFrame(const unsigned char *f, int avail);
+boolean decodeFrame(const unsigned char *f, struct wsSample *s);
+void encodeFrame(struct wsSample *s, unsigned char *f);
+int formatSample(storeModes mode, struct wsSample *s, char *buf, int size);
+boolean parseSample(const char *line, struct wsSample *s, const char **why);
+boolean checkSample(const struct wsSample *s, const char **why);
+int sampleColumn(const char *name);
+char sampleField(const struct wsSample *s, int c, double *v, const char **text);
+void benchStart(struct commPort probes[], int nProbes);
+void benchStored(struct commPort *Uno);
+void benchCommitted(void);
+boolean benchCheck(struct commPort probes[], int nProbes);
+void benchReport(FILE *out, char *mode, int nProbes);
 
 
@@ -1,55 +1,231 @@
-/* Procedure to confirm that we have WeatherProbe ("wp") software running 
+/* Procedure to confirm that we have WeatherProbe ("wp") software running
    on the Arduino.  Return "true" when successful, "false" if no port.
-   Loops with error message if we can't sync.
+   Loops with error message if we can't sync: for "tries" seconds, or, if
+   that's 0, until the probe answers (so ws can try again later, without
+   holding up its other probes for long, to reach one that was unplugged).  Replies are picked up as
+   soon as they arrive rather than after a fixed sleep.
 
-   A correctly-functioning probe will respond with "WP v<version #>"
+   A correctly-functioning probe will respond with "WP<version #>"
    when it receives a "WhoRU" query.
 
+   Once the probe has answered at baseBaud, host and probe step the link
+   up through the faster rates in baudRates[], as far as maxBaud allows,
+   keeping the fastest one that passes a round-trip check (see
+   negotiateBaud() below).
+
+   With "ws -t", startStream() then has the probe sample on its own timer
+   and push each sample, rather than wait to be asked for it.
+
    Procedure uses "keepReading" external boolean that is set "false"
-   if user types CNTL-C to abort program.  That triggers exit if typed.
+   if user types CNTL-C to abort program.  syncWP() then returns false, and
+   ws shuts down as it would from its event loop, committing what it has.
 
    Written by HDTodd, 2016-08, as part of the WeatherStation system.
 */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <unistd.h>
 #include "rs232.h"
 #include "WS.h"
 
-boolean connectToWP(struct commPort *Uno) {
-  extern boolean keepReading;
-  boolean haveWP = false;
-  int n=0, count=0;
+int maxBaud = 500000;                        // fastest rate to try; set by "-s"
+static int baudRates[] = {115200, 230400, 500000, 0};
+
+static boolean syncWP(struct commPort *Uno, int tries);
+static boolean negotiateBaud(struct commPort *Uno, int tries);
+static boolean gotReply(struct commPort *Uno, char *cmd, char *want, int timeoutMs);
+static boolean waitOut(struct commPort *Uno, int ms);
+
+boolean connectToWP(struct commPort *Uno, int tries) {
 
   // If we can't open the port at all, return with error
-  if ( RS232_OpenComport(Uno->portNum, Uno->baudRate, Uno->commMode) ) return(false);
-  sleep(2);                             // let startup settle down
+  if ( RS232_OpenComport(Uno->portNum, baseBaud, Uno->commMode) ) return(false);
+  Uno->baudRate = baseBaud;
+  resetDataLines(Uno);
+  if ( !syncWP(Uno, tries) ) {
+    RS232_CloseComport(Uno->portNum);
+    return(false);
+  };
+  if (maxBaud > baseBaud) return( negotiateBaud(Uno, tries) );
+  return(true);
+};  // End boolean connectToWP(void)
 
-  /* At this point, we have a serial port open, but we don't know what's at
-     the other end, and we don't know if we're using the same serial settings,
-     and we don't have the communication buffers sync'd.  So we'll clear our
-     buffer, send a "who are you" query, and confirm that we're talking to 
-     each other correctly and in sync.
-  */
+/* At this point, we have a serial port open, but we don't know what's at
+   the other end, and we don't know if we're using the same serial settings,
+   and we don't have the communication buffers sync'd.  So we'll send a
+   "who are you" query each second and look through the lines that come
+   back for the probe's answer, passing along any startup messages from
+   the probe ("[%WP] ...") and ignoring other chatter.  Opening the port
+   resets the Arduino, and it discards anything we send until its setup()
+   is done, so the first few queries normally go unanswered.  Returns
+   false if "tries" queries (0: no limit) go unanswered, or on ^C.
+*/
+static boolean syncWP(struct commPort *Uno, int tries) {
+  extern boolean keepReading;
+  unsigned char *lBuf;
+  boolean haveWP = false, heard;
+  struct timespec t0, t1;
+  int left, count=0;
 
-  RS232_PollComport(Uno->portNum, Uno->rBuf, rBufSize-1);   // clear buffer to start
   while (! haveWP ) {
-    if (! keepReading) exit(0);              // if ^C given at kbd, quit
+    if (! keepReading) return(false);        // if ^C given at kbd, quit
+    if (tries > 0 && count == tries) return(false);
     RS232_SendBuf(Uno->portNum, "WhoRU\n", 6);     // ask who's there
     count++;
-    sleep(1);
-    n = RS232_PollComport(Uno->portNum, Uno->rBuf, rBufSize-1);// get response
-    if (n>0) {                               // we're looking for "wp"
-      Uno->rBuf[n]=0;                        // make a NULL-terminated string
-      if ( (tolower(Uno->rBuf[0])=='w') && (tolower(Uno->rBuf[1])=='p') )
-          haveWP = true;
-        else 
-	  fprintf(stderr,"[%WS] WP invalid response after %d tries\n", count);
-    }
-    else {
-      fprintf(stderr,"[%WS] empty buffer after %d sec\n", count-1);
-    }; 
+    heard = false;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (left=1000; !haveWP && left>0; ) {   // take replies for up to a second
+      if ( waitForPort(Uno, left) )
+        while ( !haveWP && getDataLine(Uno, &lBuf) > 0 ) {
+          heard = true;
+          // we're looking for "wp<version>", not the "WP starting" banner
+          if ( (tolower(lBuf[0])=='w') && (tolower(lBuf[1])=='p') && isdigit(lBuf[2]) ) {
+            haveWP = true;
+            snprintf(Uno->version, sizeof(Uno->version), "%.*s",
+                     (int) strcspn((char *) lBuf, "\r\n"), lBuf);
+          }
+          else if (lBuf[0] == '[')
+            fprintf(stderr, "%s", lBuf);     // probe's own status message
+        };
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      left = 1000 - ((t1.tv_sec-t0.tv_sec)*1000 + (t1.tv_nsec-t0.tv_nsec)/1000000);
+    };
+    if (!haveWP && !keepReading) return(false);
+    if (!haveWP && !heard)
+      fprintf(stderr,"[%WS] empty buffer from %s after %d sec\n", Uno->devName, count);
   };
-  return(haveWP);
-};  // End boolean connectToWP(void)
+  return(true);
+};  // end syncWP()
+
+/* Step the link speed up, one rate at a time.  For each rate:
+     o  we send "baud <rate>"; the probe acknowledges at the old rate and
+        switches.  A probe that doesn't know the command (an older WP)
+        answers with its help text instead, and we stay where we are.  If
+        it then answers "WhoRU" at the old rate, it's still there; if not,
+        it may have switched with only its answer lost, and we wait out
+        the watchdog below.
+     o  we switch too, and check the link with baudChecks "WhoRU" round
+        trips, all of which must come back with the version string the
+        probe gave at baseBaud.
+     o  if they do, we send "baudok" and the probe keeps the new rate.
+        If they don't, we say nothing more: the probe goes back to the old
+        rate by itself when baudConfirmMs passes without a "baudok", and we
+        go back with it and stop climbing.
+   If the probe can't be reached even at the old rate after that, the port
+   is closed and reopened, which restarts the probe at baseBaud.  Returns
+   false, with the port closed, if that fails, or on ^C.  The waits are
+   waitOut()'s, which a ^C cuts short, since signals are taken only when
+   we look for them, and this may run from the event loop (rejoinProbe()).
+*/
+static boolean negotiateBaud(struct commPort *Uno, int tries) {
+  char cmd[32], want[32];
+  int i, n, prev;
+
+  for (i=0; baudRates[i]!=0 && baudRates[i]<=maxBaud; i++) {
+    if (baudRates[i] <= Uno->baudRate) continue;
+    prev = Uno->baudRate;
+    snprintf(cmd, sizeof(cmd), "baud %d\n", baudRates[i]);
+    snprintf(want, sizeof(want), "[%%WP] baud %d", baudRates[i]);
+    if ( !gotReply(Uno, cmd, want, 1000) ) {        // probe can't change rate, or
+      if ( !gotReply(Uno, "WhoRU\n", Uno->version, 500)  //   we missed its reply: let
+	   && !waitOut(Uno, baudConfirmMs+500) ) {      //   it time out if it did change
+	RS232_CloseComport(Uno->portNum);
+	return(false);
+      };
+      resetDataLines(Uno);
+      break;
+    };
+    if ( RS232_SetBaudrate(Uno->portNum, baudRates[i]) ) break;
+    resetDataLines(Uno);
+    Uno->baudRate = baudRates[i];
+    for (n=0; n<baudChecks && gotReply(Uno, "WhoRU\n", Uno->version, 500); n++) ;
+    if (n == baudChecks && gotReply(Uno, "baudok\n", "[%WP] baudok", 500)) continue;
+
+    /* The link isn't good at this rate: wait out the probe's watchdog, then
+       both of us are back at the old rate                                  */
+    fprintf(stderr, "[%WS] Link to %s unreliable at %d baud; using %d\n",
+	    Uno->devName, baudRates[i], prev);
+    if ( !waitOut(Uno, baudConfirmMs+500) ) {
+      RS232_CloseComport(Uno->portNum);
+      return(false);
+    };
+    RS232_SetBaudrate(Uno->portNum, prev);
+    resetDataLines(Uno);
+    Uno->baudRate = prev;
+    if ( !gotReply(Uno, "WhoRU\n", Uno->version, 1000) ) {
+      fprintf(stderr, "[?WS] Lost the probe on %s; restarting it at %d baud\n",
+	      Uno->devName, baseBaud);
+      RS232_CloseComport(Uno->portNum);
+      if ( RS232_OpenComport(Uno->portNum, baseBaud, Uno->commMode) ) {
+	fprintf(stderr, "[?WS] Cannot reopen %s\n", Uno->devName);
+	return(false);
+      };
+      Uno->baudRate = baseBaud;
+      resetDataLines(Uno);
+      if ( !syncWP(Uno, tries) ) {
+	RS232_CloseComport(Uno->portNum);
+	return(false);
+      };
+    };
+    break;
+  };
+  fprintf(stderr, "[%WS] Probe on %s at %d baud\n", Uno->devName, Uno->baudRate);
+  return(true);
+};  // end negotiateBaud()
+
+/* Start of startStream()
+ *------------------------------------------------------------------------------
+ * Asks the probe to take a sample every "secs" seconds on its own and push
+ * each one, numbered, the first a period from now.  Returns false if it
+ * doesn't know how (an older WP): it must then be asked for each sample.
+*/
+boolean startStream(struct commPort *Uno, int secs) {
+  char cmd[32], want[32];
+
+  snprintf(cmd, sizeof(cmd), "stream %d\n", secs);
+  snprintf(want, sizeof(want), "[%%WP] stream %d", secs);
+  return( gotReply(Uno, cmd, want, 1000) );
+}; // end startStream()
+
+/* Wait "ms" msec, throwing away whatever the probe sends meanwhile, but
+   stop at once on ^C: returns false if that came                         */
+static boolean waitOut(struct commPort *Uno, int ms) {
+  extern boolean keepReading;
+  unsigned char *lBuf;
+  struct timespec t0, t1;
+  int left;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (left=ms; left>0 && keepReading; ) {
+    if ( waitForPort(Uno, left) )
+      while ( getDataLine(Uno, &lBuf) > 0 ) ;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    left = ms - ((t1.tv_sec-t0.tv_sec)*1000 + (t1.tv_nsec-t0.tv_nsec)/1000000);
+  };
+  return(keepReading);
+};
+
+/* Send "cmd" and wait up to timeoutMs for a line starting with "want"
+   (ignoring case), passing the probe's other status messages along        */
+static boolean gotReply(struct commPort *Uno, char *cmd, char *want, int timeoutMs) {
+  unsigned char *lBuf;
+  struct timespec t0, t1;
+  int left, n = strlen(want);
+
+  RS232_SendBuf(Uno->portNum, (unsigned char *) cmd, strlen(cmd));
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (left=timeoutMs; left>0; ) {
+    if ( waitForPort(Uno, left) )
+      while ( getDataLine(Uno, &lBuf) > 0 ) {
+	if (strncasecmp((char *) lBuf, want, n) == 0) return(true);
+	if (lBuf[0] == '[') fprintf(stderr, "%s", lBuf);
+      };
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    left = timeoutMs - ((t1.tv_sec-t0.tv_sec)*1000 + (t1.tv_nsec-t0.tv_nsec)/1000000);
+  };
+  return(false);
+};  // end gotReply()
@@ -0,0 +1,204 @@
+/*  dbBench.c
+    Micro-benchmark for the WeatherStation database path.
+
+    Appends the same synthetic probe samples to fresh databases, first
+    the way ws used to (open the database or connect to the server, paste
+    the sample into an INSERT string, exec it, close/disconnect -- for every
+    row), then parsed by parseSample() and through appendToDB() with the
+    database held open and the INSERT prepared once, binding the typed
+    values, committing each row as it comes, and finally
+    the same way but committing "batch" rows per transaction.  It reports
+    rows/second for each.
+
+    Usage:  dbbench [-n rows] [-b batch] [directory | database]
+            rows defaults to 1000, batch to 64 (at most dbBatchMax).
+            sqlite3: the scratch database files are created in directory
+              (default /tmp) and removed afterward.  Put them on the SD
+              card to see the cost of the open/close/fsync cycle.
+            MySQL: the scratch databases <database>_old and <database>_new
+              (default weather_bench) are created on the server named in
+              WS.h, using the WS.h account, and dropped afterward; that
+              account needs CREATE and DROP privileges.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "WS.h"
+
+#ifndef USE_SQLITE3
+  #ifndef USE_MYSQL
+    #define USE_SQLITE3
+  #endif
+#endif
+
+extern char *dbName;
+extern int dbBatchRows;
+#define legacyCols "INSERT INTO ProbeData (date_time, mpl_press, mpl_temp, dht22_temp, dht22_rh," \
+                   "ds18_1_lbl, ds18_1_temp,ds18_2_lbl, ds18_2_temp,ds18_3_lbl, ds18_3_temp, ds18_4_lbl, ds18_4_temp) "
+
+static double elapsed(struct timespec *t0) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return( (t1.tv_sec-t0->tv_sec) + (t1.tv_nsec-t0->tv_nsec)/1e9 );
+};
+
+/* Build the n-th sample line just as the probe would send it in csv mode */
+static void makeSample(int n, char *lbuf) {
+  time_t t = 1504270388 + 300*(time_t)n;    // 2017-09-01, 5-minute samples
+  char dt[20];
+
+  strftime(dt, sizeof(dt), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+  sprintf(lbuf, "('%s',%d,%.1f,%.1f,%d,'IN',%.1f,'OU',%.1f,'**',00.0,'**',00.0)\n",
+	  dt, 85266-(n%50), 73.9+(n%7)/10.0, 74.1-(n%5)/10.0, 26+(n%3),
+	  72.5+(n%4)/10.0, 36.1+(n%9)/10.0);
+};
+
+#ifdef USE_SQLITE3
+/* The original path: open, exec a pasted INSERT, and close for each row */
+static void legacyAppend(char *dbFile, char *lbuf) {
+  char sqlString[300], *zErrMsg = 0;
+  sqlite3 *ldb;
+
+  if ( sqlite3_open(dbFile, &ldb) ) {
+    fprintf(stderr, "[?WS] Can't open database file '%s'\n", dbFile);
+    exit(EXIT_FAILURE);
+  };
+  strcpy(sqlString, legacyCols "VALUES ");
+  strcat(sqlString, lbuf);
+  if ( sqlite3_exec(ldb, sqlString, NULL, 0, &zErrMsg) != SQLITE_OK ) {
+    fprintf(stderr, "[?WS] SQL error during row insert: %s\n", zErrMsg);
+    exit(EXIT_FAILURE);
+  };
+  sqlite3_close(ldb);
+};
+#endif
+
+#ifdef USE_MYSQL
+/* Connect to the server named in WS.h, optionally selecting a database */
+static MYSQL *connectTo(char *dbase) {
+  MYSQL *conn;
+
+  if ( (conn=mysql_init(NULL)) == NULL
+       || mysql_real_connect(conn, myHost, myUsrName, myPwd, dbase, 0, NULL, 0) == NULL ) {
+    fprintf(stderr, "[?WS] Can't connect to MySQL server: %s\n", conn ? mysql_error(conn) : "");
+    exit(EXIT_FAILURE);
+  };
+  return(conn);
+};
+
+/* Run one statement on conn, or quit with the server's complaint */
+static void query(MYSQL *conn, char *fmt, char *arg) {
+  char sqlString[512];
+
+  snprintf(sqlString, sizeof(sqlString), fmt, arg);
+  if ( mysql_query(conn, sqlString) != 0 ) {
+    fprintf(stderr, "[?WS] MySQL statement failed: %s\n\t%s\n", sqlString, mysql_error(conn));
+    exit(EXIT_FAILURE);
+  };
+};
+
+/* The original path: connect, query a pasted INSERT, and close for each row */
+static void legacyAppend(char *dbase, char *lbuf) {
+  MYSQL *conn = connectTo(dbase);
+
+  query(conn, legacyCols "VALUES %s", lbuf);
+  mysql_close(conn);
+};
+#endif
+
+int main(int argc, char *argv[]) {
+  char oldDB[256], newDB[256];
+  unsigned char lbuf[lBufSize];
+  struct wsSample smp;
+  struct timespec t0;
+  double tOld, tNew, tBatch;
+  int c, i, rows = 1000, batch = 64;
+#ifdef USE_SQLITE3
+  char *where = "/tmp";
+#endif
+#ifdef USE_MYSQL
+  char *where = "weather_bench";
+  MYSQL *admin;
+#endif
+
+  while ( (c=getopt(argc, argv, "n:b:")) != -1 )
+    switch (c) {
+      case 'n':
+	rows = atoi(optarg);
+	break;
+      case 'b':
+	batch = atoi(optarg);
+	break;
+      default:
+	fprintf(stderr, "Usage: dbbench [-n rows] [-b batch] [directory | database]\n");
+	exit(EXIT_FAILURE);
+    };
+  if (optind < argc) where = argv[optind];
+  if (rows <= 0) rows = 1000;
+  if (batch <= 0 || batch > dbBatchMax) batch = 64;
+
+#ifdef USE_SQLITE3
+  snprintf(oldDB, sizeof(oldDB), "%s/dbbench-open-%d.db", where, (int) getpid());
+  snprintf(newDB, sizeof(newDB), "%s/dbbench-prep-%d.db", where, (int) getpid());
+#endif
+#ifdef USE_MYSQL
+  snprintf(oldDB, sizeof(oldDB), "%s_old", where);
+  snprintf(newDB, sizeof(newDB), "%s_new", where);
+  admin = connectTo(NULL);
+  query(admin, "CREATE DATABASE IF NOT EXISTS %s", oldDB);
+  query(admin, "CREATE DATABASE IF NOT EXISTS %s", newDB);
+#endif
+
+  /* Create both tables with initDBMgr() so the schemas are identical */
+  dbName = oldDB;
+  initDBMgr();
+  closeDBMgr();
+  dbName = newDB;
+  initDBMgr();
+
+  dbBatchRows = 1;                          // commit every row
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i=0; i<rows; i++) {
+    makeSample(i, (char *) lbuf);
+    if ( parseSample((char *) lbuf, &smp, NULL) ) appendToDB(0, &smp);
+  };
+  flushDB();
+  tNew = elapsed(&t0);
+
+  dbBatchRows = batch;                      // commit a batch at a time
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i=rows; i<2*rows; i++) {
+    makeSample(i, (char *) lbuf);
+    if ( parseSample((char *) lbuf, &smp, NULL) ) appendToDB(0, &smp);
+  };
+  closeDBMgr();
+  tBatch = elapsed(&t0);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i=0; i<rows; i++) {
+    makeSample(i, (char *) lbuf);
+    legacyAppend(oldDB, (char *) lbuf);
+  };
+  tOld = elapsed(&t0);
+
+  printf("%-28s %8d rows %9.3f sec %10.1f rows/sec\n", "open/exec/close per row", rows, tOld, rows/tOld);
+  printf("%-28s %8d rows %9.3f sec %10.1f rows/sec %7.1fx\n", "persistent + prepared",
+	 rows, tNew, rows/tNew, tOld/tNew);
+  printf("%-24s%4d %8d rows %9.3f sec %10.1f rows/sec %7.1fx\n", "  + batched commits of", batch,
+	 rows, tBatch, rows/tBatch, tOld/tBatch);
+#ifdef USE_SQLITE3
+  unlink(oldDB);
+  unlink(newDB);
+#endif
+#ifdef USE_MYSQL
+  query(admin, "DROP DATABASE %s", oldDB);
+  query(admin, "DROP DATABASE %s", newDB);
+  mysql_close(admin);
+#endif
+  exit(EXIT_SUCCESS);
+};
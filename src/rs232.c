@@ -41,13 +41,16 @@
 #if defined(__linux__) || defined(__FreeBSD__)   /* Linux & FreeBSD */
 
 
-int Cport[38],
+#define RS232_FIXED_PORTS 38       /* named in comports[]; the rest are for RS232_GetPortnr() */
+#define RS232_PORTS       42
+
+int Cport[RS232_PORTS],
     error;
 
 struct termios new_port_settings,
-       old_port_settings[38];
+       old_port_settings[RS232_PORTS];
 
-char comports[38][16]={"/dev/ttyS0","/dev/ttyS1","/dev/ttyS2","/dev/ttyS3","/dev/ttyS4","/dev/ttyS5",
+char comports[RS232_PORTS][32]={"/dev/ttyS0","/dev/ttyS1","/dev/ttyS2","/dev/ttyS3","/dev/ttyS4","/dev/ttyS5",
                        "/dev/ttyS6","/dev/ttyS7","/dev/ttyS8","/dev/ttyS9","/dev/ttyS10","/dev/ttyS11",
                        "/dev/ttyS12","/dev/ttyS13","/dev/ttyS14","/dev/ttyS15","/dev/ttyUSB0",
                        "/dev/ttyUSB1","/dev/ttyUSB2","/dev/ttyUSB3","/dev/ttyUSB4","/dev/ttyUSB5",
@@ -56,16 +59,9 @@ char comports[38][16]={"/dev/ttyS0","/dev/ttyS1","/dev/ttyS2","/dev/ttyS3","/dev
                        "/dev/cuau0","/dev/cuau1","/dev/cuau2","/dev/cuau3",
                        "/dev/cuaU0","/dev/cuaU1","/dev/cuaU2","/dev/cuaU3"};
 
-int RS232_OpenComport(int comport_number, int baudrate, const char *mode)
+static int baud_to_speed(int baudrate)   /* 9600 -> B9600, or -1 */
 {
-  int baudr,
-      status;
-
-  if((comport_number>37)||(comport_number<0))
-  {
-    printf("illegal comport number\n");
-    return(1);
-  }
+  int baudr;
 
   switch(baudrate)
   {
@@ -129,11 +125,33 @@ int RS232_OpenComport(int comport_number, int baudrate, const char *mode)
                    break;
     case 4000000 : baudr = B4000000;
                    break;
-    default      : printf("invalid baudrate\n");
-                   return(1);
+    default      : baudr = -1;
                    break;
   }
 
+  return(baudr);
+}
+
+
+
+int RS232_OpenComport(int comport_number, int baudrate, const char *mode)
+{
+  int baudr,
+      status;
+
+  if((comport_number>=RS232_PORTS)||(comport_number<0)||(!comports[comport_number][0]))
+  {
+    printf("illegal comport number\n");
+    return(1);
+  }
+
+  baudr = baud_to_speed(baudrate);
+  if(baudr == -1)
+  {
+    printf("invalid baudrate\n");
+    return(1);
+  }
+
   int cbits=CS8,
       cpar=0,
       ipar=IGNPAR,
@@ -232,6 +250,10 @@ http://man7.org/linux/man-pages/man3/termios.3.html
 
   if(ioctl(Cport[comport_number], TIOCMGET, &status) == -1)
   {
+    if(errno == ENOTTY || errno == EINVAL)
+    {
+      return(0);  /* a pty (e.g., a simulated probe): no modem lines to set */
+    }
     perror("unable to get portstatus");
     return(1);
   }
@@ -255,10 +277,105 @@ int RS232_PollComport(int comport_number, unsigned char *buf, int size)
 
   n = read(Cport[comport_number], buf, size);
 
+  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+  {
+    return(0);  /* nothing waiting */
+  }
+
+  /* bytes read; 0 if none are waiting (VMIN and VTIME are 0) or the tty
+     has hung up, which only poll()/epoll() can tell apart; or -1 with
+     errno set, e.g., EIO once the device is gone */
   return(n);
 }
 
 
+int RS232_SetBaudrate(int comport_number, int baudrate)  /* change speed, port stays open */
+{
+  int baudr;
+
+  struct termios settings;
+
+  baudr = baud_to_speed(baudrate);
+  if(baudr == -1)
+  {
+    printf("invalid baudrate\n");
+    return(1);
+  }
+
+  if(tcgetattr(Cport[comport_number], &settings) == -1)
+  {
+    perror("unable to read portsettings ");
+    return(1);
+  }
+
+  cfsetispeed(&settings, baudr);
+  cfsetospeed(&settings, baudr);
+
+  if(tcsetattr(Cport[comport_number], TCSADRAIN, &settings) == -1)
+  {
+    perror("unable to adjust portsettings ");
+    return(1);
+  }
+
+  tcflush(Cport[comport_number], TCIFLUSH);  /* whatever came at the old speed */
+
+  return(0);
+}
+
+
+int RS232_GetPortFd(int comport_number)   /* descriptor for poll()/epoll() */
+{
+  return(Cport[comport_number]);
+}
+
+
+int RS232_GetPortnr(const char *devname)  /* "ttyACM0" or "/dev/ttyACM0" -> 24 */
+{
+  int i;
+
+  char str[32];
+
+  if(devname[0] != '/')
+  {
+    strcpy(str, "/dev/");
+    strncat(str, devname, 26);
+  }
+  else
+  {
+    strncpy(str, devname, 31);
+  }
+  str[31] = 0;
+
+  for(i=0; i<RS232_PORTS; i++)
+  {
+    if(!strcmp(comports[i], str))
+    {
+      return(i);
+    }
+  }
+
+  /* Not a port we know by name, e.g., the pty of a simulated probe:
+     if it's a character device, give it one of the spare entries */
+  struct stat st;
+
+  if((stat(str, &st) == -1) || (!S_ISCHR(st.st_mode)))
+  {
+    return(-1);  /* device not found */
+  }
+
+  for(i=RS232_FIXED_PORTS; i<RS232_PORTS; i++)
+  {
+    if(!comports[i][0])
+    {
+      strcpy(comports[i], str);
+      return(i);
+    }
+  }
+
+  return(-1);  /* no spare entries left */
+}
+
+
 int RS232_SendByte(int comport_number, unsigned char byte)
 {
   int n;
@@ -282,15 +399,20 @@ void RS232_CloseComport(int comport_number)
 
   if(ioctl(Cport[comport_number], TIOCMGET, &status) == -1)
   {
-    perror("unable to get portstatus");
-  }
-
-  status &= ~TIOCM_DTR;    /* turn off DTR */
-  status &= ~TIOCM_RTS;    /* turn off RTS */
-
-  if(ioctl(Cport[comport_number], TIOCMSET, &status) == -1)
+    if(errno != ENOTTY && errno != EINVAL && errno != EIO && errno != ENODEV)
+    {
+      perror("unable to get portstatus");
+    }
+  }  /* a pty has no modem lines, and an unplugged device none left */
+  else
   {
-    perror("unable to set portstatus");
+    status &= ~TIOCM_DTR;    /* turn off DTR */
+    status &= ~TIOCM_RTS;    /* turn off RTS */
+
+    if(ioctl(Cport[comport_number], TIOCMSET, &status) == -1)
+    {
+      perror("unable to set portstatus");
+    }
   }
 
   tcsetattr(Cport[comport_number], TCSANOW, old_port_settings + comport_number);
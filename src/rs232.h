@@ -51,6 +51,7 @@ extern "C" {
 #include <termios.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -64,6 +65,9 @@ extern "C" {
 
 int RS232_OpenComport(int, int, const char *);
 int RS232_PollComport(int, unsigned char *, int);
+int RS232_GetPortFd(int);
+int RS232_SetBaudrate(int, int);
+int RS232_GetPortnr(const char *);
 int RS232_SendByte(int, unsigned char);
 int RS232_SendBuf(int, unsigned char *, int);
 void RS232_CloseComport(int);
@@ -0,0 +1,382 @@
+/*  wpsim.c
+    WeatherProbe simulator, for testing ws without an Arduino.
+
+    wpsim opens a pseudo-terminal and behaves at its end the way WP does
+    at the end of the USB serial line: it answers the commands in
+    cmdNames[] in WP/WP.h (whoru, sample, report, csv, xmlstart, xmlstop,
+    binary, settime, baud, stream, latest, ...) and reports synthetic sensor readings in
+    the same formats, so ws can be run against it by naming the pty (or
+    a link to it) with -p.  To load-test ingest, wpsim can also send
+    samples on its own at a fixed rate -- thousands per second if asked --
+    with random delays and with a fraction of them corrupted or lost in
+    transit.
+
+    Usage:  wpsim [-l link] [-r rate] [-j jitter] [-c corrupt] [-x lose] [-s step] [-d ds18] [-f fail]
+            -l link     also make "link" a symbolic link to the pty, e.g. /tmp/ttyWP
+            -r rate     once ws has asked for a sample, keep sending "rate"
+                        samples/sec without being asked (default 0: only on "sample")
+            -j jitter   delay each sample by a random 0-"jitter" msec
+            -c corrupt  corrupt "corrupt" percent of samples (one byte changed)
+            -x lose     lose "lose" percent of samples altogether (not sent)
+            -s step     advance the probe clock "step" seconds per sample, so
+                        that fast samples have distinct times (default: the
+                        clock follows real time, as the probe's RTC does)
+            -d ds18     number of DS18 probes present, 0-4 (default 2)
+            -f fail     the DHT22 fails to read, as a real one now and then
+                        does, for "fail" percent of samples: its readings are NaN
+    ^C or SIGTERM stops wpsim, which reports how much it sent.
+
+    Then, e.g.:  ./wpsim -l /tmp/ttyWP -r 1000 -s 1 &
+                 ./ws -p /tmp/ttyWP sql
+    or, for samples the probe pushes every second, numbered, a few lost:
+                 ./wpsim -l /tmp/ttyWP -x 5 &
+                 ./ws -p /tmp/ttyWP -t 1 rpt
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <termios.h>
+#include "WS.h"
+
+/* The probe's command set, in the order of cmdNames[] in WP/WP.h */
+typedef enum {vers=0, csample, creport, ccsv, cxmlstart, cxmlstop, cwhoru, chelp,
+	      csettime, crestart, cbinary, cbaudok, cbaud, cstream, clatest, noCmd} cmds;
+static const char *cmdNames[] = {"version", "sample", "report", "csv",
+				 "xmlstart", "xmlstop", "whoru", "help",
+				 "settime", "restart", "binary", "baudok",
+				 "baud", "stream", "latest", "unrecognized"};
+typedef enum {none=0, report, csv, xml, binary} rptModes;
+#define Vers "WP5.4 DB3.0"
+
+static int mfd = -1;                       // our end of the pty
+static rptModes reportMode = report;
+static double jitter = 0, corrupt = 0, lose = 0, step = 0, dhtFail = 0;
+static int nDS18 = 2;
+static long nTaken, nSent, nCorrupt, nLost, nCmds;
+static struct wsSample lastSmp;            // the last sample taken, for "latest"
+static struct timespec lastAt;             //   and when
+#define refreshMs 60000                    // WP samples this often unasked (UPDATE_DELAY)
+static int streamSecs = 0;                 // "stream <seconds>": push a sample this often
+static unsigned long streamSeq;            //   numbered from 1
+static struct timespec streamNext;         //   the next one due
+static time_t clockBase;                   // probe clock at sample 0 (step>0)
+static long clockOffset;                   //   or its offset from real time
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig) { running = 0; };
+
+/* Write all of buf to the pty.  This waits while the pty is full (no one is
+   reading), much as the probe's serial output would, until told to stop.  */
+static void sendOut(const void *buf, int len) {
+  const char *p = buf;
+  int n;
+
+  while (len > 0 && running) {
+    if ( (n=write(mfd, p, len)) < 0 ) {
+      if (errno == EINTR) continue;
+      perror("[?WPSIM] Can't write to pty");
+      exit(EXIT_FAILURE);
+    };
+    p += n;
+    len -= n;
+  };
+};
+
+static void sendLine(const char *s) {
+  sendOut(s, strlen(s));
+  sendOut("\r\n", 2);
+};
+
+/* Fill in the n-th sample as readSensors() would: the time from the probe
+   clock, smoothly varying readings, and '**' for absent DS18s             */
+static void makeSample(long n, struct wsSample *s) {
+  static const char *labels[dsMax] = {"IN", "OU", "GA", "BA"};
+  time_t t;
+  int i;
+
+  t = step>0 ? clockBase + (time_t) (n*step) : time(NULL) + clockOffset;
+  strftime(s->dt, sizeof(s->dt), "%Y-%m-%d %H:%M:%S", localtime(&t));
+  s->mplPress = floor(101325 + 400*sin(n/500.0));
+  s->mplTemp  = round(10*(68 + 10*sin(n/300.0)))/10;
+  s->mplAlt   = round(10*(169 + sin(n/50.0)))/10;
+  s->dhtTemp  = round(10*(s->mplTemp + 0.4))/10;
+  s->dhtRH    = round(45 + 20*sin(n/700.0));
+  if ( dhtFail > 0 && 100.0*random()/RAND_MAX < dhtFail )
+    s->dhtTemp = s->dhtRH = NAN;              // as the DHT library reports it
+  for (i=0; i<dsMax; i++) {
+    if (i < nDS18) {
+      strcpy(s->dsLabel[i], labels[i]);
+      s->dsTemp[i] = round(10*(i==1 ? 35 + 15*sin(n/400.0) : s->mplTemp + i))/10;
+    }
+    else {
+      strcpy(s->dsLabel[i], "**");
+      s->dsTemp[i] = 0.0;
+    };
+  };
+};
+
+/* Take the next sample, keeping it for "latest", as loop() in WP.ino does */
+static struct wsSample *takeSample(void) {
+  makeSample(nTaken++, &lastSmp);
+  clock_gettime(CLOCK_MONOTONIC, &lastAt);
+  return(&lastSmp);
+};
+
+/* Report sample "smp" in the current mode, perhaps late, perhaps damaged,
+   perhaps not at all, after the line "tag" if there is one: WP numbers
+   the samples it pushes, and says how old its latest one is            */
+static void sendSample(struct wsSample *smp, const char *tag) {
+  static const storeModes asStored[] = {noMode, rptMode, sqlMode, xmlMode};
+  char out[sBufSize];
+  int len = 0;
+
+  if (reportMode == none) return;
+  if ( lose > 0 && 100.0*random()/RAND_MAX < lose ) {
+    nLost++;
+    return;
+  };
+  if (tag) sendLine(tag);
+  if (reportMode == binary) {
+    encodeFrame(smp, (unsigned char *) out);
+    len = frameLen;
+  }
+  else
+    len = formatSample(asStored[reportMode], smp, out, sizeof(out));
+  if (len <= 0) return;
+  if ( corrupt > 0 && 100.0*random()/RAND_MAX < corrupt ) {
+    out[random() % len] ^= 1 + random() % 255;
+    nCorrupt++;
+  };
+  if (jitter > 0) usleep( (useconds_t) (1000*jitter*random()/RAND_MAX) );
+  sendOut(out, len);
+  nSent++;
+};
+
+/* Msec from "now" until "t", or 0 if it has passed */
+static int msUntil(struct timespec *now, struct timespec *t) {
+  long ms = (t->tv_sec-now->tv_sec)*1000 + (t->tv_nsec-now->tv_nsec)/1000000;
+
+  return( ms<0 ? 0 : ms );
+};
+
+static boolean isDue(struct timespec *now, struct timespec *t) {
+  return( now->tv_sec > t->tv_sec || (now->tv_sec == t->tv_sec && now->tv_nsec >= t->tv_nsec) );
+};
+
+/* What WP prints as it starts up */
+static void banner(void) {
+  sendLine("WP starting");
+  sendLine("[%WP] TFT not found");
+  sendLine("[%WP] RTC is NOT connected!  Emulating clock.");
+  sendLine("<!-- Arduino-Based Weather Probe for Raspberry Pi -->");
+};
+
+/* Act on one command line, as loop() in WP.ino does.  Returns true for "sample" */
+static boolean doCommand(char *cmdString) {
+  char msg[80];
+  struct tm tm;
+  struct timespec now;
+  int cmd;
+  long baud, secs, ms;
+
+  nCmds++;
+  for (cmd=0; cmd<noCmd && strncasecmp(cmdString, cmdNames[cmd], strlen(cmdNames[cmd])); cmd++) ;
+  switch (cmd) {
+    case vers:
+    case cwhoru:
+      sendLine(Vers);
+      break;
+    case csample:
+      sendSample(takeSample(), NULL);
+      return(true);
+    case clatest:                          // what it took last, on its timer if not asked
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      ms = (now.tv_sec-lastAt.tv_sec)*1000 + (now.tv_nsec-lastAt.tv_nsec)/1000000;
+      if (nTaken == 0 || ms >= refreshMs) {
+	takeSample();
+	ms = nTaken==1 ? 0 : ms % refreshMs;
+      };
+      snprintf(msg, sizeof(msg), "@%ld", ms);
+      sendSample(&lastSmp, msg);
+      break;
+    case creport:
+      reportMode = report;
+      break;
+    case ccsv:
+      reportMode = csv;
+      break;
+    case cxmlstart:
+      reportMode = xml;
+      sendLine("<?xml version=\"1.0\" ?>");
+      sendLine("<!DOCTYPE samples SYSTEM \"weather_data.dtd\">");
+      sendLine("<samples>");
+      break;
+    case cxmlstop:
+      reportMode = none;
+      sendLine("</samples>");
+      break;
+    case cbinary:
+      reportMode = binary;
+      break;
+    case csettime:
+      memset(&tm, 0, sizeof(tm));
+      if ( strlen(cmdString) < 27 || strptime(cmdString+8, "%Y-%m-%d %H:%M:%S", &tm) == NULL ) {
+	snprintf(msg, sizeof(msg), "[%%WP] setTime called with bad input string = '%s'", cmdString+8);
+	sendLine(msg);
+	break;
+      };
+      tm.tm_isdst = -1;
+      clockOffset = mktime(&tm) - time(NULL);
+      clockBase = mktime(&tm) - (time_t) (nTaken*step);
+      break;
+    case crestart:
+      reportMode = report;
+      banner();
+      break;
+    case cbaud:                            // a pty has no speed: just agree
+      baud = atol(cmdString+5);
+      if (baud!=9600 && baud!=115200 && baud!=230400 && baud!=500000) {
+	sendLine("[?WP] Unsupported baud rate");
+	break;
+      };
+      snprintf(msg, sizeof(msg), "[%%WP] baud %ld", baud);
+      sendLine(msg);
+      break;
+    case cbaudok:
+      sendLine("[%WP] baudok");
+      break;
+    case cstream:
+      secs = atol(cmdString+6);            // seconds between samples; 0 stops
+      if (secs < 0 || secs > streamMax) {
+	sendLine("[?WP] Unsupported stream period");
+	break;
+      };
+      snprintf(msg, sizeof(msg), "[%%WP] stream %ld", secs);
+      sendLine(msg);
+      streamSecs = secs;
+      streamSeq = 0;
+      clock_gettime(CLOCK_MONOTONIC, &streamNext);
+      streamNext.tv_sec += streamSecs;     // the first a period from now
+      break;
+    default:
+      sendOut("Command, one of: ", 17);
+      for (cmd=0; cmd<noCmd; cmd++) {
+	sendOut(cmdNames[cmd], strlen(cmdNames[cmd]));
+	sendOut(" | ", 3);
+      };
+      sendLine("?");
+      break;
+  };
+  return(false);
+};
+
+int main(int argc, char *argv[]) {
+  char *link = NULL, *pts, line[256], buf[256], tag[24];
+  struct termios tio;
+  struct sigaction sa;
+  struct pollfd pfd;
+  struct timespec now, next;
+  double rate = 0;
+  boolean pushing = false;
+  int c, n, i, sfd, lineLen = 0, timeout;
+
+  while ( (c=getopt(argc, argv, "l:r:j:c:x:s:d:f:")) != -1 )
+    switch (c) {
+      case 'l': link = optarg;          break;
+      case 'r': rate = atof(optarg);    break;
+      case 'j': jitter = atof(optarg);  break;
+      case 'c': corrupt = atof(optarg); break;
+      case 'x': lose = atof(optarg);    break;
+      case 's': step = atof(optarg);    break;
+      case 'd': nDS18 = atoi(optarg);   break;
+      case 'f': dhtFail = atof(optarg); break;
+      default:
+	fprintf(stderr, "Usage: wpsim [-l link] [-r rate] [-j jitter] [-c corrupt] [-x lose] [-s step] [-d ds18] [-f fail]\n");
+	exit(EXIT_FAILURE);
+    };
+  if (nDS18 < 0 || nDS18 > dsMax) nDS18 = 2;
+
+  /* Open the pty, and hold its other end open ourselves so that it stays
+     usable as ws comes and goes; make it raw, like the probe's port      */
+  if ( (mfd=posix_openpt(O_RDWR|O_NOCTTY)) < 0 || grantpt(mfd) || unlockpt(mfd)
+       || (pts=ptsname(mfd)) == NULL || (sfd=open(pts, O_RDWR|O_NOCTTY)) < 0 ) {
+    perror("[?WPSIM] Can't create pty");
+    exit(EXIT_FAILURE);
+  };
+  tcgetattr(sfd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(sfd, TCSANOW, &tio);
+  if (link) {
+    unlink(link);
+    if ( symlink(pts, link) ) {
+      perror("[?WPSIM] Can't link to pty");
+      exit(EXIT_FAILURE);
+    };
+  };
+  printf("wpsim: probe on %s%s%s\n", pts, link ? " = " : "", link ? link : "");
+  fflush(stdout);
+
+  sa.sa_handler = stop;                     // no SA_RESTART: interrupt a blocked write
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  srandom(time(NULL));
+  clockBase = time(NULL);
+  banner();
+
+  pfd.fd = mfd;
+  pfd.events = POLLIN;
+  while (running) {
+    timeout = -1;                           // when is the next sample due?
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (pushing) timeout = msUntil(&now, &next);
+    if (streamSecs > 0 && (timeout < 0 || msUntil(&now, &streamNext) < timeout))
+      timeout = msUntil(&now, &streamNext);
+    if ( (n=poll(&pfd, 1, timeout)) < 0 && errno != EINTR ) break;
+    if ( n > 0 && (n=read(mfd, buf, sizeof(buf))) > 0 )
+      for (i=0; i<n; i++) {                 // assemble and obey command lines
+	if (buf[i] != '\n') {
+	  if (buf[i] != '\r' && lineLen < (int) sizeof(line)-1) line[lineLen++] = buf[i];
+	  continue;
+	};
+	line[lineLen] = 0;
+	lineLen = 0;
+	if ( doCommand(line) && rate > 0 && !pushing ) {
+	  pushing = true;                   // first "sample": start the stream
+	  clock_gettime(CLOCK_MONOTONIC, &next);
+	};
+      };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (streamSecs > 0 && isDue(&now, &streamNext)) {   // the probe's own timer
+      snprintf(tag, sizeof(tag), "#%lu", ++streamSeq);
+      sendSample(takeSample(), tag);
+      streamNext.tv_sec += streamSecs;
+    };
+    if (pushing) {                          // send whatever samples are due
+      while ( running && isDue(&now, &next) ) {
+	sendSample(takeSample(), NULL);
+	next.tv_nsec += (long) (1e9/rate);
+	next.tv_sec += next.tv_nsec / 1000000000;
+	next.tv_nsec %= 1000000000;
+      };
+    };
+  };
+
+  fprintf(stderr, "[%%WPSIM] %ld samples sent (%ld corrupted, %ld more lost), %ld commands received\n",
+	  nSent, nCorrupt, nLost, nCmds);
+  if (link) unlink(link);
+  exit(EXIT_SUCCESS);
+};
@@ -0,0 +1,171 @@
+/*  wsq.c
+    Query and export tool for WeatherStation data.
+
+    Answers "field X from T1 to T2 at resolution R" from whichever store
+    ws records to -- the ProbeData table (sqlite3 or MySQL, as compiled),
+    or the column store of "ws ts" -- and writes the answer as CSV, JSON,
+    or binary, for a chart or another program.  Only the one field and
+    date_time are read, by a range of ProbeData's key or of the column
+    store's block index, and buckets of whole hours or days come from the
+    rollup tables; see WS-Query.c, which ws's HTTP server shares.
+
+    Downsampling is by:
+      lttb    Largest-Triangle-Three-Buckets, to at most -n points that
+              keep the shape of the series for a line chart
+      minmax  the min and max in each bucket of -r seconds (or -n buckets)
+      avg     the mean, and the count, in each bucket
+      raw     every sample (the default without -r or -n)
+
+    Usage:  wsq [-d database | -t tsdir] [-p probe] [-s start] [-e end]
+                [-r resolution | -n points] [-a raw|lttb|minmax|avg]
+                [-o csv|json|bin] field
+            start and end are "yyyy-mm-dd[ hh:mm[:ss]]", "now", or relative
+              to now, e.g., -168h, -7d (default -24h to now)
+            resolution is seconds, or with m, h, d, or w, e.g., 1h
+            wsq -l [-p probe] [-o csv|json]
+
+    "wsq -l" prints instead the current conditions -- each probe's latest
+    sample -- from the copy ws keeps in shared memory (see WS-Latest.c),
+    without going near the database.
+
+    Binary output is "WSQ1", an int32 count k of values per record, then
+    records of an int64 time (epoch seconds) and k doubles, little-endian.
+
+    Written by HDTodd, hdtodd@gmail.com, for use with WeatherStation.c
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "WS.h"
+
+#ifdef USE_SQLITE3
+  #ifndef DBName
+    #define DBName sqlite3DB
+  #endif
+#endif
+
+/* Start of latest()
+ *------------------------------------------------------------------------------
+ * -l: prints each probe's latest sample (or probe "probe"'s), as ws published it
+*/
+static void latest(int probe, char *format) {
+  struct latestShm *ls = latestMap();
+  struct latestSlot slot;
+  struct wsSample *s = &slot.sample;
+  char buf[1024];
+  int i, j, n = 0;
+
+  if (ls == NULL) {
+    fprintf(stderr, "[?WSQ] ws isn't publishing its latest samples in /dev/shm%s\n", latestShmName);
+    exit(EXIT_FAILURE);
+  };
+  if (ls->pid == 0) fprintf(stderr, "[%WSQ] ws has stopped; these are the last samples it recorded\n");
+  if (strcmp(format, "json") == 0) printf("{\"samples\":[");
+  else {
+    printf("probe_id,date_time,recorded_ms,mpl_press,mpl_temp,dht22_temp,dht22_rh");
+    for (j=1; j<=dsMax; j++) printf(",ds18_%d_lbl,ds18_%d_temp", j, j);
+    printf("\n");
+  };
+  for (i=0; i<maxProbes; i++) {
+    if ( (probe >= 0 && i != probe) || !latestRead(ls, i, &slot) ) continue;
+    if (strcmp(format, "json") == 0) {
+      if (latestJSON(i, &slot, buf, sizeof(buf)) > 0) printf("%s%s", n++ ? "," : "", buf);
+      continue;
+    };
+    printf("%d,%s,%lld,%.10g,%.10g,%.10g,%.10g", i, s->dt, slot.recordedMs,
+	   s->mplPress, s->mplTemp, s->dhtTemp, s->dhtRH);
+    for (j=0; j<dsMax; j++) printf(",%s,%.10g", s->dsLabel[j], s->dsTemp[j]);
+    printf("\n");
+  };
+  if (strcmp(format, "json") == 0) printf("]}\n");
+  exit(EXIT_SUCCESS);
+}; // end latest()
+
+static void usage(void) {
+  printf("wsq: query WeatherStation data\n");
+  printf("\twsq [-d database | -t tsdir] [-p probe] [-s start] [-e end]\n");
+  printf("\t    [-r resolution | -n points] [-a raw|lttb|minmax|avg] [-o csv|json|bin] field\n");
+  printf("\treads field (e.g., mpl_press, dht22_temp, ds18_1_temp) from start to end\n");
+  printf("\t(\"yyyy-mm-dd[ hh:mm[:ss]]\", \"now\", or e.g. -168h, -7d; default -24h to now)\n");
+  printf("\tfrom ProbeData (default %s) or from the \"ws ts\" column store in tsdir,\n",
+#ifdef USE_MYSQL
+	 myDB);
+#else
+	 DBName);
+#endif
+  printf("\tand writes it, downsampled to points with lttb or to buckets of resolution\n");
+  printf("\t(e.g., 3600 or 1h) with minmax or avg, as CSV, JSON, or binary\n");
+  printf("\twsq -l [-p probe] [-o csv|json]\n");
+  printf("\tprints the current conditions: each probe's latest sample, from ws\n");
+  exit(EXIT_SUCCESS);
+};
+
+int main(int argc, char *argv[]) {
+#ifdef USE_MYSQL
+  char *dbase = myDB;
+#else
+  char *dbase = DBName;
+#endif
+  char *tsDir = NULL, *format = "csv";
+  const char *why;
+  struct wsQuery q;
+  boolean ok, wantLatest = false;
+  int c;
+
+  memset(&q, 0, sizeof(q));
+  q.probe = -1;
+  q.t1 = time(NULL);
+  q.t0 = q.t1 - 86400;
+  while ( (c=getopt(argc, argv, "a:d:e:ln:o:p:r:s:t:")) != -1 )
+    switch (c) {
+      case 'a':
+	if (strcmp(optarg, "raw") == 0) q.mode = aRaw;
+	else if (strcmp(optarg, "lttb") == 0) q.mode = aLTTB;
+	else if (strcmp(optarg, "minmax") == 0) q.mode = aMinMax;
+	else if (strcmp(optarg, "avg") == 0) q.mode = aAvg;
+	else usage();
+	break;
+      case 'd': dbase = optarg; break;
+      case 'l': wantLatest = true; break;
+      case 't': tsDir = optarg; break;
+      case 'p': q.probe = atoi(optarg); break;
+      case 'n': q.points = atol(optarg); break;
+      case 'r':
+	if ( (q.width=wsqSeconds(optarg)) <= 0 ) usage();
+	break;
+      case 'o':
+	format = optarg;
+	if (strcmp(format, "csv") && strcmp(format, "json") && strcmp(format, "bin")) usage();
+	break;
+      case 's':
+      case 'e':
+	if ( (c == 's' ? (q.t0=wsqTime(optarg)) : (q.t1=wsqTime(optarg))) < 0 ) {
+	  fprintf(stderr, "[?WSQ] %s isn't a time wsq understands\n", optarg);
+	  exit(EXIT_FAILURE);
+	};
+	break;
+      default:
+	usage();
+    };
+  if (wantLatest) latest(q.probe, strcmp(format, "json") == 0 ? "json" : "csv");
+  if (optind != argc-1) usage();
+  if (strlen(argv[optind]) >= sizeof(q.field)) {
+    fprintf(stderr, "[?WSQ] Can't query %s: no field has a name that long\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  };
+  strcpy(q.field, argv[optind]);
+  if ( !wsqPrepare(&q, &why) ) {
+    fprintf(stderr, "[?WSQ] Can't query %s: %s\n", argv[optind], why);
+    exit(EXIT_FAILURE);
+  };
+
+  ok = tsDir ? wsqReadTS(&q, tsDir) : wsqReadSQL(&q, dbase);
+  if (!ok) exit(EXIT_FAILURE);
+  wsqDownsample(&q);
+  wsqOutput(&q, stdout, format);
+  wsqFree(&q);
+  exit(EXIT_SUCCESS);
+};